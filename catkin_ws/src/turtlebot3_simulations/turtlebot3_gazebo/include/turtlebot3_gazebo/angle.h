@@ -0,0 +1,30 @@
+#ifndef ANGLE_H_
+#define ANGLE_H_
+
+#include <cmath>
+
+#ifndef PI
+#define PI 3.14159265
+#endif
+
+// Rounds turns to the nearest integer. Adding and subtracting 1.5 * 2^(mantissa bits) does it for magnitudes below
+// 2^51 (double) or 2^22 (float) with plain additions, where std::round() and std::floor() need SSE4.1 or a libm call.
+// Relies on IEEE arithmetic, so don't build with -ffast-math, which folds it away. Other types use std::nearbyint().
+template <typename Scalar>
+inline Scalar angleRoundTurns(Scalar turns) { return std::nearbyint(turns); }
+template <>
+inline double angleRoundTurns<double>(double turns) { return (turns + 6755399441055744.0) - 6755399441055744.0; }
+template <>
+inline float angleRoundTurns<float>(float turns) { return (turns + 12582912.0f) - 12582912.0f; }
+
+// Wrap an angle to [-PI, PI] by removing the nearest whole number of turns. No branches, no fmod.
+// Same as the former fmod based normalizeAngle() to rounding, for |angle| up to about 1e15 in double. Exactly at +-PI
+// either end may come out, which was already the case.
+template <typename Scalar>
+inline Scalar normalizeAngle(Scalar angle)
+{
+    Scalar turns = angleRoundTurns<Scalar>(angle * Scalar(1.0/(2*PI)));
+    return angle - Scalar(2*PI) * turns;
+}
+
+#endif // ANGLE_H_
@@ -0,0 +1,82 @@
+#ifndef EKF_CAPTURE_H_
+#define EKF_CAPTURE_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_slam.h"
+
+// Compact binary capture of the filter inputs, for replaying runs offline without ROS (see ekf_replay).
+// Layout, in host byte order:
+//   header: char magic[4] = "EKFC", uint32 version
+//   records: uint8 type, float64 stamp [s], then per type
+//     CAPTURE_MOTION:  float64 linVel, float64 angVel                                   (/cmd_vel)
+//     CAPTURE_MARKERS: uint32 count, count x (int32 landmarkId, float64 range, float64 bearing)  (Aruco markers)
+//     CAPTURE_TRUTH:   float64 x, float64 y, float64 th, in the filter's frame              (Gazebo /odom)
+// Records are in stamp order.
+#define EKF_CAPTURE_VERSION 1
+#define EKF_CAPTURE_MAX_OBSERVATIONS 4096 // Per CAPTURE_MARKERS record, well above the markers or clusters of a frame
+
+enum CaptureRecordType
+{
+    CAPTURE_MOTION = 1,
+    CAPTURE_MARKERS = 2,
+    CAPTURE_TRUTH = 3
+};
+
+struct CaptureRecord
+{
+    int type;
+    double stamp;
+    double linVel;
+    double angVel;
+    double x;
+    double y;
+    double th;
+    std::vector<LandmarkObservation> observations;
+};
+
+class CaptureWriter
+{
+
+private:
+    std::ofstream file;
+
+public:
+    CaptureWriter() {};
+    ~CaptureWriter() {};
+
+    bool open(const std::string &path);
+    void writeMotion(double stamp, double linVel, double angVel);
+    void writeMarkers(double stamp, const std::vector<LandmarkObservation> &observations);
+    void writeTruth(double stamp, double x, double y, double th);
+    void close() { file.close(); };
+    bool good() const { return file.good(); };
+};
+
+class CaptureReader
+{
+
+private:
+    std::ifstream file;
+    int numRecords; // Read so far
+    bool bError;
+
+    bool fail(const char *reason);
+
+public:
+    CaptureReader() : numRecords(0), bError(false) {};
+    ~CaptureReader() {};
+
+    // Returns false if the file can't be opened or is not a capture
+    bool open(const std::string &path);
+    // Reads the next record into record, reusing its observations storage. Returns false at the end of the capture,
+    // and also on a truncated or corrupt record, after which failed() is set and nothing more is read.
+    bool next(CaptureRecord &record);
+    // Whether reading stopped on a bad record rather than at the end of the file
+    bool failed() const { return bError; };
+    int getNumRecords() const { return numRecords; };
+};
+
+#endif // EKF_CAPTURE_H_
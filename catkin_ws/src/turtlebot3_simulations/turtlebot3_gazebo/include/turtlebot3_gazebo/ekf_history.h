@@ -0,0 +1,150 @@
+#ifndef EKF_HISTORY_H_
+#define EKF_HISTORY_H_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_slam.h"
+
+// History of the recent predictions of a filter, for fusing out of sequence measurements (OOSM) at their own time.
+//
+// Aruco markers reach the filter tens of ms after the image was taken, by when a few /cmd_vel predictions have
+// already been applied. The history keeps a fixed capacity ring of checkpoints, one per prediction: the stamp, the
+// motion that was applied and the robot block of the filter from before it (robot states, Sigma_rr and the
+// composed motion Jacobians that stand for Sigma_rm, see EkfSlam::getRobotBlock()). That is all a prediction
+// changes, so it costs O(1) per prediction.
+//
+// A late measurement then goes:
+//   history.rewind(ekf, stamp);   // undo the predictions newer than stamp
+//   ... correction step(s) ...
+//   history.replay(ekf);          // apply them again, from the corrected state
+// rewind() goes back to the checkpoint of the first prediction newer than stamp, ie. to the end of the last
+// prediction at or before it, so the measurement is fused up to one /cmd_vel period (10 ms at 100Hz) early. Splitting
+// that prediction at stamp would add the motion noise R of one more step for every late marker.
+//
+// A correction changes the landmark rows that the checkpoints don't hold, so the checkpoints from before it can't be
+// restored any more. replay() takes the checkpoints of the predictions it applies again from the corrected filter
+// and drops the older ones, so the next marker can still be fused at its own time as long as it isn't older than
+// the last one. That is the usual case, where the camera latency is longer than its frame period and every frame
+// comes late. A measurement older than the last correction, or older than the oldest checkpoint, gets fused at the
+// current time as before and is counted as too old.
+template <typename Filter>
+class EkfHistory
+{
+
+public:
+    typedef typename Filter::RobotBlock RobotBlock;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    struct Checkpoint
+    {
+        double stamp; // Of the prediction
+        double linVel;
+        double angVel;
+        double deltaT;
+        RobotBlock robot; // From before the prediction
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    std::vector<Checkpoint, Eigen::aligned_allocator<Checkpoint> > ring;
+    int head; // Oldest checkpoint
+    int count;
+    int numRewound; // Newest checkpoints undone by rewind(), that replay() applies again
+    bool bOverflowed; // Checkpoints were overwritten since the last correction
+    double lastCorrectionStamp; // Time the last correction was fused at
+    double correctionStamp; // Time the correction between rewind() and replay() is fused at
+    int numLate;
+    int numTooOld;
+
+    Checkpoint &at(int i) { return ring[(head + i) % ring.size()]; };
+
+public:
+    explicit EkfHistory(int capacity) :
+    ring(std::max(capacity, 1)),
+    head(0),
+    count(0),
+    numRewound(0),
+    bOverflowed(false),
+    lastCorrectionStamp(-std::numeric_limits<double>::max()),
+    correctionStamp(-std::numeric_limits<double>::max()),
+    numLate(0),
+    numTooOld(0)
+    {};
+
+    ~EkfHistory() {};
+
+    int getNumLate() const { return numLate; };
+    int getNumTooOld() const { return numTooOld; };
+
+    // Prediction step through the history, so that it can be undone again
+    void predict(Filter &ekf, double stamp, double linVel, double angVel, double deltaT)
+    {
+        if(count == (int)ring.size())
+        {
+            head = (head + 1) % ring.size();
+            count -= 1;
+            bOverflowed = true;
+        }
+        Checkpoint &cp = at(count);
+        count += 1;
+        cp.stamp = stamp;
+        cp.linVel = linVel;
+        cp.angVel = angVel;
+        cp.deltaT = deltaT;
+        ekf.getRobotBlock(cp.robot);
+        ekf.predict(linVel, angVel, deltaT);
+    };
+
+    // Undoes the predictions newer than stamp, ie. takes the filter back to when the measurement was taken.
+    // Returns the number of predictions undone.
+    int rewind(Filter &ekf, double stamp)
+    {
+        int first = count;
+        while(first > 0 && at(first-1).stamp > stamp)
+        {
+            first -= 1;
+        }
+        numRewound = 0;
+        if(first == count)
+        {
+            correctionStamp = stamp; // In order, the filter is already at its time
+            return 0;
+        }
+
+        numLate += 1;
+        if(stamp < lastCorrectionStamp || (first == 0 && bOverflowed))
+        {
+            numTooOld += 1;
+            correctionStamp = at(count-1).stamp;
+            return 0;
+        }
+
+        ekf.setRobotBlock(at(first).robot);
+        numRewound = count - first;
+        correctionStamp = stamp;
+        return numRewound;
+    };
+
+    // Applies the predictions undone by rewind() again, after the correction step. Their checkpoints are taken again
+    // on the way, from the corrected filter, and become the new history.
+    void replay(Filter &ekf)
+    {
+        for(int i = count - numRewound; i < count; ++i)
+        {
+            Checkpoint &cp = at(i);
+            ekf.getRobotBlock(cp.robot);
+            ekf.predict(cp.linVel, cp.angVel, cp.deltaT);
+        }
+        head = (head + count - numRewound) % ring.size();
+        count = numRewound;
+        bOverflowed = false; // The oldest checkpoint left starts at the correction
+        lastCorrectionStamp = std::max(lastCorrectionStamp, correctionStamp);
+        numRewound = 0;
+    };
+};
+
+#endif // EKF_HISTORY_H_
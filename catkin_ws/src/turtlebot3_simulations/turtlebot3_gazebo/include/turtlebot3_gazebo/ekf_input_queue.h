@@ -0,0 +1,78 @@
+#ifndef EKF_INPUT_QUEUE_H_
+#define EKF_INPUT_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_slam.h"
+
+enum EkfInputType
+{
+    INPUT_MOTION = 1,
+    INPUT_MARKERS = 2
+};
+
+// One input of the filter, as queued by the ROS callbacks
+struct EkfInput
+{
+    int type;
+    double stamp; // [s] Header stamp of the measurement, or receive time for inputs without a header (/cmd_vel)
+    double linVel; // INPUT_MOTION
+    double angVel;
+    std::vector<LandmarkObservation> observations; // INPUT_MARKERS
+};
+
+// Bounded multi producer, single consumer queue of filter inputs, handed to the consumer in stamp order.
+//
+// Producers (the ROS callbacks, on any spinner thread) only take the lock to swap their input into a preallocated
+// slot, so they never wait on the filter. Inputs are swapped rather than copied: push() hands back the storage of
+// an older input, so a producer that reuses its EkfInput doesn't allocate once the observation vectors have grown.
+// If the consumer falls so far behind that the queue is full, push() drops the input and counts it.
+//
+// The consumer (the filter thread) gets inputs from pop() sorted by stamp. Since the camera stamps its markers when
+// the image was taken, they arrive later than /cmd_vel sent at the same time. So pop() holds inputs back until
+// newer ones have arrived reorderWindow later, or nothing has arrived for reorderWindow. An input that is older
+// than one already handed out is still handed out, but counted as late.
+class EkfInputQueue
+{
+
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::vector<EkfInput> slots; // Ring of capacity slots, the count queued start at head
+    int head;
+    int count;
+    bool bClosed;
+    unsigned long numDropped;
+    std::chrono::steady_clock::time_point lastArrival;
+
+    // Consumer side only, inputs taken off the ring and waiting to be handed out in stamp order
+    std::vector<EkfInput> pending; // Min heap on stamp
+    std::vector<EkfInput> spare; // Storage handed back by pop(), swapped into the slots as they get emptied
+    double reorderWindow;
+    double newestStamp;
+    double lastPoppedStamp;
+    unsigned long numLate;
+
+    void takeQueued();
+
+public:
+    EkfInputQueue(int capacity, double reorderWindow);
+    ~EkfInputQueue() {};
+
+    // Producer side. input gets the storage of an older input back. Returns false if the queue was full or closed.
+    bool push(EkfInput &input);
+
+    // Consumer side. Waits for the next input in stamp order. Returns false once the queue is closed and empty.
+    bool pop(EkfInput &input);
+
+    // Wakes up the consumer, which then gets the inputs still queued and false after them
+    void close();
+
+    unsigned long getNumDropped();
+    unsigned long getNumLate() const { return numLate; };
+};
+
+#endif // EKF_INPUT_QUEUE_H_
@@ -0,0 +1,962 @@
+#ifndef EKF_SLAM_H_
+#define EKF_SLAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/angle.h" // normalizeAngle() and PI
+#include "turtlebot3_gazebo/ekf_trace.h"
+
+// A (range, bearing) observation of a landmark, eg. one Aruco marker
+struct LandmarkObservation
+{
+    int landmarkId;
+    double range;
+    double bearing;
+    // Covariance of (range, bearing), eg. from the spread of the returns of a lidar cluster. Only used by EkfSlam
+    // if bCovariance is set, it uses its sensor noise Q otherwise, as do the other backends. Left unaligned, so that
+    // observations can go in plain std::vectors.
+    Eigen::Matrix<double, 2, 2, Eigen::DontAlign> covariance;
+    bool bCovariance;
+
+    LandmarkObservation() : landmarkId(-1), range(0), bearing(0), bCovariance(false) {};
+};
+
+// Largest number of landmarks for which the full state and variances are stored in fixed size Eigen types.
+// Beyond this the matrices get too big to live inside the filter object, so EkfSlam falls back to dynamic storage.
+#define EKF_SLAM_MAX_FIXED_LANDMARKS 16
+
+// Unscented mode (EkfSlam::setUnscented()). Kappa 0 puts no weight on the center sigma point, so that the sigma
+// point covariances stay positive semidefinite whatever the state size. The floor is added to the variances the
+// sigma points are drawn from, so that they stay apart along directions with no variance, eg. the initial pose.
+#define EKF_UKF_KAPPA 0.0
+#define EKF_UKF_FLOOR 1e-9 // [m^2, rad^2]
+// Largest spread of the robot and landmark sigma points, as a fraction of the range, that an observation is
+// linearized with them. Wider ones, eg. a landmark just added with its landmarkPriorVariance prior, would put sigma
+// points behind the robot, so the observation is linearized at the mean as by the EKF, which also initializes the
+// landmark from it.
+#define EKF_UKF_MAX_SPREAD 0.5
+
+
+// Flat copies of the states and variances, eg. for the data of a Float64MultiArray. The variances are packed row
+// major as per the MultiArray docs. data is resized to fit, so reusing it across calls avoids reallocating.
+void packStates(const Eigen::Ref<const Eigen::VectorXd> &states, std::vector<double> &data);
+void packRowMajor(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<double> &data);
+// Compact forms of the variances: the 2x2 marginal of each landmark (row major, 4 per landmark), and the upper
+// triangle row by row ((n*(n+1))/2 values). float is plenty for plotting and gating, and halves the size again.
+void packLandmarkMarginals(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<float> &data);
+// Same layout from the marginals alone, the 2x2 blocks of a 2 x 2*numLandmarks matrix (see SlamBackend::getLandmarkMarginals())
+void packMarginalBlocks(const Eigen::Ref<const Eigen::MatrixXd> &marginals, std::vector<float> &data);
+void packUpperTriangle(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<float> &data);
+
+// Velocity motion model of one pose at heading th: the change delta of (x, y, th) for (linVel, angVel) over deltaT,
+// and the robot block Gr = I + Delta of its Jacobian. The robot moves straight below angVelThresh. The one copy of
+// the model for every backend, EkfSlam::motionModel() is its batched form for the sigma points.
+template <typename Scalar>
+void velocityMotion(Scalar th, Scalar linVel, Scalar angVel, Scalar deltaT, Scalar angVelThresh,
+                    Eigen::Matrix<Scalar, 3, 1> &delta, Eigen::Matrix<Scalar, 3, 3> &Gr)
+{
+    Gr.setIdentity();
+    if (std::abs(angVel) > angVelThresh)
+    {
+        Scalar r = linVel/angVel;
+
+        //?? ADD other condition of angles
+        delta << -r*std::sin(th) + r*std::sin(th + angVel*deltaT),
+                 +r*std::cos(th) - r*std::cos(th + angVel*deltaT),
+                 angVel*deltaT;
+        // Derivative of X and Y wrt Th. derivTh = 1 got from Identity addition
+        Gr(0,2) = -r*std::cos(th) + r*std::cos(th + angVel*deltaT);
+        Gr(1,2) = -r*std::sin(th) + r*std::sin(th + angVel*deltaT);
+    }
+    else
+    {
+        Scalar dist = linVel*deltaT;
+        // ADD other condition of angles
+        delta << -dist*std::cos(th), dist*std::sin(th), 0;
+        Gr(0,2) = dist*std::sin(th);
+        Gr(1,2) = dist*std::cos(th);
+    }
+}
+
+
+// EKF SLAM core for the velocity motion model with 2D point landmarks observed as (range, bearing).
+// State layout: [x, y, th, m0x, m0y, m1x, m1y, ...] where mi is the landmark in slot i.
+//
+// Landmarks are added on their first sighting and get the next free slot, so the state only holds landmarks that
+// have actually been seen. landmarkSlots maps the landmark id (eg. Aruco id) to its slot, so sparse ids such as 1023
+// only cost one slot. Only the top left numTotStates block of the state and variances storage is in use.
+//
+// NumLandmarks is the number of landmarks the storage is sized for. For small maps (<= EKF_SLAM_MAX_FIXED_LANDMARKS)
+// the storage is fixed size, so there is no heap traffic, and landmarks beyond NumLandmarks are rejected.
+// With Eigen::Dynamic (or large NumLandmarks) the storage starts at the capacity passed to the constructor and
+// grows geometrically, so the variances are only copied when the capacity doubles and not on every new landmark.
+// The per landmark kernels (2x5 H, 2x2 innovation, 5x5 observed block) are always fixed size.
+//
+// In unscented mode the motion and observation models are not linearized by their hand derived Jacobians, but by
+// sigma points pushed through the same model functions (motionModel(), measurementModel()), all points of a step at
+// once as Eigen array expressions. The block structure is kept: a prediction draws its 7 sigma points from the 3x3
+// robot block only, and a correction its 11 from the 5x5 robot and landmark block. The regression Jacobian of the
+// sigma points, Pyx * Pxx^-1, then takes the place of Gr and H, so that the cross terms go through crossGr and the
+// low rank or batched correction steps as for the EKF, O(1) per prediction and O(numTotStates^2) per correction.
+// What the Jacobian leaves out of the sigma point covariance (the curvature of the model) is added to the motion
+// noise or to the innovation covariance.
+template <int NumLandmarks, typename Scalar = double>
+class EkfSlam
+{
+
+public:
+    enum
+    {
+        NumModelStates = 3,
+        NumComponents = 2,
+        NumObservedStates = NumModelStates + NumComponents,
+        bFixedSize = (NumLandmarks != Eigen::Dynamic && NumLandmarks <= EKF_SLAM_MAX_FIXED_LANDMARKS),
+        NumTotStates = bFixedSize ? (NumModelStates + NumComponents*NumLandmarks) : Eigen::Dynamic
+    };
+
+    typedef Eigen::Matrix<Scalar, NumTotStates, 1> StateVector;
+    typedef Eigen::Matrix<Scalar, NumTotStates, NumTotStates> CovarianceMatrix;
+    typedef Eigen::Matrix<Scalar, NumTotStates, NumComponents> GainMatrix;
+    typedef Eigen::Matrix<Scalar, NumModelStates, NumModelStates> ModelMatrix;
+    typedef Eigen::Matrix<Scalar, NumModelStates, 1> ModelVector;
+    typedef Eigen::Matrix<Scalar, NumComponents, NumComponents> MeasurementMatrix;
+    typedef Eigen::Matrix<Scalar, NumComponents, 1> MeasurementVector;
+    typedef Eigen::Matrix<Scalar, NumComponents, NumObservedStates> JacobianMatrix;
+    typedef Eigen::Matrix<Scalar, NumObservedStates, 1> ObservedVector;
+    typedef Eigen::Matrix<Scalar, NumObservedStates, NumObservedStates> ObservedMatrix;
+    typedef Eigen::VectorBlock<const StateVector> ConstStateBlock;
+    typedef Eigen::Block<const CovarianceMatrix> ConstCovarianceBlock;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    int numLandmarks; // Landmarks currently in the state
+    int numTotStates; // States currently in use
+    int landmarkCapacity; // Landmarks the storage has room for
+
+    StateVector states;
+    // The robot-landmark cross terms Sigma_rm (and Sigma_mr) of variances lag behind the predictions: the true
+    // Sigma_rm is crossGr * Sigma_rm, see predictVariances(). Brought up to date by flushCrossVariances(), which is
+    // why they are mutable.
+    mutable CovarianceMatrix variances;
+    mutable ModelMatrix crossGr; // Composed motion Jacobian of the predictions not applied to Sigma_rm yet
+    mutable ModelMatrix flushedGr; // Composed crossGr of the flushes since the last correction, for setRobotBlock()
+    std::unordered_map<int, int> landmarkSlots; // (landmarkId, slot)
+    std::vector<int> landmarkIds; // landmarkId of each slot
+    Scalar landmarkPriorVariance;
+
+    ModelMatrix RmotionCovar;
+    MeasurementMatrix QsensorCovar;
+    Scalar angVelThresh;
+
+    // Scratch space for the correction step, kept around so that dynamic sized filters don't allocate per marker
+    GainMatrix PHt;
+    GainMatrix K;
+    Eigen::LDLT<MeasurementMatrix> innovationLdlt;
+
+    // Correction steps whose innovation covariance is numerically singular (reciprocal condition number below
+    // minInnovationRcond) or fails to factorize are rejected and counted
+    Scalar minInnovationRcond;
+    int numRejectedUpdates;
+
+    // Scratch space for the batched correction step, grown to the most markers seen in one frame
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DynamicMatrix;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> DynamicVector;
+    DynamicMatrix batchPHt;
+    DynamicMatrix batchKt;
+    DynamicMatrix batchS;
+    DynamicVector batchInnovation;
+    Eigen::LDLT<DynamicMatrix> batchLdlt;
+    std::vector<JacobianMatrix, Eigen::aligned_allocator<JacobianMatrix> > batchH;
+    std::vector<MeasurementMatrix, Eigen::aligned_allocator<MeasurementMatrix> > batchResidual; // See linearizeObservation()
+    std::vector<int> batchStateIdx;
+    std::vector<int> batchObservationIdx;
+
+    bool bBatchCorrection; // update() fuses all observations of a frame in one joint correction step
+    bool bDenseCorrection; // Use the O(N^3) dense correction step. Reference for checking the low rank correction step against
+    bool bUnscented; // Linearize with sigma points instead of the Jacobians, see above
+
+    // atan2 of two arrays, which Eigen has no array function for
+    struct Atan2Op
+    {
+        Scalar operator()(Scalar y, Scalar x) const { return std::atan2(y, x); };
+    };
+
+public:
+    // Fixed size storage ignores the capacity and always has room for NumLandmarks
+    explicit EkfSlam(int initialCapacity = (NumLandmarks == Eigen::Dynamic ? 8 : NumLandmarks)) :
+    numLandmarks(0),
+    numTotStates(NumModelStates),
+    landmarkCapacity(bFixedSize ? NumLandmarks : std::max(initialCapacity, 1)),
+    states(StateVector::Zero(NumModelStates + NumComponents*landmarkCapacity)),
+    variances(CovarianceMatrix::Zero(NumModelStates + NumComponents*landmarkCapacity, NumModelStates + NumComponents*landmarkCapacity)),
+    crossGr(ModelMatrix::Identity()),
+    flushedGr(ModelMatrix::Identity()),
+    landmarkPriorVariance(std::numeric_limits<float>::max()),
+    RmotionCovar(ModelMatrix::Zero()),
+    QsensorCovar(MeasurementMatrix::Zero()),
+    angVelThresh(0.001),
+    PHt(NumModelStates + NumComponents*landmarkCapacity, NumComponents),
+    K(NumModelStates + NumComponents*landmarkCapacity, NumComponents),
+    minInnovationRcond(std::numeric_limits<Scalar>::epsilon()),
+    numRejectedUpdates(0),
+    bBatchCorrection(1),
+    bDenseCorrection(0),
+    bUnscented(0)
+    {
+        landmarkIds.reserve(landmarkCapacity);
+        landmarkSlots.reserve(landmarkCapacity);
+    };
+
+    ~EkfSlam() {};
+
+    void setMotionNoise(const ModelMatrix &R) { RmotionCovar = R; };
+    void setSensorNoise(const MeasurementMatrix &Q) { QsensorCovar = Q; };
+    void setAngVelThresh(Scalar thresh) { angVelThresh = thresh; };
+    void setBatchCorrection(bool bBatch) { bBatchCorrection = bBatch; };
+    void setDenseCorrection(bool bDense) { bDenseCorrection = bDense; };
+    void setUnscented(bool bUkf) { bUnscented = bUkf; };
+    void setMinInnovationRcond(Scalar rcond) { minInnovationRcond = rcond; };
+
+    int getNumLandmarks() const { return numLandmarks; };
+    int getNumTotStates() const { return numTotStates; };
+    int getLandmarkCapacity() const { return landmarkCapacity; };
+    ConstStateBlock getStates() const { return states.head(numTotStates); };
+    // Brings the cross terms up to date first, O(numTotStates) if there were predictions since. Undoes the saving of
+    // the lazy predictions if called after each of them, so meant for the covariance publishing rate.
+    ConstCovarianceBlock getVariances() const
+    {
+        flushCrossVariances();
+        return static_cast<const CovarianceMatrix &>(variances).topLeftCorner(numTotStates, numTotStates);
+    };
+    // Sigma_rr, which every prediction keeps up to date, so no flush
+    ModelMatrix getRobotVariances() const { return variances.template topLeftCorner<NumModelStates, NumModelStates>(); };
+    const std::vector<int> &getLandmarkIds() const { return landmarkIds; };
+    int getNumRejectedUpdates() const { return numRejectedUpdates; };
+
+    static int slotStateIdx(int slot) { return NumModelStates + NumComponents*slot; };
+
+    // Slot of a landmark in the state, -1 if it hasn't been added yet
+    int landmarkSlot(int landmarkId) const
+    {
+        std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(landmarkId);
+        return it == landmarkSlots.end() ? -1 : it->second;
+    };
+
+    // Index of the landmark's x state, -1 if it hasn't been added yet
+    int landmarkStateIdx(int landmarkId) const
+    {
+        int slot = landmarkSlot(landmarkId);
+        return slot < 0 ? -1 : slotStateIdx(slot);
+    };
+
+    void setRobotPose(Scalar x, Scalar y, Scalar th)
+    {
+        states(0) = x;
+        states(1) = y;
+        states(2) = th;
+    };
+
+    // Start over with no landmarks and the robot at (x, y, th) with zero variance, eg. for a new local submap.
+    // The storage and the noise settings are kept.
+    void reset(Scalar x, Scalar y, Scalar th)
+    {
+        numLandmarks = 0;
+        numTotStates = NumModelStates;
+        landmarkSlots.clear();
+        landmarkIds.clear();
+        setRobotPose(x, y, th);
+        variances.template topLeftCorner<NumModelStates, NumModelStates>().setZero();
+        crossGr.setIdentity();
+        flushedGr.setIdentity();
+    };
+
+    // Everything predict() changes: the robot states, Sigma_rr, and Sigma_rm through crossGr
+    struct RobotBlock
+    {
+        ModelVector states;
+        ModelMatrix variances; // Sigma_rr
+        ModelMatrix crossGr;
+        ModelMatrix flushedGr;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    // Saved before predictions so that they can be undone again, eg. for a measurement that arrives late. O(1), as
+    // Sigma_rm itself only changes at flushes, which flushedGr keeps track of.
+    void getRobotBlock(RobotBlock &block) const
+    {
+        block.states = states.template head<NumModelStates>();
+        block.variances = variances.template topLeftCorner<NumModelStates, NumModelStates>();
+        block.crossGr = crossGr;
+        block.flushedGr = flushedGr;
+    };
+
+    // Restores a block saved by getRobotBlock(), with no correction in between. Sigma_rm was then
+    // crossGr_saved * flushedGr_saved * Sigma_rm_0, and Sigma_rm is now flushedGr * Sigma_rm_0, so the cross terms
+    // come back with crossGr = crossGr_saved * flushedGr_saved * flushedGr^-1. Landmarks added since then have
+    // Sigma_rm = 0, which no crossGr changes, as they start out uncorrelated with the robot.
+    void setRobotBlock(const RobotBlock &block)
+    {
+        states.template head<NumModelStates>() = block.states;
+        variances.template topLeftCorner<NumModelStates, NumModelStates>() = block.variances;
+        crossGr = block.crossGr * block.flushedGr * flushedGr.inverse();
+    };
+
+    // Variance ("inf") given to the position of a landmark when it is added
+    void setLandmarkPriorVariance(Scalar INF) { landmarkPriorVariance = INF; };
+
+    bool isLandmarkSeen(int landmarkId) const
+    {
+        return landmarkSlots.count(landmarkId) > 0;
+    };
+
+    // Add a landmark that hasn't been seen before to the state, with its prior at a global position.
+    // The prior has landmarkPriorVariance along x and y, and no correlation with the robot or the other landmarks.
+    // Returns the slot of the landmark, or -1 if the (fixed size) storage is full.
+    int addLandmark(int landmarkId, Scalar landX, Scalar landY)
+    {
+        int slot = landmarkSlot(landmarkId);
+        if(slot >= 0)
+        {
+            return slot;
+        }
+
+        if(numLandmarks == landmarkCapacity)
+        {
+            if(bFixedSize)
+            {
+                std::cout << "No room left in the state for landmark: " << landmarkId << std::endl;
+                return -1;
+            }
+            reserveLandmarks(2*landmarkCapacity);
+        }
+
+        slot = numLandmarks;
+        int stateIdx = slotStateIdx(slot);
+        numLandmarks += 1;
+        numTotStates += NumComponents;
+        landmarkSlots[landmarkId] = slot;
+        landmarkIds.push_back(landmarkId);
+
+        states(stateIdx) = landX;
+        states(stateIdx+1) = landY;
+        // The storage beyond numTotStates can hold stale values from before, so clear the new rows and columns
+        variances.block(stateIdx, 0, NumComponents, numTotStates).setZero();
+        variances.block(0, stateIdx, numTotStates, NumComponents).setZero();
+        variances.template block<NumComponents, NumComponents>(stateIdx, stateIdx) = landmarkPriorVariance * MeasurementMatrix::Identity();
+        EKF_TRACE(TRACE_LANDMARK_ADDED, landmarkId, landX, landY, slot, landmarkCapacity);
+        return slot;
+    };
+
+    // Grow the storage to hold at least newCapacity landmarks. Only the part in use gets copied over.
+    void reserveLandmarks(int newCapacity)
+    {
+        if(bFixedSize || newCapacity <= landmarkCapacity)
+        {
+            return;
+        }
+
+        int newTotStates = NumModelStates + NumComponents*newCapacity;
+        StateVector newStates = StateVector::Zero(newTotStates);
+        CovarianceMatrix newVariances(newTotStates, newTotStates);
+        newStates.head(numTotStates) = states.head(numTotStates);
+        newVariances.topLeftCorner(numTotStates, numTotStates) = variances.topLeftCorner(numTotStates, numTotStates);
+        states.swap(newStates);
+        variances.swap(newVariances);
+
+        PHt.resize(newTotStates, NumComponents);
+        K.resize(newTotStates, NumComponents);
+        landmarkCapacity = newCapacity;
+        landmarkIds.reserve(newCapacity);
+        landmarkSlots.reserve(newCapacity);
+    };
+
+    // Global position of a landmark seen at (range, bearing) from the current robot pose
+    // u_jx = u_tx + r*cos(phi + u_tth)
+    // landmark_x = robot_x + r*cos(phi + robot_heading)
+    void landmarkFromObservation(Scalar range, Scalar bearing, Scalar &landX, Scalar &landY) const
+    {
+        landX = states(0) + range * std::cos(bearing + states(2));
+        landY = states(1) + range * std::sin(bearing + states(2));
+    };
+
+    // Velocity motion model, moving each column (x, y, th) of poses by (linVel, angVel) for deltaT. velocityMotion()
+    // for all the unscented sigma points at once. The headings are not wrapped, so that sigma points either side of
+    // +-PI stay next to each other.
+    template <typename Derived>
+    void motionModel(Eigen::MatrixBase<Derived> &poses, Scalar linVel, Scalar angVel, Scalar deltaT) const
+    {
+        typedef Eigen::Array<Scalar, 1, Derived::ColsAtCompileTime> RowArray;
+        RowArray th = poses.row(2).array();
+
+        if (std::abs(angVel) > angVelThresh)
+        {
+            Scalar r = linVel/angVel;
+
+            //?? ADD other condition of angles
+            RowArray thNext = th + angVel*deltaT;
+            poses.row(0).array() += -r*th.sin() + r*thNext.sin();
+            poses.row(1).array() += r*th.cos() - r*thNext.cos();
+            poses.row(2).array() = thNext;
+        }
+        else
+        {
+            Scalar dist = linVel*deltaT;
+            // ADD other condition of angles
+            poses.row(0).array() -= dist*th.cos();
+            poses.row(1).array() += dist*th.sin();
+        }
+    };
+
+    // Prediction step with the velocity motion model
+    void predict(Scalar linVel, Scalar angVel, Scalar deltaT)
+    {
+        if(!(bUnscented && predictUnscented(linVel, angVel, deltaT)))
+        {
+            // Jacobian of non-linear motion model: Gt = I + Fx^T * Gr * Fx, where Gr is the 3x3 robot block
+            ModelVector delta;
+            ModelMatrix Gr;
+            velocityMotion(states(2), linVel, angVel, deltaT, angVelThresh, delta, Gr);
+
+            states.template head<NumModelStates>() += delta;
+            states(2) = normalizeAngle(states(2));
+            predictVariances(Gr);
+        }
+        EKF_TRACE(TRACE_PREDICT, numTotStates, linVel, angVel, deltaT, states(2));
+    };
+
+    // Unscented prediction, from the sigma points of the robot block: Sigma_rr is their covariance plus R, and their
+    // regression Jacobian goes into crossGr in place of Gr. False, with nothing changed, if Sigma_rr is broken.
+    bool predictUnscented(Scalar linVel, Scalar angVel, Scalar deltaT)
+    {
+        ModelMatrix robotBlock = variances.template topLeftCorner<NumModelStates, NumModelStates>();
+        Eigen::Matrix<Scalar, NumModelStates, 2*NumModelStates+1> points;
+        ModelMatrix L;
+        if(!sigmaPoints(ModelVector(states.template head<NumModelStates>()), robotBlock, points, L))
+        {
+            return false;
+        }
+        motionModel(points, linVel, angVel, deltaT);
+
+        ModelVector mean;
+        ModelMatrix covariance;
+        ModelMatrix Gr;
+        unscentedMoments(points, L, mean, covariance, Gr);
+        mean(2) = normalizeAngle(mean(2));
+        states.template head<NumModelStates>() = mean;
+        variances.template topLeftCorner<NumModelStates, NumModelStates>() = covariance + RmotionCovar;
+        crossGr = Gr * crossGr;
+        return true;
+    };
+
+    // Sigma points of N(mean, P): column 0 is the mean, columns 1+j and 1+n+j are mean +- sqrt(n + kappa) * L_j,
+    // with L*L^T = P + floor*I. False if P + floor*I isn't positive definite.
+    template <int N>
+    bool sigmaPoints(const Eigen::Matrix<Scalar, N, 1> &mean, const Eigen::Matrix<Scalar, N, N> &P,
+                     Eigen::Matrix<Scalar, N, 2*N+1> &points, Eigen::Matrix<Scalar, N, N> &L) const
+    {
+        Eigen::LLT<Eigen::Matrix<Scalar, N, N> > llt(P + Scalar(EKF_UKF_FLOOR) * Eigen::Matrix<Scalar, N, N>::Identity());
+        if(llt.info() != Eigen::Success)
+        {
+            std::cout << "Variances not positive definite, unscented step replaced by the EKF one" << std::endl;
+            return false;
+        }
+        L = llt.matrixL();
+        Scalar c = std::sqrt(N + Scalar(EKF_UKF_KAPPA));
+        points.colwise() = mean;
+        points.template middleCols<N>(1) += c * L;
+        points.template rightCols<N>() -= c * L;
+        return true;
+    };
+
+    // Weighted mean and covariance of the sigma points Y = f(X) of sigmaPoints(), and their regression Jacobian
+    // J = Pyx * (P + floor*I)^-1 = [(Y_j+ - Y_j-) / (2*sqrt(n + kappa))] * L^-1. The covariance has J*floor*J^T taken
+    // back out, so it is J*P*J^T plus the curvature term that J leaves out, which is positive semidefinite for
+    // kappa = 0.
+    template <int M, int N>
+    void unscentedMoments(const Eigen::Matrix<Scalar, M, 2*N+1> &Y, const Eigen::Matrix<Scalar, N, N> &L,
+                          Eigen::Matrix<Scalar, M, 1> &mean, Eigen::Matrix<Scalar, M, M> &covariance,
+                          Eigen::Matrix<Scalar, M, N> &J) const
+    {
+        Scalar c = std::sqrt(N + Scalar(EKF_UKF_KAPPA));
+        Scalar weight0 = Scalar(EKF_UKF_KAPPA) / (N + Scalar(EKF_UKF_KAPPA));
+        Scalar weight = 1 / (2*(N + Scalar(EKF_UKF_KAPPA)));
+
+        mean = weight0 * Y.col(0) + weight * Y.template rightCols<2*N>().rowwise().sum();
+        Eigen::Matrix<Scalar, M, 2*N+1> deviations = Y.colwise() - mean;
+        covariance.noalias() = weight * deviations.template rightCols<2*N>() * deviations.template rightCols<2*N>().transpose();
+        covariance.noalias() += weight0 * deviations.col(0) * deviations.col(0).transpose();
+
+        // J * L = D, solved as L^T * J^T = D^T
+        Eigen::Matrix<Scalar, M, N> D = (Y.template middleCols<N>(1) - Y.template rightCols<N>()) / (2*c);
+        J.transpose() = L.transpose().template triangularView<Eigen::Upper>().solve(D.transpose());
+        covariance -= Scalar(EKF_UKF_FLOOR) * J * J.transpose();
+        covariance = Scalar(0.5) * (covariance + covariance.transpose());
+    };
+
+    // Variance Calculation, in O(1):
+    // Gt * variances * Gt^T + Fx^T * R * Fx only touches the robot rows and columns, ie.
+    //   Sigma_rr = Gr * Sigma_rr * Gr^T + R
+    //   Sigma_rm = Gr * Sigma_rm  and  Sigma_mr = Sigma_rm^T
+    // The landmark-landmark block Sigma_mm is unchanged by the motion model.
+    // /cmd_vel comes a lot more often than the markers, so Sigma_rm is not rewritten on every prediction: the Gr of
+    // consecutive predictions are composed into crossGr, and flushCrossVariances() applies them in one pass when the
+    // cross terms are needed, ie. before a correction step or when the variances are read.
+    // Process noise R MUST be added so that in Correction step, matrix inversion does not yield inv(0) and thus Nan after sometime
+    void predictVariances(const ModelMatrix &Gr)
+    {
+        ModelMatrix robotBlock = variances.template topLeftCorner<NumModelStates, NumModelStates>();
+        variances.template topLeftCorner<NumModelStates, NumModelStates>() = Gr * robotBlock * Gr.transpose() + RmotionCovar;
+        crossGr = Gr * crossGr;
+    };
+
+    // Sigma_rm = crossGr * Sigma_rm, in O(numTotStates)
+    void flushCrossVariances() const
+    {
+        if(crossGr == ModelMatrix::Identity())
+        {
+            return;
+        }
+        // Column at a time so that no 3xN temporary gets allocated
+        for(int j = NumModelStates; j < numTotStates; ++j)
+        {
+            ModelVector crossCol = crossGr * variances.template block<NumModelStates, 1>(0, j);
+            variances.template block<NumModelStates, 1>(0, j) = crossCol;
+            variances.template block<1, NumModelStates>(j, 0) = crossCol.transpose();
+        }
+        flushedGr = crossGr * flushedGr;
+        crossGr.setIdentity();
+    };
+
+    // Before a correction step changes Sigma_rm in ways crossGr can't express. Saved robot blocks can't be restored
+    // past it (see EkfHistory::replay()), so flushedGr starts over.
+    void flushForCorrection()
+    {
+        flushCrossVariances();
+        flushedGr.setIdentity();
+    };
+
+    // Correction step for all the landmarks seen in one frame. Landmarks not seen before get added with their prior
+    // set to the global position of the observation. The observations are fused jointly with correctBatch(), or one
+    // at a time with correct() if batch correction is off. Returns the number of observations used.
+    int update(const std::vector<LandmarkObservation> &observations)
+    {
+        for(int i = 0; i < observations.size(); ++i)
+        {
+            const LandmarkObservation &obs = observations[i];
+            if(!isLandmarkSeen(obs.landmarkId))
+            {
+                Scalar landX, landY;
+                landmarkFromObservation(obs.range, obs.bearing, landX, landY);
+                addLandmark(obs.landmarkId, landX, landY);
+            }
+        }
+
+        if(bBatchCorrection)
+        {
+            return correctBatch(observations);
+        }
+
+        int numUsed = 0;
+        for(int i = 0; i < observations.size(); ++i)
+        {
+            const LandmarkObservation &obs = observations[i];
+            numUsed += correct(obs.landmarkId, obs.range, obs.bearing, observationNoise(obs));
+        }
+        return numUsed;
+    };
+
+    // Covariance of an observation: its own if it has one, Q otherwise
+    MeasurementMatrix observationNoise(const LandmarkObservation &obs) const
+    {
+        if(obs.bCovariance)
+        {
+            return obs.covariance.template cast<Scalar>();
+        }
+        return QsensorCovar;
+    };
+
+    // Correction step for a single landmark seen at (range, bearing). Returns false if the update was skipped.
+    bool correct(int landmarkId, Scalar range, Scalar bearing)
+    {
+        return correct(landmarkId, range, bearing, QsensorCovar);
+    };
+
+    // Same, with sensorNoise as the covariance of (range, bearing) instead of Q
+    bool correct(int landmarkId, Scalar range, Scalar bearing, const MeasurementMatrix &sensorNoise)
+    {
+        int stateIdx = landmarkStateIdx(landmarkId);
+        if(stateIdx < 0)
+        {
+            std::cout << "Landmark not in the state: " << landmarkId << std::endl;
+            return false;
+        }
+
+        MeasurementVector zj;
+        MeasurementVector zjHat;
+        JacobianMatrix Hq;
+        MeasurementMatrix residual;
+        zj << range, bearing;
+        linearizeObservation(stateIdx, zjHat, Hq, residual);
+        MeasurementVector innovation = zj - zjHat;
+        innovation(1) = normalizeAngle(innovation(1));
+
+        MeasurementMatrix noise = sensorNoise + residual;
+        if(bDenseCorrection)
+        {
+            return correctDense(Hq, innovation, stateIdx, noise);
+        }
+        return correctLowRank(Hq, innovation, stateIdx, noise);
+    };
+
+    // Expected (range, bearing) of each column (x, y, th, mx, my) of points. Used for the EKF (one column) and the
+    // unscented sigma points (all columns at once). The bearings are not wrapped.
+    template <typename DerivedX, typename DerivedZ>
+    static void measurementModel(const Eigen::MatrixBase<DerivedX> &points, Eigen::MatrixBase<DerivedZ> &Z)
+    {
+        typedef Eigen::Array<Scalar, 1, DerivedX::ColsAtCompileTime> RowArray;
+        RowArray delx = points.row(3).array() - points.row(0).array();
+        RowArray dely = points.row(4).array() - points.row(1).array();
+        Z.row(0) = (delx.square() + dely.square()).sqrt().matrix();
+        Z.row(1) = (dely.binaryExpr(delx, Atan2Op()) - points.row(2).array()).matrix();
+    };
+
+    // Expected (range, bearing) of the landmark at stateIdx from the current robot pose, and its Jacobian
+    // wrt the robot and landmark states (x, y, th, mx, my)
+    void observationModel(int stateIdx, MeasurementVector &zjHat, JacobianMatrix &Hq) const
+    {
+        ObservedVector point;
+        point << states.template head<NumModelStates>(), states.template segment<NumComponents>(stateIdx);
+        measurementModel(point, zjHat);
+        zjHat(1) = normalizeAngle(zjHat(1));
+
+        Scalar delx = states(stateIdx) - states(0);
+        Scalar dely = states(stateIdx+1) - states(1);
+        Scalar q = delx*delx + dely*dely;
+        EKF_TRACE(TRACE_OBSERVATION, stateIdx, zjHat(0), zjHat(1), delx, dely);
+
+        // Partial differential of:
+        // zHat_x wrt modelX, modelY, modelTh, mx, my
+        // zHat_y wrt modelX, modelY, modelTh, mx, my
+        Hq <<
+            -std::sqrt(q)*delx , -std::sqrt(q)*dely , 0    , std::sqrt(q)*delx   , std::sqrt(q)*dely ,
+            dely              , -delx               , -q   , -dely               , delx;
+        Hq *= (1/q);
+    };
+
+    // The 5x5 block of the variances for the robot and the landmark at stateIdx. The cross terms must be up to date.
+    ObservedMatrix observedVariances(int stateIdx) const
+    {
+        ObservedMatrix P;
+        P.template topLeftCorner<NumModelStates, NumModelStates>() = variances.template topLeftCorner<NumModelStates, NumModelStates>();
+        P.template topRightCorner<NumModelStates, NumComponents>() = variances.template block<NumModelStates, NumComponents>(0, stateIdx);
+        P.template bottomLeftCorner<NumComponents, NumModelStates>() = variances.template block<NumComponents, NumModelStates>(stateIdx, 0);
+        P.template bottomRightCorner<NumComponents, NumComponents>() = variances.template block<NumComponents, NumComponents>(stateIdx, stateIdx);
+        return P;
+    };
+
+    // Expected observation of the landmark at stateIdx and the Jacobian to correct with, from observationModel() or
+    // the sigma points in unscented mode. residual is what the Jacobian leaves out of the innovation covariance, to
+    // be added to Q (zero for the EKF).
+    void linearizeObservation(int stateIdx, MeasurementVector &zjHat, JacobianMatrix &Hq, MeasurementMatrix &residual) const
+    {
+        if(bUnscented && unscentedObservation(stateIdx, zjHat, Hq, residual))
+        {
+            return;
+        }
+        observationModel(stateIdx, zjHat, Hq);
+        residual.setZero();
+    };
+
+    // Unscented linearization of the observation of the landmark at stateIdx, from the 11 sigma points of the robot
+    // and landmark block. False if that block is broken or too wide for it (see EKF_UKF_MAX_SPREAD).
+    bool unscentedObservation(int stateIdx, MeasurementVector &zjHat, JacobianMatrix &Hq, MeasurementMatrix &residual) const
+    {
+        flushCrossVariances();
+        ObservedVector mean;
+        mean << states.template head<NumModelStates>(), states.template segment<NumComponents>(stateIdx);
+        ObservedMatrix P = observedVariances(stateIdx);
+
+        Scalar sqRange = (mean.template tail<NumComponents>() - mean.template head<NumComponents>()).squaredNorm();
+        Scalar sqSpread = (NumObservedStates + Scalar(EKF_UKF_KAPPA)) * (P(0, 0) + P(1, 1) + P(3, 3) + P(4, 4));
+        if(sqSpread > Scalar(EKF_UKF_MAX_SPREAD*EKF_UKF_MAX_SPREAD) * sqRange)
+        {
+            return false;
+        }
+
+        Eigen::Matrix<Scalar, NumObservedStates, 2*NumObservedStates+1> points;
+        ObservedMatrix L;
+        if(!sigmaPoints(mean, P, points, L))
+        {
+            return false;
+        }
+
+        // Bearings taken relative to the center point's, so that sigma points either side of +-PI average right
+        Eigen::Matrix<Scalar, NumComponents, 2*NumObservedStates+1> Z;
+        measurementModel(points, Z);
+        Scalar centerBearing = Z(1, 0);
+        for(int c = 0; c < Z.cols(); ++c)
+        {
+            Z(1, c) = normalizeAngle<Scalar>(Z(1, c) - centerBearing);
+        }
+
+        MeasurementMatrix covariance;
+        unscentedMoments(Z, L, zjHat, covariance, Hq);
+        zjHat(1) = normalizeAngle(zjHat(1) + centerBearing);
+        residual.noalias() = covariance - Hq * P * Hq.transpose();
+        residual = Scalar(0.5) * (residual + residual.transpose());
+        EKF_TRACE(TRACE_OBSERVATION, stateIdx, zjHat(0), zjHat(1), residual(0, 0), residual(1, 1));
+        return true;
+    };
+
+    // Innovation of a (range, bearing) observation of a landmark in the state and its covariance
+    // S = H * Sigma * H^T + Q, from the 5x5 robot and landmark block of the variances, eg. for gating an observation
+    // against the landmark. O(1) once the cross terms are up to date. False if the landmark isn't in the state.
+    bool innovation(int landmarkId, Scalar range, Scalar bearing, MeasurementVector &nu, MeasurementMatrix &S) const
+    {
+        int stateIdx = landmarkStateIdx(landmarkId);
+        if(stateIdx < 0)
+        {
+            return false;
+        }
+        flushCrossVariances();
+
+        MeasurementVector zjHat;
+        JacobianMatrix Hq;
+        MeasurementMatrix residual;
+        linearizeObservation(stateIdx, zjHat, Hq, residual);
+        nu << range - zjHat(0), normalizeAngle(bearing - zjHat(1));
+
+        ObservedMatrix P = observedVariances(stateIdx);
+        S.noalias() = Hq * P * Hq.transpose();
+        S += QsensorCovar + residual;
+        return true;
+    };
+
+    // Joint correction step for all the landmarks seen in one frame. The m observations are stacked into a 2m
+    // measurement vector with a block sparse 2m x numTotStates Jacobian (each block row only touches the robot
+    // and its own landmark), and the variances get a single rank-2m update from one factorization of the 2m x 2m
+    // innovation covariance, instead of m separate updates of the full variances.
+    // Observations of landmarks that are not in the state are ignored. Returns the number of observations used.
+    int correctBatch(const std::vector<LandmarkObservation> &observations)
+    {
+        flushForCorrection();
+        int n = numTotStates;
+        batchStateIdx.clear();
+        batchObservationIdx.clear();
+        for(int i = 0; i < observations.size(); ++i)
+        {
+            int stateIdx = landmarkStateIdx(observations[i].landmarkId);
+            if(stateIdx < 0)
+            {
+                std::cout << "Landmark not in the state: " << observations[i].landmarkId << std::endl;
+                continue;
+            }
+            batchStateIdx.push_back(stateIdx);
+            batchObservationIdx.push_back(i);
+        }
+        int m = batchStateIdx.size();
+        if(m == 0)
+        {
+            return 0;
+        }
+
+        int numMeas = NumComponents*m;
+        reserveBatch(m);
+        for(int i = 0; i < m; ++i)
+        {
+            const LandmarkObservation &obs = observations[batchObservationIdx[i]];
+            MeasurementVector zj;
+            MeasurementVector zjHat;
+            zj << obs.range, obs.bearing;
+            linearizeObservation(batchStateIdx[i], zjHat, batchH[i], batchResidual[i]);
+            batchInnovation.template segment<NumComponents>(NumComponents*i) = zj - zjHat;
+            // Both bearings are in [-PI, PI], so their difference can be off by a turn near +-PI
+            batchInnovation(NumComponents*i + 1) = normalizeAngle<Scalar>(batchInnovation(NumComponents*i + 1));
+
+            // Block column i of PHt = variances * H^T, from the robot and landmark columns of the variances only
+            batchPHt.block(0, NumComponents*i, n, NumComponents).noalias() =
+                variances.block(0, 0, n, NumModelStates) * batchH[i].template leftCols<NumModelStates>().transpose();
+            batchPHt.block(0, NumComponents*i, n, NumComponents).noalias() +=
+                variances.block(0, batchStateIdx[i], n, NumComponents) * batchH[i].template rightCols<NumComponents>().transpose();
+        }
+        // S = H * PHt + Q, block (i, j) only needs the robot and landmark i rows of block column j of PHt
+        for(int i = 0; i < m; ++i)
+        {
+            for(int j = 0; j < m; ++j)
+            {
+                MeasurementMatrix Sij;
+                Sij.noalias() = batchH[i].template leftCols<NumModelStates>() * batchPHt.template block<NumModelStates, NumComponents>(0, NumComponents*j);
+                Sij.noalias() += batchH[i].template rightCols<NumComponents>() * batchPHt.template block<NumComponents, NumComponents>(batchStateIdx[i], NumComponents*j);
+                if(i == j)
+                {
+                    Sij += observationNoise(observations[batchObservationIdx[i]]) + batchResidual[i];
+                }
+                batchS.template block<NumComponents, NumComponents>(NumComponents*i, NumComponents*j) = Sij;
+            }
+        }
+
+        batchLdlt.compute(batchS.topLeftCorner(numMeas, numMeas));
+        if(!isInnovationWellConditioned(batchLdlt))
+        {
+            return 0;
+        }
+
+        // Kt = S^-1 * PHt^T, so that K = Kt^T. PHt gets overwritten with W = PHt - K*S/2 for the Joseph form update
+        // (see correctLowRank())
+        batchKt.topLeftCorner(numMeas, n) = batchLdlt.solve(batchPHt.leftCols(numMeas).topRows(n).transpose());
+        states.head(n).noalias() += batchKt.topLeftCorner(numMeas, n).transpose() * batchInnovation.head(numMeas);
+        batchPHt.leftCols(numMeas).topRows(n).noalias() -=
+            Scalar(0.5) * batchKt.topLeftCorner(numMeas, n).transpose() * batchS.topLeftCorner(numMeas, numMeas);
+        variances.topLeftCorner(n, n).noalias() -= batchPHt.leftCols(numMeas).topRows(n) * batchKt.topLeftCorner(numMeas, n);
+        variances.topLeftCorner(n, n).noalias() -= batchKt.topLeftCorner(numMeas, n).transpose() * batchPHt.leftCols(numMeas).topRows(n).transpose();
+        EKF_TRACE(TRACE_CORRECT_BATCH, m, batchInnovation.head(numMeas).norm(), batchKt.topLeftCorner(numMeas, n).norm(), n, 0);
+        return m;
+    };
+
+    // Make room for a batch of m observations in the batch scratch space, so that frames with no more markers
+    // than seen before don't allocate
+    void reserveBatch(int m)
+    {
+        int rows = NumModelStates + NumComponents*landmarkCapacity;
+        if(batchPHt.rows() != rows || batchPHt.cols() < NumComponents*m)
+        {
+            int cols = std::max<int>(NumComponents*m, batchPHt.cols());
+            batchPHt.resize(rows, cols);
+            batchKt.resize(cols, rows);
+            batchS.resize(cols, cols);
+            batchInnovation.resize(cols);
+        }
+        if(batchH.size() < m)
+        {
+            batchH.resize(m);
+            batchResidual.resize(m);
+        }
+    };
+
+    // Low rank correction step for a single landmark, in O(numTotStates^2) without numTotStates x numTotStates temporaries.
+    // HFxj = Hq * Fxj only has non-zero columns for the robot states and the observed landmark's states, so
+    //   PHt = variances * HFxj^T only needs those 5 columns of the variances (numTotStates x 2)
+    //   tmp = HFxj * PHt + noise only needs the matching 5 rows of PHt (2x2)
+    //   K = PHt * tmp^-1, solved from the LDLT factorization of tmp instead of an explicit inverse
+    // The variances get the Joseph form update
+    //   (I - K*HFxj) * variances * (I - K*HFxj)^T + K*noise*K^T = variances - W*K^T - K*W^T, with W = PHt - K*tmp/2
+    // which is a symmetric rank-4 update, so the variances stay symmetric and positive definite without the
+    // roundoff drift of the plain variances - K * PHt^T downdate.
+    // noise is the sensor noise plus the unscented curvature term of linearizeObservation(), which is zero for the EKF.
+    bool correctLowRank(const JacobianMatrix &Hq, const MeasurementVector &innovation, int stateIdx, const MeasurementMatrix &noise)
+    {
+        flushForCorrection();
+        int n = numTotStates;
+        PHt.topRows(n).noalias() = variances.block(0, 0, n, NumModelStates) * Hq.template leftCols<NumModelStates>().transpose();
+        PHt.topRows(n).noalias() += variances.block(0, stateIdx, n, NumComponents) * Hq.template rightCols<NumComponents>().transpose();
+
+        MeasurementMatrix tmp;
+        tmp.noalias() = Hq.template leftCols<NumModelStates>() * PHt.template topRows<NumModelStates>();
+        tmp.noalias() += Hq.template rightCols<NumComponents>() * PHt.template middleRows<NumComponents>(stateIdx);
+        tmp += noise;
+
+        innovationLdlt.compute(tmp);
+        if(!isInnovationWellConditioned(innovationLdlt))
+        {
+            return false;
+        }
+
+        // K^T = tmp^-1 * PHt^T
+        K.topRows(n).transpose() = innovationLdlt.solve(PHt.topRows(n).transpose());
+        EKF_TRACE(TRACE_CORRECT, landmarkIds[(stateIdx - NumModelStates)/NumComponents], innovation(0), innovation(1), K.topRows(n).norm(), n);
+
+        states.head(n).noalias() += K.topRows(n) * innovation;
+        PHt.topRows(n).noalias() -= Scalar(0.5) * K.topRows(n) * tmp; // W
+        variances.topLeftCorner(n, n).noalias() -= PHt.topRows(n) * K.topRows(n).transpose();
+        variances.topLeftCorner(n, n).noalias() -= K.topRows(n) * PHt.topRows(n).transpose();
+        return true;
+    };
+
+    // Stability gate for the correction step. The reciprocal condition number of the innovation covariance is
+    // estimated from the diagonal of its LDLT factorization, which is free once the factorization is done.
+    template <typename LdltType>
+    bool isInnovationWellConditioned(const LdltType &ldlt)
+    {
+        if(ldlt.info() != Eigen::Success || !ldlt.isPositive())
+        {
+            numRejectedUpdates += 1;
+            EKF_TRACE(TRACE_INNOVATION, 0, 0, 0, 0, ldlt.rows());
+            std::cout << "Innovation covariance not positive definite, correction skipped" << std::endl;
+            return false;
+        }
+
+        Scalar maxD = ldlt.vectorD().cwiseAbs().maxCoeff();
+        Scalar minD = ldlt.vectorD().cwiseAbs().minCoeff();
+        bool bWellConditioned = minD > minInnovationRcond * maxD;
+        EKF_TRACE(TRACE_INNOVATION, bWellConditioned, minD, maxD, minD / maxD, ldlt.rows());
+        if(!bWellConditioned)
+        {
+            numRejectedUpdates += 1;
+            std::cout << "Innovation covariance ill conditioned, correction skipped" << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    // Dense correction step for a single landmark. Builds the full Fxj and HFxj matrices and does
+    // (I - K*HFxj) * variances, which is O(numTotStates^3) per landmark.
+    // Kept as the reference implementation to check correctLowRank() against (see setDenseCorrection()).
+    bool correctDense(const JacobianMatrix &Hq, const MeasurementVector &innovation, int stateIdx, const MeasurementMatrix &noise)
+    {
+        typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> DenseMatrix;
+
+        flushForCorrection();
+        DenseMatrix Fxj = DenseMatrix::Zero(NumObservedStates, numTotStates);
+        Fxj.topLeftCorner(NumModelStates, NumModelStates).setIdentity();
+        Fxj(NumModelStates, stateIdx) = 1;
+        Fxj(NumModelStates+1, stateIdx+1) = 1;
+
+        // (3+2)x(3+2n) = 5x5 for single landmark case, with each landmark being 2D
+        DenseMatrix HFxj = Hq * Fxj;
+        DenseMatrix Htrans = HFxj.transpose();
+        DenseMatrix P = variances.topLeftCorner(numTotStates, numTotStates);
+        MeasurementMatrix tmp = HFxj * P * Htrans + noise;
+        innovationLdlt.compute(tmp);
+        if(!isInnovationWellConditioned(innovationLdlt))
+        {
+            return false;
+        }
+        DenseMatrix Kdense = innovationLdlt.solve(HFxj * P).transpose();
+
+        // Joseph form
+        states.head(numTotStates) += Kdense * innovation;
+        DenseMatrix IKH = DenseMatrix::Identity(numTotStates, numTotStates) - Kdense*HFxj;
+        variances.topLeftCorner(numTotStates, numTotStates) = IKH * P * IKH.transpose() + Kdense * noise * Kdense.transpose();
+        return true;
+    };
+
+    void display() const
+    {
+        std::cout << "numModelStates " << (int)NumModelStates << std::endl;
+        std::cout << "numLandmarks " << numLandmarks << std::endl;
+        std::cout << "landmarkCapacity " << landmarkCapacity << std::endl;
+        std::cout << "numTotStates " << numTotStates << std::endl;
+        std::cout << "numComponents " << (int)NumComponents << std::endl;
+        std::cout << "fixed size storage " << (bool)bFixedSize << std::endl;
+        std::cout << "landmarkPriorVariance " << landmarkPriorVariance << std::endl;
+        std::cout << "states " << getStates() << std::endl;
+        std::cout << "variances " << getVariances() << std::endl;
+        std::cout << "RmotionCovar " << RmotionCovar << std::endl;
+        std::cout << "QsensorCovar" << QsensorCovar << std::endl;
+    };
+
+};
+
+// The nodes all use the dynamic size filter, which is compiled once in the ekf_slam_core library
+extern template class EkfSlam<Eigen::Dynamic>;
+
+#endif // EKF_SLAM_H_
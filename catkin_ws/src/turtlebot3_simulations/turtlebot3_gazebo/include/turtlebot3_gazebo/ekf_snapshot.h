@@ -0,0 +1,60 @@
+#ifndef EKF_SNAPSHOT_H_
+#define EKF_SNAPSHOT_H_
+
+#include <memory>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+// Consistent copy of the filter output after one filter step
+struct EkfSnapshot
+{
+    double stamp; // Time of the filter step [s]
+    unsigned long seq; // Number of snapshots published before this one
+    Eigen::VectorXd states;
+    Eigen::MatrixXd variances; // Empty for snapshots of the states only or of the marginals
+    // Marginals only, for the backends whose full variances cost too much (see SlamBackend::hasCheapVariances())
+    Eigen::Matrix3d robotVariances;
+    Eigen::MatrixXd landmarkMarginals; // 2 x 2*numLandmarks, only in snapshots of the marginals
+    std::vector<int> landmarkIds; // landmarkId of each slot, see EkfSlam::getLandmarkIds()
+};
+
+typedef std::shared_ptr<const EkfSnapshot> EkfSnapshotPtr;
+
+// Double buffered snapshots of the filter, so that readers on other threads (publishers, controllers, services)
+// get a consistent (states, variances, stamp) view without locking the filter or blocking the writer.
+//
+// The single writer fills the back buffer and swaps it to the front. Readers take a reference to the front buffer
+// with latest(), which stays valid and unchanged for as long as they hold it. If a reader still holds the back
+// buffer when the writer comes around to it again, the writer moves on to a new buffer instead of waiting, so the
+// buffers only get reallocated when readers are slow or the state grows.
+class EkfSnapshotBuffer
+{
+
+private:
+    std::shared_ptr<EkfSnapshot> buffers[2];
+    int backIdx;
+    unsigned long seq;
+    EkfSnapshotPtr front; // Only accessed with std::atomic_load/std::atomic_store
+
+    EkfSnapshot &beginPublish(const Eigen::Ref<const Eigen::VectorXd> &states, const std::vector<int> &landmarkIds, double stamp);
+    void endPublish();
+
+public:
+    EkfSnapshotBuffer() : backIdx(0), seq(0) {};
+    ~EkfSnapshotBuffer() {};
+
+    // Writer side. Only ever called from one thread at a time.
+    void publish(const Eigen::Ref<const Eigen::VectorXd> &states, const Eigen::Ref<const Eigen::MatrixXd> &variances,
+                 const std::vector<int> &landmarkIds, double stamp);
+    // Snapshot of the states only, for outputs that don't need the variances at every filter step
+    void publish(const Eigen::Ref<const Eigen::VectorXd> &states, const std::vector<int> &landmarkIds, double stamp);
+    // Snapshot of the robot variances and the landmark marginals instead of the full variances
+    void publish(const Eigen::Ref<const Eigen::VectorXd> &states, const Eigen::Matrix3d &robotVariances,
+                 const Eigen::Ref<const Eigen::MatrixXd> &landmarkMarginals, const std::vector<int> &landmarkIds, double stamp);
+
+    // Reader side, from any thread. Null until the first publish().
+    EkfSnapshotPtr latest() const { return std::atomic_load(&front); };
+};
+
+#endif // EKF_SNAPSHOT_H_
@@ -0,0 +1,61 @@
+#ifndef EKF_TRACE_H_
+#define EKF_TRACE_H_
+
+#include <stdint.h>
+
+// Structured tracing of the filter, in place of printing the states and variances to std::cout on every callback.
+//
+// The EKF_TRACE* macros compile to nothing unless EKF_TRACE_ENABLED is defined (cmake -DEKF_TRACE=ON), and their
+// arguments are not evaluated, so trace points cost nothing in release builds and may compute eg. norms of K.
+// When enabled, each trace point writes one fixed size record into a lock free ring buffer owned by the calling
+// thread. A background thread drains all the rings to the trace file, so the filter never blocks on disk or on
+// another thread. If a ring fills up faster than it gets drained, records are dropped and counted.
+//
+// Trace file layout, in host byte order:
+//   header: char magic[4] = "EKFT", uint32 version, uint32 sizeof(EkfTraceRecord)
+//   records: EkfTraceRecord, in the order they were drained (sort by stampNs to interleave threads)
+// Print it with: ekf_trace_dump <trace file>
+#define EKF_TRACE_VERSION 1
+#define EKF_TRACE_RING_SIZE 8192 // Records per thread. Power of 2
+#define EKF_TRACE_DRAIN_PERIOD_MS 5
+
+// What the id and values of a record hold for each event
+enum EkfTraceEvent
+{
+    TRACE_PREDICT = 1,          // id: numTotStates. values: linVel, angVel, deltaT, th after the prediction
+    TRACE_LANDMARK_ADDED = 2,   // id: landmarkId. values: landX, landY, slot, landmarkCapacity
+    TRACE_OBSERVATION = 3,      // id: stateIdx. values: expected range, expected bearing, delx, dely
+    TRACE_INNOVATION = 4,       // id: 1 if accepted, 0 if rejected. values: min |D|, max |D| of the LDLT, rcond, size
+    TRACE_CORRECT = 5,          // id: landmarkId. values: range innovation, bearing innovation, |K|, numTotStates
+    TRACE_CORRECT_BATCH = 6,    // id: markers fused. values: |innovation|, |K|, numTotStates, 0
+    TRACE_MARKERS = 7,          // id: markers in the MarkerArray. values: 0
+    TRACE_ROBOT = 8             // id: numLandmarks. values: x, y, th, trace of the robot variances
+};
+
+struct EkfTraceRecord
+{
+    uint64_t stampNs; // steady clock
+    uint16_t event; // EkfTraceEvent
+    uint16_t thread; // Order in which the thread first traced
+    int32_t id;
+    double values[4];
+};
+
+// Opens the trace file and starts the drain thread. Trace points before this (or after ekfTraceStop()) are ignored.
+bool ekfTraceStart(const char *path);
+// Drains what is left, stops the drain thread and closes the trace file
+void ekfTraceStop();
+void ekfTraceEmit(int event, int id, double a, double b, double c, double d);
+const char *ekfTraceEventName(int event);
+
+#ifdef EKF_TRACE_ENABLED
+#define EKF_TRACE(event, id, a, b, c, d) ekfTraceEmit((event), (id), (a), (b), (c), (d))
+#define EKF_TRACE_START(path) ekfTraceStart(path)
+#define EKF_TRACE_STOP() ekfTraceStop()
+#else
+#define EKF_TRACE(event, id, a, b, c, d) do {} while(0)
+#define EKF_TRACE_START(path) do {} while(0)
+#define EKF_TRACE_STOP() do {} while(0)
+#endif
+
+#endif // EKF_TRACE_H_
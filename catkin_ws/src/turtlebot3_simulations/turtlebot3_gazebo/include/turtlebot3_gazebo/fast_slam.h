@@ -0,0 +1,190 @@
+#ifndef FAST_SLAM_H_
+#define FAST_SLAM_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/slam_backend.h"
+
+// Rao-Blackwellised particle filter SLAM, FastSLAM 2.0 (Montemerlo et al. 2003, Probabilistic Robotics table 13.3),
+// for maps too large for the O(N^2) covariance of the EKF. Same models as EkfSlam: velocity motion model and
+// (range, bearing) point landmarks.
+//
+// Each particle is a robot pose with its own map of independent 2x2 landmark EKFs. Between corrections a particle
+// keeps a Gaussian pose, its mean moved by the motion model and its variances grown by R as in EkfSlam::predict().
+// A correction builds the FastSLAM 2.0 proposal from that Gaussian and the observations of the frame, samples the
+// pose from it, updates the observed landmarks at the sampled pose and weighs the particle by the likelihood of the
+// observations at its predicted pose. Particles are resampled (low variance sampler) once the effective number of
+// particles drops below half.
+//
+// The landmark maps are persistent balanced binary trees keyed by slot, 2^depth leaves deep, shared between the
+// particles. Resampling only copies the root pointer of a map, and a landmark update copies the O(log N) nodes on
+// its path if they are shared, or changes them in place if the particle is their only owner. So a step is
+// O(M * observations * log N) in the number of particles M and landmarks N, and memory is O(M * log N) per
+// landmark update on top of the N leaves.
+//
+// Predictions and corrections run on numThreads threads, each on a contiguous range of particles with its own
+// random number generator. The threads are kept for the life of the filter. The paths to the observed landmarks are
+// unshared on the filter thread before a correction goes to the threads, so that each thread only changes nodes
+// that its own particles alone point to.
+class FastSlam : public SlamBackend
+{
+
+public:
+    enum
+    {
+        NumModelStates = 3,
+        NumComponents = 2
+    };
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    // Node of a landmark map. Leaves (at depth 0) hold a landmark, the others their two subtrees
+    struct MapNode
+    {
+        std::shared_ptr<MapNode> child[2];
+        Eigen::Vector2d mean;
+        Eigen::Matrix2d variances;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::shared_ptr<MapNode> MapPtr;
+
+    struct Particle
+    {
+        Eigen::Vector3d pose; // Mean since the last correction
+        Eigen::Matrix3d poseVariances; // Grown by the predictions since the last correction, zero after one
+        double weight; // Normalized
+        double logLikelihood; // Of the observations being fused
+        MapPtr map;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<Particle, Eigen::aligned_allocator<Particle> > ParticleList;
+
+    enum Work
+    {
+        WORK_PREDICT = 1,
+        WORK_UPDATE = 2
+    };
+
+    ParticleList particles;
+    ParticleList resampled; // Swapped with particles by the resampling, kept to avoid reallocating
+    int depth; // Of every map, 2^depth slots
+
+    std::unordered_map<int, int> landmarkSlots; // (landmarkId, slot), the same in every particle
+    std::vector<int> landmarkIds; // landmarkId of each slot
+
+    Eigen::Matrix3d RmotionCovar;
+    Eigen::Matrix2d QsensorCovar;
+    double angVelThresh;
+    double landmarkPriorVariance;
+    double lastPredictStamp;
+    int numLate;
+    int numResamples;
+
+    // Worker threads. Thread 0 is the filter thread itself, which runs a share of every step too
+    int numThreads;
+    std::vector<std::thread> workers;
+    std::vector<std::mt19937> generators; // By thread
+    std::mutex workMutex;
+    std::condition_variable workCondition;
+    std::condition_variable doneCondition;
+    unsigned long workGeneration; // Bumped for every step handed to the workers
+    int numWorking;
+    int numChunks; // Threads the current step is split between
+    bool bStopping;
+
+    // Arguments of the current step
+    Work work;
+    double workLinVel;
+    double workAngVel;
+    double workDeltaT;
+    std::vector<int> workSlots; // Slot of each observation, -1 if it can't be used
+    const std::vector<LandmarkObservation> *workObservations;
+    std::vector<std::vector<char> > workUsed; // By thread, whether each observation was fused in one of its particles
+
+    // Outputs
+    Eigen::Vector3d robotMean; // Weighted mean of the particles, also used by landmarkFromObservation()
+    Eigen::VectorXd states; // Landmark part kept per slot by refreshLandmark()
+    Eigen::MatrixXd landmarkMarginals; // 2 x 2*numLandmarks, kept along with the landmark states
+    Eigen::MatrixXd variances;
+    bool bVariancesValid;
+
+    static const MapNode *findLeaf(const MapNode *root, int depth, int slot);
+    static MapNode *mutableLeaf(MapPtr &root, int depth, int slot);
+    static MapNode *ownedLeaf(MapNode *root, int depth, int slot);
+    static void gatherMeans(const MapNode *node, int depth, int firstSlot, double weight, Eigen::VectorXd &states);
+
+    void workLoop(int thread);
+    void runParallel(Work work, int minPerChunk);
+    void runChunk(int chunk);
+    void predictParticle(Particle &p) const;
+    void updateParticle(Particle &p, std::mt19937 &generator, std::vector<char> &used) const;
+    void normalizeWeights();
+    void resample();
+    void computeRobotMean();
+    void refreshLandmark(int slot);
+
+public:
+    // numThreads <= 0 uses every core
+    FastSlam(int initialCapacity, int numParticles, int numThreads);
+    ~FastSlam();
+
+    void setMotionNoise(const Eigen::Matrix3d &R) { RmotionCovar = R; };
+    void setSensorNoise(const Eigen::Matrix2d &Q) { QsensorCovar = Q; };
+    void setAngVelThresh(double thresh) { angVelThresh = thresh; };
+    void setLandmarkPriorVariance(double INF) { landmarkPriorVariance = INF; };
+    void setRobotPose(double x, double y, double th);
+
+    void predict(double stamp, double linVel, double angVel, double deltaT);
+    // A particle filter can't take back the poses it sampled, so late markers are fused at the current time, and
+    // counted. Every late marker is then too old to rewind.
+    int rewind(double stamp);
+    void replay() {};
+    int getNumLate() const { return numLate; };
+    int getNumTooOld() const { return numLate; };
+    // Returns the number of observations fused in at least one particle
+    int update(const std::vector<LandmarkObservation> &observations);
+
+    // The landmark is placed in each particle at the same position relative to the particle as to the mean pose
+    int addLandmark(int landmarkId, double landX, double landY);
+    bool isLandmarkSeen(int landmarkId) const { return landmarkSlots.count(landmarkId) > 0; };
+    void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const;
+
+    // Moments of the mixture of the particle innovations, O(M * log N)
+    bool innovation(int landmarkId, double range, double bearing, Eigen::Vector2d &nu, Eigen::Matrix2d &S);
+
+    int getNumLandmarks() const { return landmarkIds.size(); };
+    const std::vector<int> &getLandmarkIds() const { return landmarkIds; };
+    int getNumParticles() const { return particles.size(); };
+    int getNumResamples() const { return numResamples; };
+    // Effective number of particles, 1 / sum(weight^2)
+    double getNumEffective() const;
+    // Weighted mean of the particles, O(1). The mean of a landmark is taken when it is added and after each
+    // correction that observes it, with the weights of that time. The weights change at every correction, but the
+    // particles' estimates of a landmark only change when it is observed, so it only lags by how much the other
+    // landmarks' observations have reweighed or resampled the particles since.
+    Eigen::Ref<const Eigen::VectorXd> getStates();
+    // Spread of the particles plus the weighted mean of their pose and landmark variances, O(M * numTotStates^2),
+    // with every landmark mean taken again first. Cached until the next step. Only for offline use, eg. ekf_replay,
+    // which is why hasCheapVariances() is false.
+    Eigen::Ref<const Eigen::MatrixXd> getVariances();
+    // Robot block of getVariances() alone, O(M)
+    Eigen::Matrix3d getRobotVariances();
+    bool hasCheapVariances() const { return false; };
+    // O(N) copy, the marginals are kept with the landmark means (see getStates())
+    void getLandmarkMarginals(Eigen::MatrixXd &marginals) { marginals = landmarkMarginals; };
+
+    void display() const;
+};
+
+#endif // FAST_SLAM_H_
@@ -0,0 +1,112 @@
+#ifndef ISAM_SLAM_H_
+#define ISAM_SLAM_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/nonlinear/ISAM2.h>
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include "turtlebot3_gazebo/slam_backend.h"
+
+// Incremental smoothing and mapping with GTSAM's iSAM2 (Kaess et al. 2012). Same models as EkfSlam: velocity motion
+// model and (range, bearing) point landmarks, but the whole trajectory of keyframes is kept and re-estimated instead
+// of being marginalized out at every step.
+//
+// Between keyframes the predictions only integrate the motion model from the last keyframe, with its variances grown
+// by R as in EkfSlam::predict(). A frame of markers seen after the robot moved makes a new keyframe: a Pose2 joined
+// to the previous one by a BetweenFactor with the integrated motion, and one BearingRangeFactor per marker. New
+// landmarks get their position from the observation and a landmarkPriorVariance prior, like in EkfSlam. Each
+// keyframe is one ISAM2::update(), which only re-eliminates the part of the Bayes tree the new factors touch and
+// only relinearizes the variables whose estimate moved more than relinearizeThreshold since they were last
+// linearized, checked every relinearizeSkip updates. So a keyframe costs about the same however long the run, except
+// when a loop closure moves a large part of the map.
+//
+// The published robot pose is the estimate of the last keyframe moved on by the motion since. The variances are the
+// marginals of the robot and of each landmark, without the cross covariances between them, which would take a
+// factorization of the whole graph.
+class IsamSlam : public SlamBackend
+{
+
+public:
+    enum
+    {
+        NumModelStates = 3,
+        NumComponents = 2
+    };
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    gtsam::ISAM2 isam;
+    gtsam::NonlinearFactorGraph newFactors; // Not handed to isam yet
+    gtsam::Values newValues;
+    int numKeyframes; // Keyframe k is gtsam::Symbol('x', k), landmark id gtsam::Symbol('l', id)
+
+    std::unordered_map<int, int> landmarkSlots; // (landmarkId, slot)
+    std::vector<int> landmarkIds; // landmarkId of each slot
+
+    Eigen::Matrix3d RmotionCovar;
+    Eigen::Matrix2d QsensorCovar;
+    double angVelThresh;
+    double landmarkPriorVariance;
+    double lastPredictStamp;
+    int numLate;
+
+    // Motion since the last keyframe
+    gtsam::Pose2 keyframePose; // Estimate of the last keyframe
+    gtsam::Pose2 robotPose; // keyframePose moved on by the predictions since
+    Eigen::Matrix3d motionGr; // Composed motion Jacobian of the predictions since the keyframe
+    Eigen::Matrix3d motionVariances; // Of robotPose given keyframePose, grown by R
+    bool bMoved; // Predicted since the last keyframe
+
+    // Outputs
+    Eigen::VectorXd states; // Landmark part set by addLandmark() and update()
+    Eigen::MatrixXd variances;
+    bool bVariancesValid;
+
+    void addKeyframe();
+
+public:
+    IsamSlam(int initialCapacity, double relinearizeThreshold, int relinearizeSkip);
+    ~IsamSlam() {};
+
+    void setMotionNoise(const Eigen::Matrix3d &R) { RmotionCovar = R; };
+    void setSensorNoise(const Eigen::Matrix2d &Q) { QsensorCovar = Q; };
+    void setAngVelThresh(double thresh) { angVelThresh = thresh; };
+    void setLandmarkPriorVariance(double INF) { landmarkPriorVariance = INF; };
+    // Prior of the first keyframe. Only before the first update().
+    void setRobotPose(double x, double y, double th);
+
+    void predict(double stamp, double linVel, double angVel, double deltaT);
+    // Late markers are fused at the current keyframe, and counted. Every late marker is then too old to rewind.
+    int rewind(double stamp);
+    void replay() {};
+    int getNumLate() const { return numLate; };
+    int getNumTooOld() const { return numLate; };
+    int update(const std::vector<LandmarkObservation> &observations);
+
+    int addLandmark(int landmarkId, double landX, double landY);
+    bool isLandmarkSeen(int landmarkId) const { return landmarkSlots.count(landmarkId) > 0; };
+    void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const;
+
+    int getNumLandmarks() const { return landmarkIds.size(); };
+    const std::vector<int> &getLandmarkIds() const { return landmarkIds; };
+    int getNumKeyframes() const { return numKeyframes; };
+    // O(1). The landmark estimates are taken once per update(), O(numLandmarks), a landmark added since is at the
+    // position it was added with.
+    Eigen::Ref<const Eigen::VectorXd> getStates();
+    // Block diagonal, the robot and landmark marginals. Cached until the next step.
+    Eigen::Ref<const Eigen::MatrixXd> getVariances();
+    // Robot block of getVariances() alone
+    Eigen::Matrix3d getRobotVariances();
+
+    void display() const;
+};
+
+#endif // ISAM_SLAM_H_
@@ -0,0 +1,98 @@
+#ifndef LANDMARK_ASSOCIATION_H_
+#define LANDMARK_ASSOCIATION_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/slam_backend.h"
+
+// Data association for observations that come without a landmark id (landmarkId < 0), eg. lidar clusters, where
+// Aruco markers carry their own.
+//
+// Landmark positions are kept in a uniform grid of cellSize cells, so the candidates for an observation are the
+// landmarks in the 3x3 cells around where it lands, O(1) per observation whatever the size of the map. The
+// candidates in the state are then gated by their squared Mahalanobis distance nu^T * S^-1 * nu, from the 2x2
+// innovation only (see SlamBackend::innovation()), and each landmark goes to at most one observation of a frame,
+// closest first. An observation with no candidate closer than newLandmarkThresh is a new landmark: it is matched
+// by plain distance against the tentative landmarks that the node hasn't added to the state yet (see
+// LandmarkMleInitializer), or gets a new id from firstId on. Observations in between the two thresholds are too
+// ambiguous to use and keep landmarkId < 0.
+//
+// A tentative landmark that isn't seen again for tentativeFrames frames (of those with unlabelled observations) and
+// hasn't made it into the state by then is dropped, eg. a passing person or a spurious cluster, and its id is given
+// out again. So the entries, the grid and the initializer windows (see getExpiredIds()) stay bounded by the
+// landmarks seen recently rather than every cluster ever seen.
+//
+// The grid is refreshed with the current mean of every landmark the gating looks at, and rebuilt from the states
+// every rebuildPeriod frames for the ones that moved without being looked at.
+class LandmarkAssociator
+{
+
+private:
+    struct Entry
+    {
+        double x, y; // Indexed position
+        long long cell;
+        int count; // Observations averaged into (x, y) while tentative
+        int takenFrame; // Frame the landmark was last associated in
+        bool bIndexed;
+    };
+
+    struct Match
+    {
+        double distance; // Squared Mahalanobis
+        int observation;
+        int landmarkId;
+
+        bool operator<(const Match &other) const { return distance < other.distance; };
+    };
+
+    double cellSize;
+    double gateThresh;
+    double newLandmarkThresh;
+    double tentativeRadius; // [m] For matching tentative landmarks, which have no covariance yet
+    int tentativeFrames;
+    int rebuildPeriod;
+    int nextId;
+    int numFrames;
+
+    std::vector<Entry> entries; // By landmarkId
+    std::unordered_map<long long, std::vector<int> > cells; // (cell, landmarkIds)
+    std::vector<int> tentativeIds; // Ids given out that weren't in the state yet at the last frame
+    std::vector<int> freeIds; // Of the dropped tentative landmarks, given out before nextId
+    std::vector<int> expiredIds; // Dropped during the last associate()
+
+    // Scratch space, reused across frames
+    std::vector<int> candidates;
+    std::vector<Match> matches;
+    std::vector<double> minDistances;
+
+    long long cellKey(double x, double y) const;
+    Entry &entry(int landmarkId);
+    void index(int landmarkId, double x, double y);
+    void unindex(int landmarkId);
+    void expireTentative(const SlamBackend &filter);
+    void findNear(double x, double y, std::vector<int> &landmarkIds) const;
+
+public:
+    LandmarkAssociator(double cellSize, double gateThresh, double newLandmarkThresh, double tentativeRadius,
+                       int tentativeFrames, int rebuildPeriod, int firstId);
+    ~LandmarkAssociator() {};
+
+    // Indexes every landmark of the state at its mean, in the EkfSlam state layout, O(numLandmarks)
+    void rebuild(const std::vector<int> &landmarkIds, const Eigen::Ref<const Eigen::VectorXd> &states);
+
+    // Sets the landmarkId of the observations of a frame that have none, as above. Returns the number set.
+    // Frames with only labelled observations cost nothing.
+    int associate(SlamBackend &filter, std::vector<LandmarkObservation> &observations);
+    // Tentative landmarks dropped by the last associate(), whose ids may come back for other landmarks. The caller
+    // has to drop what it keeps for them too, eg. LandmarkMleInitializer::clear().
+    const std::vector<int> &getExpiredIds() const { return expiredIds; };
+    int getNumTentative() const { return tentativeIds.size(); };
+
+    int getNumIndexed() const;
+};
+
+#endif // LANDMARK_ASSOCIATION_H_
@@ -0,0 +1,55 @@
+#ifndef LANDMARK_INITIALIZER_H_
+#define LANDMARK_INITIALIZER_H_
+
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+// Max Likelihood Estimate of the prior of a landmark, from its first few sightings.
+// Initializing a landmark from a single sighting makes the filter heavily biased on that prior belief. Instead the
+// global positions of the sightings are collected in a sliding window, and the landmark is only initialized with
+// their mean once the window is full and their covariance is small enough in every direction, ie. its largest
+// eigenvalue is below the threshold.
+// For a Gaussian distribution the MLE is the same as the mean and covariance.
+//
+// Landmark ids are Aruco ids, so small non negative ints: the windows are stored flat and indexed by id. Each keeps
+// the running mean and co-moments of its samples, updated Welford style as a sample enters and the oldest leaves, so
+// a sighting is O(1) whatever the window length.
+class LandmarkMleInitializer
+{
+
+private:
+    struct Window
+    {
+        int count; // Samples in the window
+        int next; // Ring buffer slot the next sample goes to
+        double meanX, meanY;
+        double momentXX, momentYY, momentXY; // Sums of (x - meanX) * (y - meanY) etc. over the window
+    };
+
+    int windowLength;
+    double varianceThresh;
+    std::vector<Window> windows; // By landmarkId
+    std::vector<double> samples; // windowLength (x, y) pairs per landmarkId, ring buffers
+
+    void addToMoments(Window &window, double x, double y);
+    void removeFromMoments(Window &window, double x, double y);
+
+public:
+    LandmarkMleInitializer(int windowLength, double varianceThresh);
+    ~LandmarkMleInitializer() {};
+
+    // Drops all the samples collected so far
+    void setWindow(int windowLength, double varianceThresh);
+
+    // Add a sighting of the landmark at global position (landX, landY). Returns true, with the prior in
+    // (meanX, meanY), once the landmark is ready to be initialized.
+    bool addSample(int landmarkId, double landX, double landY, double &meanX, double &meanY);
+    // Same, also returning the covariance of the samples in the window
+    bool addSample(int landmarkId, double landX, double landY, double &meanX, double &meanY, Eigen::Matrix2d &covariance);
+
+    // Drop the sightings of a landmark, eg. once it is in the state
+    void clear(int landmarkId);
+};
+
+#endif // LANDMARK_INITIALIZER_H_
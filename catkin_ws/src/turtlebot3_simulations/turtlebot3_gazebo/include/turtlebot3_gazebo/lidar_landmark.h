@@ -0,0 +1,77 @@
+#ifndef LIDAR_LANDMARK_H_
+#define LIDAR_LANDMARK_H_
+
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+// Range and heading of the single landmark in a lidar scan, for the single landmark test worlds.
+// All the lidar returns shorter than INF are assumed to belong to the landmark, so the range is their average and
+// the heading is the middle of the arc between the first and last return. Angles are measured from the start of
+// the scan, positive to the LHS of the robot.
+// Returns {avgRange, headingMiddle}. avgRange is INF if there are not enough returns to trust.
+std::vector<double> lidarRangeHeading(const std::vector<float> &lidarRange, double angleInc, float INF);
+
+// Landmark made of one cluster of lidar returns
+struct LidarCluster
+{
+    double range; // [m] To the centroid of the returns
+    double bearing; // [rad] Positive to the LHS of the robot, same as the Aruco bearings
+    Eigen::Matrix2d covariance; // Of (range, bearing)
+    int numPoints;
+};
+typedef std::vector<LidarCluster, Eigen::aligned_allocator<LidarCluster> > LidarClusterList;
+
+// Splits a scan into the landmarks in it, for worlds with more than one object in view.
+//
+// The rays are converted to points in the robot frame with sin/cos tables, which are only recomputed when
+// angle_min, angle_increment or the number of rays change, and with Eigen array operations so that the conversion
+// is vectorized (SSE2, AVX, NEON). The points are then split in a single pass: consecutive returns further apart
+// than jumpDistance start a new cluster, and each cluster only keeps its running sums. Out of range rays are
+// skipped without breaking a cluster. For a scan that goes all the way round, the clusters either side of the
+// first ray are joined.
+//
+// A cluster is a landmark if it has at least minPoints returns and its ends are at most maxWidth apart, so walls
+// are left out. It is reduced to the range and bearing of its centroid, with the spread of its returns taken
+// through the polar Jacobian plus rangeVariance and one ray of bearing as the covariance. The centroid lies on the
+// visible face of the object, so it is closer than the middle of the object by a fraction of its radius.
+//
+// The tables, points and clusters are kept across scans, so once they have grown a scan doesn't allocate.
+class LidarSegmenter
+{
+
+private:
+    struct Segment
+    {
+        int count;
+        double sumX, sumY, sumXX, sumYY, sumXY;
+        float firstX, firstY, lastX, lastY; // End points, for the width
+    };
+
+    double jumpDistance; // [m]
+    int minPoints;
+    double maxWidth; // [m]
+    double rangeVariance; // [m^2]
+
+    double tableAngleMin; // Scan the tables are for
+    double tableAngleInc;
+    Eigen::ArrayXf cosTable; // By ray
+    Eigen::ArrayXf sinTable;
+    Eigen::ArrayXf pointsX; // Last scan in the robot frame
+    Eigen::ArrayXf pointsY;
+    std::vector<Segment> segments;
+
+    void setAngles(double angleMin, double angleInc, int numRays);
+    bool toCluster(const Segment &segment, double angleInc, LidarCluster &cluster) const;
+
+public:
+    LidarSegmenter(double jumpDistance, int minPoints, double maxWidth, double rangeVariance);
+    ~LidarSegmenter() {};
+
+    // Landmarks of a sensor_msgs::LaserScan, in order of their first ray. Rays outside [rangeMin, rangeMax] are
+    // ignored. Returns the number of landmarks.
+    int segment(const std::vector<float> &ranges, double angleMin, double angleInc, float rangeMin, float rangeMax,
+                LidarClusterList &clusters);
+};
+
+#endif // LIDAR_LANDMARK_H_
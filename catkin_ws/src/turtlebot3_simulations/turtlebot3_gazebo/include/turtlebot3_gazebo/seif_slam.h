@@ -0,0 +1,158 @@
+#ifndef SEIF_SLAM_H_
+#define SEIF_SLAM_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/slam_backend.h"
+
+// Sparse extended information filter (SEIF) SLAM, for marker fields too large for the dense EKF.
+// Same models as EkfSlam (velocity motion model, (range, bearing) point landmarks), but the filter keeps the
+// information matrix Omega = Sigma^-1 and the information vector xi = Omega * mu instead of the variances.
+//
+// Omega is stored block sparse: the 3x3 robot block, the 2x2 diagonal block of each landmark, 2x2 links between
+// landmarks that share information, and 3x2 robot links for the active landmarks only. A landmark becomes active
+// when it is observed. Once more than maxActive landmarks are active, the sparsification step cuts the robot links
+// of the ones seen longest ago (Thrun et al., Probabilistic Robotics, ch. 12). With the active set bounded, no step
+// depends on the size of the map:
+//   predict()   O(maxActive^3), only the robot, the active landmarks and the links among them change
+//   update()    O(1) per observation, adds H^T Q^-1 H to the robot and landmark blocks, plus a sparsification
+// and memory is O(numLandmarks * links per landmark) instead of O(numLandmarks^2).
+//
+// The means are needed to linearize the models, and are recovered after every step instead of solving
+// Omega * mu = xi in full: the robot and active landmarks exactly, from their local block with the other means held
+// fixed, and numRelaxPerStep passive landmarks (round robin) by one Gauss-Seidel step each. The recovery of the
+// whole map is so spread over the steps, which is where the SEIF approximation comes from, along with the
+// sparsification.
+class SeifSlam : public SlamBackend
+{
+
+public:
+    enum
+    {
+        NumModelStates = 3,
+        NumComponents = 2
+    };
+
+    typedef Eigen::Matrix<double, NumModelStates, NumComponents> RobotLinkMatrix;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    // Omega block between a landmark and the landmark in slot
+    struct Link
+    {
+        int slot;
+        Eigen::Matrix2d info;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<Link, Eigen::aligned_allocator<Link> > LinkList;
+
+    struct Landmark
+    {
+        Eigen::Matrix2d info; // Omega_mm
+        Eigen::Vector2d infoVector; // xi_m
+        Eigen::Vector2d mean; // mu_m
+        RobotLinkMatrix robotLink; // Omega_rm, zero unless active
+        LinkList links; // Omega_mk, stored on both landmarks
+        bool bActive;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    std::vector<Landmark, Eigen::aligned_allocator<Landmark> > landmarks; // By slot
+    std::unordered_map<int, int> landmarkSlots; // (landmarkId, slot)
+    std::vector<int> landmarkIds; // landmarkId of each slot
+    std::vector<int> activeSlots; // In the order they were last observed, oldest first
+
+    Eigen::Matrix3d robotInfo; // Omega_rr
+    Eigen::Vector3d robotInfoVector; // xi_r
+    Eigen::Vector3d robotMean; // mu_r
+
+    Eigen::Matrix3d RmotionCovar;
+    Eigen::Matrix2d QsensorInfo; // Q^-1
+    double angVelThresh;
+    double landmarkPriorVariance;
+
+    int maxActive;
+    int numRelaxPerStep;
+    int nextRelaxSlot;
+    double lastPredictStamp;
+    int numLate;
+
+    // Dense copy of the local block of Omega, xi and mu: the robot and the landmarks in localSlots, in that order.
+    // Kept around so that their storage gets reused, but they are reallocated whenever the local block changes
+    // size: the sparsification works on 3 + 2*(maxActive+numCut) states and the other steps on 3 + 2*maxActive.
+    std::vector<int> localSlots;
+    Eigen::MatrixXd localInfo;
+    Eigen::VectorXd localInfoVector;
+    Eigen::VectorXd localMean;
+    Eigen::MatrixXd localNewInfo;
+    Eigen::MatrixXd localMarginal;
+    Eigen::MatrixXd localRobotCols;
+    Eigen::MatrixXd localGain;
+    Eigen::LDLT<Eigen::MatrixXd> localLdlt;
+
+    // Outputs, filled on request
+    Eigen::VectorXd states;
+    Eigen::MatrixXd variances;
+    bool bVariancesValid;
+
+    Eigen::Matrix2d *findLink(int slot, int otherSlot);
+    void setLink(int slot, int otherSlot, const Eigen::Matrix2d &info);
+    void gatherLocal();
+    void scatterLocal();
+    void activate(int slot);
+    bool correct(int slot, double range, double bearing);
+    void sparsify();
+    void recoverMeans();
+    void wrapRobotHeading();
+
+public:
+    SeifSlam(int initialCapacity, int maxActive, int numRelaxPerStep);
+    ~SeifSlam() {};
+
+    void setMotionNoise(const Eigen::Matrix3d &R) { RmotionCovar = R; };
+    void setSensorNoise(const Eigen::Matrix2d &Q) { QsensorInfo = Q.inverse(); };
+    void setAngVelThresh(double thresh) { angVelThresh = thresh; };
+    void setLandmarkPriorVariance(double INF) { landmarkPriorVariance = INF; };
+    void setRobotPose(double x, double y, double th);
+
+    void predict(double stamp, double linVel, double angVel, double deltaT);
+    // Predictions can't be undone in information form without keeping the dense blocks they changed, so late
+    // markers are fused at the current time, and counted. Every late marker is then too old to rewind.
+    int rewind(double stamp);
+    void replay() {};
+    int getNumLate() const { return numLate; };
+    int getNumTooOld() const { return numLate; };
+    int update(const std::vector<LandmarkObservation> &observations);
+
+    int addLandmark(int landmarkId, double landX, double landY);
+    bool isLandmarkSeen(int landmarkId) const { return landmarkSlots.count(landmarkId) > 0; };
+    void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const;
+
+    int getNumLandmarks() const { return landmarks.size(); };
+    int getNumActive() const { return activeSlots.size(); };
+    const std::vector<int> &getLandmarkIds() const { return landmarkIds; };
+    // Means in the EkfSlam state layout, O(numLandmarks)
+    Eigen::Ref<const Eigen::VectorXd> getStates();
+    // Sigma = Omega^-1 from a dense factorization of Omega, O(numTotStates^3). Cached until the next step. Only
+    // for offline use, eg. ekf_replay, which is why hasCheapVariances() is false.
+    Eigen::Ref<const Eigen::MatrixXd> getVariances();
+    // Sigma_rr from the local block of the robot and the active landmarks, O(maxActive^3). That is the robot
+    // variances given the passive landmarks, so a little smaller than the marginal, which needs all of Omega.
+    Eigen::Matrix3d getRobotVariances();
+    bool hasCheapVariances() const { return false; };
+    // Each from the local block of the landmark and the landmarks it is linked to, with the others held at their
+    // means, so also a little smaller than the marginals. O(numLandmarks * links per landmark^3).
+    void getLandmarkMarginals(Eigen::MatrixXd &marginals);
+    // Number of 2x2 landmark-landmark blocks of Omega in use, ie. how sparse it has stayed
+    int getNumLinks() const;
+
+    void display() const;
+};
+
+#endif // SEIF_SLAM_H_
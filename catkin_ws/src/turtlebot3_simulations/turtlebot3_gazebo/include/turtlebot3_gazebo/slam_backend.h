@@ -0,0 +1,135 @@
+#ifndef SLAM_BACKEND_H_
+#define SLAM_BACKEND_H_
+
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/ekf_history.h"
+#include "turtlebot3_gazebo/ekf_slam.h"
+
+// Estimator behind a filter node, so that the node only queues, orders and publishes, and the launch file picks the
+// estimator (~backend param). Every backend uses the state layout of EkfSlam, [x, y, th, m0x, m0y, ...] with the
+// landmarks in the slots they were added to, so /turtle/states, /turtle/landmark_ids and the snapshots look the same
+// whichever backend is running.
+class SlamBackend
+{
+
+public:
+    virtual ~SlamBackend() {};
+
+    virtual void setMotionNoise(const Eigen::Matrix3d &R) = 0;
+    virtual void setSensorNoise(const Eigen::Matrix2d &Q) = 0;
+    virtual void setAngVelThresh(double thresh) = 0;
+    virtual void setLandmarkPriorVariance(double INF) = 0;
+    virtual void setRobotPose(double x, double y, double th) = 0;
+
+    // Prediction step with the velocity motion model, for the motion applied at stamp
+    virtual void predict(double stamp, double linVel, double angVel, double deltaT) = 0;
+
+    // Out of sequence measurements, see EkfHistory: rewind() to the stamp of a late measurement, correct, replay().
+    // A backend that can't undo its predictions fuses late measurements at the current time and rewinds nothing.
+    virtual int rewind(double stamp) = 0;
+    virtual void replay() = 0;
+    virtual int getNumLate() const = 0;
+    // The late measurements that were fused at the current time instead of their own, out of getNumLate()
+    virtual int getNumTooOld() const = 0;
+
+    // Correction step for all the landmarks seen in one frame, adding the ones not seen before. Returns the number
+    // of observations used.
+    virtual int update(const std::vector<LandmarkObservation> &observations) = 0;
+
+    virtual int addLandmark(int landmarkId, double landX, double landY) = 0;
+    virtual bool isLandmarkSeen(int landmarkId) const = 0;
+    virtual void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const = 0;
+
+    // Innovation of a (range, bearing) observation of a landmark in the state and its 2x2 covariance S, for gating
+    // observations that come without a landmark id (see LandmarkAssociator). Backends that can't get S without
+    // recovering the full covariance return false, and then only work with landmark ids.
+    virtual bool innovation(int, double, double, Eigen::Vector2d &, Eigen::Matrix2d &) { return false; };
+
+    virtual int getNumLandmarks() const = 0;
+    virtual const std::vector<int> &getLandmarkIds() const = 0;
+
+    // Mean and covariance of the full state, valid until the next filter step. getVariances() is meant to be called
+    // at the covariance publishing rate rather than after every step.
+    virtual Eigen::Ref<const Eigen::VectorXd> getStates() = 0;
+    virtual Eigen::Ref<const Eigen::MatrixXd> getVariances() = 0;
+    // Sigma_rr alone, cheap enough to call after every step whichever the backend (eg. for the trace points)
+    virtual Eigen::Matrix3d getRobotVariances() = 0;
+
+    // False for the backends whose getVariances() costs a lot more than a filter step (an information filter has to
+    // invert its information matrix), so that a node doesn't call it on its filter thread. Their covariance output is
+    // then getRobotVariances() and getLandmarkMarginals().
+    virtual bool hasCheapVariances() const { return true; };
+    // 2x2 marginal of each landmark, the columns of a 2 x 2*numLandmarks matrix in slot order. The default takes
+    // them from getVariances().
+    virtual void getLandmarkMarginals(Eigen::MatrixXd &marginals)
+    {
+        Eigen::Ref<const Eigen::MatrixXd> variances = getVariances();
+        marginals.resize(2, variances.rows() - 3);
+        for(int i = 0; i < marginals.cols(); i += 2)
+        {
+            marginals.block<2, 2>(0, i) = variances.block<2, 2>(3 + i, 3 + i);
+        }
+    };
+
+    virtual void display() const = 0;
+};
+
+
+// Dense EKF SLAM (EkfSlam) with the prediction history for late markers. O(numTotStates^2) memory and per step.
+class EkfBackend : public SlamBackend
+{
+
+public:
+    typedef EkfSlam<Eigen::Dynamic> EkfCore;
+
+    EkfCore ekf; // For the EKF only options, eg. setBatchCorrection()
+    EkfHistory<EkfCore> history; // So that markers are fused at the time the image was taken, even if they come late
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    EkfBackend(int initialCapacity, int historySize) :
+    ekf(initialCapacity),
+    history(historySize)
+    {};
+
+    ~EkfBackend() {};
+
+    void setMotionNoise(const Eigen::Matrix3d &R) { ekf.setMotionNoise(R); };
+    void setSensorNoise(const Eigen::Matrix2d &Q) { ekf.setSensorNoise(Q); };
+    void setAngVelThresh(double thresh) { ekf.setAngVelThresh(thresh); };
+    void setLandmarkPriorVariance(double INF) { ekf.setLandmarkPriorVariance(INF); };
+    void setRobotPose(double x, double y, double th) { ekf.setRobotPose(x, y, th); };
+
+    void predict(double stamp, double linVel, double angVel, double deltaT) { history.predict(ekf, stamp, linVel, angVel, deltaT); };
+    int rewind(double stamp) { return history.rewind(ekf, stamp); };
+    void replay() { history.replay(ekf); };
+    int getNumLate() const { return history.getNumLate(); };
+    int getNumTooOld() const { return history.getNumTooOld(); };
+    int update(const std::vector<LandmarkObservation> &observations) { return ekf.update(observations); };
+
+    int addLandmark(int landmarkId, double landX, double landY) { return ekf.addLandmark(landmarkId, landX, landY); };
+    bool isLandmarkSeen(int landmarkId) const { return ekf.isLandmarkSeen(landmarkId); };
+    void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const
+    {
+        ekf.landmarkFromObservation(range, bearing, landX, landY);
+    };
+
+    bool innovation(int landmarkId, double range, double bearing, Eigen::Vector2d &nu, Eigen::Matrix2d &S)
+    {
+        return ekf.innovation(landmarkId, range, bearing, nu, S);
+    };
+
+    int getNumLandmarks() const { return ekf.getNumLandmarks(); };
+    const std::vector<int> &getLandmarkIds() const { return ekf.getLandmarkIds(); };
+    // Views of the filter storage, no copies
+    Eigen::Ref<const Eigen::VectorXd> getStates() { return ekf.getStates(); };
+    Eigen::Ref<const Eigen::MatrixXd> getVariances() { return ekf.getVariances(); };
+    Eigen::Matrix3d getRobotVariances() { return ekf.getRobotVariances(); };
+
+    void display() const { ekf.display(); };
+};
+
+#endif // SLAM_BACKEND_H_
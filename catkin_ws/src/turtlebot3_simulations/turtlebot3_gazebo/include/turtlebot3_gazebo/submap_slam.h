@@ -0,0 +1,142 @@
+#ifndef SUBMAP_SLAM_H_
+#define SUBMAP_SLAM_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
+
+#include "turtlebot3_gazebo/slam_backend.h"
+
+// Map estimate in the EkfSlam state layout, [x, y, th, m0x, m0y, ...], relative to a base pose.
+// For a local submap the base is the robot pose the submap was started at and (x, y, th) is the robot pose at its
+// end. For the joined global map the base is the world frame and (x, y, th) is the base of the next submap to join.
+struct Submap
+{
+    int index; // Local: submaps finished before this one. Global: number of submaps joined into it
+    Eigen::VectorXd states;
+    Eigen::MatrixXd variances;
+    std::vector<int> landmarkIds;
+    std::vector<int> landmarkSlots; // Global slot of each landmark, see SubmapSlam::getLandmarkIds()
+    Eigen::Vector3d baseMean; // Local only, front end estimate of the base in the world frame, for the outputs
+    Eigen::Matrix3d baseVariances;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::shared_ptr<const Submap> SubmapPtr;
+
+// EKF SLAM on local submaps with sequential map joining (Tardos et al., "Robust mapping and localization in indoor
+// environments using sonar data", 2002), for runs that go on for hours.
+//
+// The filter steps run on a local submap only: an EkfSlam with the robot starting at the origin of the submap with
+// zero variance. Once the submap has maxLandmarks landmarks or the robot has travelled maxDistance in it, it is
+// handed to a background thread and a new submap is started where the robot is. The cost of a filter step is so
+// bounded by the submap size instead of growing with everything seen since the start.
+//
+// The join thread joins the finished submaps into the global map one at a time: the submap is moved into the world
+// frame through the pose at the end of the global map, and the landmarks that both maps hold are fused with an
+// ideal (m_global - m_local = 0) measurement. A join is O(N^2) in the size of the global map, but off the filter
+// thread.
+//
+// The outputs are composed from the latest global map, the finished submaps it hasn't joined yet and the current
+// submap. Landmarks take their global map estimate once joined. The variances have the global map's variances and
+// the marginals of the robot and of the landmarks not joined yet, without their cross terms.
+class SubmapSlam : public SlamBackend
+{
+
+public:
+    typedef EkfSlam<Eigen::Dynamic> EkfCore;
+
+    EkfCore ekf; // Current submap, for the EKF only options, eg. setBatchCorrection()
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+    EkfHistory<EkfCore> history;
+    int maxLandmarks;
+    double maxDistance;
+    double distance; // Travelled in the current submap
+
+    // World frame pose of the base of the current submap
+    Eigen::Vector3d baseMean;
+    Eigen::Matrix3d baseVariances;
+
+    // Global slots, in the order landmarks were first seen in any submap
+    std::unordered_map<int, int> globalSlots; // (landmarkId, slot)
+    std::vector<int> globalIds; // landmarkId of each slot
+    std::vector<int> currentSlots; // Global slot of each landmark of the current submap
+
+    int numFinished;
+    std::deque<SubmapPtr> pending; // Finished but not joined yet as far as the filter thread knows, oldest first
+    SubmapPtr joinedSeen; // Global map the outputs were last composed from
+
+    // Join thread
+    std::thread joinThread;
+    std::mutex joinMutex;
+    std::condition_variable joinCondition;
+    std::deque<SubmapPtr> toJoin;
+    bool bStopping;
+    SubmapPtr joined; // Only accessed with std::atomic_load/std::atomic_store
+
+    // Outputs, and the global map part of the states, redone when a join finishes
+    Eigen::VectorXd joinedStates;
+    std::vector<bool> bJoinedSlots;
+    Eigen::VectorXd states;
+    Eigen::MatrixXd variances;
+
+    int assignSlot(int landmarkId);
+    void syncCurrentSlots();
+    void finishSubmap();
+    void syncJoined();
+    void joinLoop();
+    void toWorld(const Eigen::Vector3d &base, double localX, double localY, double &x, double &y) const;
+
+public:
+    SubmapSlam(int initialCapacity, int historySize, int maxLandmarks, double maxDistance);
+    ~SubmapSlam();
+
+    // Joins local into global as above. Static so that it can be run on its own, eg. in a benchmark.
+    static void joinMaps(Submap &global, const Submap &local);
+
+    void setMotionNoise(const Eigen::Matrix3d &R) { ekf.setMotionNoise(R); };
+    void setSensorNoise(const Eigen::Matrix2d &Q) { ekf.setSensorNoise(Q); };
+    void setAngVelThresh(double thresh) { ekf.setAngVelThresh(thresh); };
+    void setLandmarkPriorVariance(double INF) { ekf.setLandmarkPriorVariance(INF); };
+    // Only before the first submap is finished
+    void setRobotPose(double x, double y, double th);
+
+    void predict(double stamp, double linVel, double angVel, double deltaT);
+    int rewind(double stamp) { return history.rewind(ekf, stamp); };
+    void replay() { history.replay(ekf); };
+    int getNumLate() const { return history.getNumLate(); };
+    int getNumTooOld() const { return history.getNumTooOld(); };
+    int update(const std::vector<LandmarkObservation> &observations);
+
+    // Landmark positions are in the world frame, and converted to the current submap
+    int addLandmark(int landmarkId, double landX, double landY);
+    bool isLandmarkSeen(int landmarkId) const { return globalSlots.count(landmarkId) > 0; };
+    void landmarkFromObservation(double range, double bearing, double &landX, double &landY) const;
+
+    int getNumLandmarks() const { return globalIds.size(); };
+    const std::vector<int> &getLandmarkIds() const { return globalIds; };
+    int getNumSubmaps() const { return numFinished + 1; };
+    int getNumPending() const { return pending.size(); };
+    // O(numLandmarks) copy of the global map part, plus O(submap size) per submap not joined yet
+    Eigen::Ref<const Eigen::VectorXd> getStates();
+    // O(numTotStates^2)
+    Eigen::Ref<const Eigen::MatrixXd> getVariances();
+    // Robot variances of the current submap composed with the variances of its base
+    Eigen::Matrix3d getRobotVariances();
+    // Waits for the join thread to join every finished submap, eg. before reading the final map of a replay
+    void waitForJoins();
+
+    void display() const;
+};
+
+#endif // SUBMAP_SLAM_H_
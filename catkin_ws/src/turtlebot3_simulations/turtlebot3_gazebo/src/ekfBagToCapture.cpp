@@ -0,0 +1,122 @@
+// Converts a rosbag of a run into a compact capture (see ekf_capture.h) for ekf_replay.
+// Usage: rosrun turtlebot3_gazebo ekf_bag_to_capture <bag file> <capture file>
+//
+// Records /cmd_vel as motion, /aruco_marker_publisher/markers as (range, bearing) observations and the Gazebo /odom
+// as the ground truth. All records are stamped with the time the bag received them, which is what the ekf node sees.
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <geometry_msgs/Twist.h>
+#include <aruco_msgs/MarkerArray.h> // Located in devel/include/aruco_msgs/MarkerArray.h
+#include <nav_msgs/Odometry.h>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_capture.h"
+
+
+// Yaw of a quaternion, rotation about z
+double quaternionYaw(const geometry_msgs::Quaternion &q)
+{
+    return std::atan2(2*(q.w*q.z + q.x*q.y), 1 - 2*(q.y*q.y + q.z*q.z));
+}
+
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        std::cout << "Usage: ekf_bag_to_capture <bag file> <capture file>" << std::endl;
+        return 1;
+    }
+
+    rosbag::Bag bag;
+    bag.open(argv[1], rosbag::bagmode::Read);
+
+    CaptureWriter writer;
+    if(!writer.open(argv[2]))
+    {
+        std::cout << "Could not open " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> topics;
+    topics.push_back("/cmd_vel");
+    topics.push_back("/aruco_marker_publisher/markers");
+    topics.push_back("/odom");
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+    std::vector<LandmarkObservation> observations;
+    bool bOdomOriginSet = false;
+    double odomX0 = 0, odomY0 = 0, odomTh0 = 0;
+    int numMotion = 0, numMarkers = 0, numTruth = 0;
+
+    for(rosbag::View::iterator it = view.begin(); it != view.end(); ++it)
+    {
+        const rosbag::MessageInstance &m = *it;
+        double stamp = m.getTime().toSec();
+
+        geometry_msgs::Twist::ConstPtr twist = m.instantiate<geometry_msgs::Twist>();
+        if(twist)
+        {
+            writer.writeMotion(stamp, twist->linear.x, twist->angular.z);
+            numMotion += 1;
+            continue;
+        }
+
+        aruco_msgs::MarkerArray::ConstPtr markers = m.instantiate<aruco_msgs::MarkerArray>();
+        if(markers)
+        {
+            observations.clear();
+            for(int i = 0; i < markers->markers.size(); ++i)
+            {
+                const aruco_msgs::Marker &marker_i = markers->markers.at(i);
+                double x = marker_i.pose.pose.position.x;
+                double z = marker_i.pose.pose.position.z;
+
+                LandmarkObservation obs;
+                obs.landmarkId = marker_i.id;
+                obs.range = z;
+                obs.bearing = -std::atan2(x,z); // negated so that angle is positive to the LHS of robot
+                observations.push_back(obs);
+            }
+            writer.writeMarkers(stamp, observations);
+            numMarkers += 1;
+            continue;
+        }
+
+        nav_msgs::Odometry::ConstPtr odom = m.instantiate<nav_msgs::Odometry>();
+        if(odom)
+        {
+            double odomX = odom->pose.pose.position.x;
+            double odomY = odom->pose.pose.position.y;
+            double odomTh = quaternionYaw(odom->pose.pose.orientation);
+            if(!bOdomOriginSet)
+            {
+                odomX0 = odomX;
+                odomY0 = odomY;
+                odomTh0 = odomTh;
+                bOdomOriginSet = true;
+            }
+
+            // Pose relative to where the run started, in the odom frame at the start
+            double dx = odomX - odomX0;
+            double dy = odomY - odomY0;
+            double relX = std::cos(odomTh0)*dx + std::sin(odomTh0)*dy;
+            double relY = -std::sin(odomTh0)*dx + std::cos(odomTh0)*dy;
+
+            // The filter starts at (0, 0, PI/2), ie. its frame is the odom frame rotated by PI/2
+            writer.writeTruth(stamp, -relY, relX, normalizeAngle(odomTh - odomTh0 + PI/2.0));
+            numTruth += 1;
+        }
+    }
+
+    writer.close();
+    bag.close();
+
+    std::cout << "Wrote " << numMotion << " motion, " << numMarkers << " marker and " << numTruth
+              << " truth records to " << argv[2] << std::endl;
+    return 0;
+}
@@ -0,0 +1,593 @@
+// Microbenchmarks of the EKF steps versus the number of landmarks in the state.
+// Runs on synthetic landmarks and trajectories generated in process, so it needs no ROS, bags or Gazebo.
+// Usage: ekf_bench [N ...]    (default N = 5 50 500 2000)
+//        ekf_bench --check     (only the checks, as run by ctest)
+//
+// For each N this reports ns/op, bytes/op and allocs/op of:
+//   predict      one prediction step, the cross covariances are brought up to date by the next correct
+//   correct      one single marker correction step
+//   batch        one joint correction step of a frame of markers (see EkfSlam::update())
+//   serialize    packing the states and full variances for publishing, into a fresh array
+//   compact      packing the landmark marginals for /turtle/covariance, into a reused array like the nodes do
+//   ukf_pred     one prediction step in unscented mode (see EkfSlam::setUnscented())
+//   ukf_batch    one joint correction step in unscented mode, for the same frames as batch
+//   seif_pred    one prediction step of the SEIF backend (see SeifSlam)
+//   seif_batch   one correction step of the SEIF backend for the same frames as batch, mean recovery included
+//
+// Before that it checks normalizeAngle() against the fmod based version it replaced, on a fine sweep of
+// [-BENCH_WRAP_SWEEP_TURNS, BENCH_WRAP_SWEEP_TURNS] turns plus the edge cases, and its float form against the double
+// one (see checkAngleWrap()). It checks the low rank and batched correction steps against the dense one (see
+// checkCorrections()), and the unscented filter in float against the one in double (see checkUnscentedFloat()).
+// It exits with 1 if any of them differs. Then it times wrapping BENCH_WRAP_ANGLES angles (N column) with each:
+//   wrap_fmod    the former normalizeAngle(), one angle at a time
+//   wrap         normalizeAngle(), one angle at a time
+//
+// EkfSlam<5, float> is instantiated below, so that the filter core keeps building for float.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_slam.h"
+#include "turtlebot3_gazebo/seif_slam.h"
+
+#define BENCH_MIN_TIME 0.2 // Seconds each benchmark runs for, at least
+#define BENCH_FRAME_MARKERS 4 // Markers seen per frame, about what the camera sees in the Gazebo world
+#define BENCH_SEIF_MAX_ACTIVE 6 // Same as the ~seif_max_active default of the nodes
+#define BENCH_WRAP_ANGLES 1024 // Angles per wrap op, eg. the bearings of a particle set
+#define BENCH_WRAP_SWEEP_TURNS 1000
+#define BENCH_WRAP_TOLERANCE 1e-9 // Rounding of large angles, well below any heading error that matters
+#define BENCH_WRAP_FLOAT_TURNS 100 // Float keeps ~1e-4 rad at 100 turns, and loses the heading not long after
+#define BENCH_CHECK_LANDMARKS 20
+#define BENCH_CHECK_FRAMES 200
+#define BENCH_CHECK_NOISE 0.05 // [m, rad, m/s] Standard deviation of the noise on the observations and the motion
+#define BENCH_CHECK_TOLERANCE 1e-9 // Relative to the largest state or variance. Rounding alone stays below 1e-12
+#define BENCH_CHECK_FLOAT_TOLERANCE 1e-3 // Same, for float against double
+
+
+// Allocation counters. Eigen allocates with malloc and not operator new, so with glibc malloc itself is wrapped,
+// which catches both. Elsewhere only operator new is counted.
+static std::size_t benchAllocBytes = 0;
+static std::size_t benchAllocCount = 0;
+
+#ifdef __GLIBC__
+extern "C"
+{
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t num, std::size_t size);
+void *__libc_realloc(void *ptr, std::size_t size);
+void *__libc_memalign(std::size_t alignment, std::size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(std::size_t size)
+{
+    benchAllocBytes += size;
+    benchAllocCount += 1;
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t num, std::size_t size)
+{
+    benchAllocBytes += num*size;
+    benchAllocCount += 1;
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, std::size_t size)
+{
+    benchAllocBytes += size;
+    benchAllocCount += 1;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, std::size_t alignment, std::size_t size)
+{
+    benchAllocBytes += size;
+    benchAllocCount += 1;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12; // ENOMEM
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+}
+#else
+void *operator new(std::size_t size)
+{
+    benchAllocBytes += size;
+    benchAllocCount += 1;
+    void *ptr = std::malloc(size);
+    if(!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+
+typedef EkfSlam<Eigen::Dynamic> EkfCore;
+template class EkfSlam<5, float>; // Every member, so that a double only call in the filter core fails the build
+
+// Landmarks on a grid around the origin, and a robot driving in circles through them
+struct SyntheticWorld
+{
+    std::vector<double> landX;
+    std::vector<double> landY;
+    double x, y, th;
+    double linVel, angVel, deltaT;
+
+    SyntheticWorld(int numLandmarks) :
+    x(0), y(0), th(PI/2.0), linVel(0.25), angVel(0.25), deltaT(0.01)
+    {
+        int side = std::ceil(std::sqrt(numLandmarks));
+        for(int i = 0; i < numLandmarks; ++i)
+        {
+            landX.push_back(-4 + 8.0*(i % side)/side);
+            landY.push_back(-4 + 8.0*(i / side)/side);
+        }
+    };
+
+    void step()
+    {
+        double r = linVel/angVel;
+        x += -r*std::sin(th) + r*std::sin(th + angVel*deltaT);
+        y += +r*std::cos(th) - r*std::cos(th + angVel*deltaT);
+        th = normalizeAngle(th + angVel*deltaT);
+    };
+
+    LandmarkObservation observe(int landmarkId) const
+    {
+        double delx = landX[landmarkId] - x;
+        double dely = landY[landmarkId] - y;
+        LandmarkObservation obs;
+        obs.landmarkId = landmarkId;
+        obs.range = std::sqrt(delx*delx + dely*dely);
+        obs.bearing = normalizeAngle(std::atan2(dely, delx) - th);
+        return obs;
+    };
+};
+
+// Filter with all the landmarks of the world already in the state, so that the benchmarks run at full size
+template <typename Filter>
+void initFilter(Filter &ekf, const SyntheticWorld &world)
+{
+    ekf.setRobotPose(world.x, world.y, world.th);
+    ekf.setLandmarkPriorVariance(100);
+    ekf.setMotionNoise(Eigen::Vector3d(0.05, 0.05, 0.05).asDiagonal());
+    ekf.setSensorNoise(Eigen::Vector2d(0.005, 0.005).asDiagonal());
+    ekf.setAngVelThresh(0.001);
+    for(int i = 0; i < world.landX.size(); ++i)
+    {
+        ekf.addLandmark(i, world.landX[i], world.landY[i]);
+    }
+}
+
+// Runs op in batches of doubling size until BENCH_MIN_TIME has passed, and prints the per op cost
+template <typename Op>
+void runBench(int numLandmarks, const char *name, Op op)
+{
+    long numOps = 0;
+    std::size_t bytes = 0;
+    std::size_t allocs = 0;
+    double elapsed = 0;
+    for(long batch = 1; elapsed < BENCH_MIN_TIME; batch *= 2)
+    {
+        std::size_t bytesStart = benchAllocBytes;
+        std::size_t allocsStart = benchAllocCount;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(long i = 0; i < batch; ++i)
+        {
+            op(numOps + i);
+        }
+        elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bytes += benchAllocBytes - bytesStart;
+        allocs += benchAllocCount - allocsStart;
+        numOps += batch;
+    }
+    std::printf("%6d  %-10s %10ld %14.1f %12.1f %10.2f\n", numLandmarks, name, numOps,
+                1e9*elapsed/numOps, (double)bytes/numOps, (double)allocs/numOps);
+}
+
+// normalizeAngle() as it was before angle.h, the reference for the equivalence check
+double normalizeAngleFmod(double angle)
+{
+	double output;
+	double rem = std::fmod(std::abs(angle), PI);
+	double quo = (std::abs(angle) - rem) / PI;
+
+	int oddQuo = std::fmod(quo, 2);
+	// Positive angle input or 0
+	if (angle >= 0)
+	{
+		if (oddQuo == 0)
+		{
+			output = rem;
+		}
+		else
+		{
+			output = -(PI - rem);
+		}
+	}
+	// Negative Angle received
+	else
+	{
+		if (oddQuo == 0)
+		{
+			output = -rem;
+		}
+		else
+		{
+			output = (PI - rem);
+		}
+	}
+
+	return output;
+}
+
+// Largest difference between two wrapped angles, where -PI and PI are the same angle
+double wrapDifference(double a, double b)
+{
+    double diff = std::abs(a - b);
+    return std::min(diff, std::abs(diff - 2*PI));
+}
+
+// Wrapping in long double, the arbiter where the fmod version and the new one disagree. The fmod version truncates
+// its quotient to int, so just below odd multiples of PI it can come out a half turn off.
+double normalizeAngleExact(double angle)
+{
+    long double turns = (long double)angle / (2*(long double)PI);
+    return (double)((long double)angle - 2*(long double)PI*std::floor(turns + 0.5L));
+}
+
+// Returns false, after printing the worst angle, if the new wrapping is off anywhere: it must match the fmod version,
+// or where that one is off, the long double one
+bool checkAngleWrap()
+{
+    std::vector<double> angles;
+    int numSteps = 2*BENCH_WRAP_SWEEP_TURNS*1000;
+    for(int i = 0; i <= numSteps; ++i)
+    {
+        angles.push_back(2*PI*BENCH_WRAP_SWEEP_TURNS*(-1.0 + 2.0*i/numSteps) + 1e-4*std::sin(i)); // Not only grid points
+    }
+    for(int k = -BENCH_WRAP_SWEEP_TURNS; k <= BENCH_WRAP_SWEEP_TURNS; ++k)
+    {
+        // Multiples of PI and their neighbours, where the branches of the fmod version switch
+        double edge = k*PI;
+        angles.push_back(edge);
+        angles.push_back(std::nextafter(edge, 1e300));
+        angles.push_back(std::nextafter(edge, -1e300));
+    }
+    angles.push_back(0.0);
+    angles.push_back(-0.0);
+    angles.push_back(1e-300);
+    angles.push_back(-1e-300);
+
+    double maxDiff = 0;
+    double worstAngle = 0;
+    int numFmodOff = 0;
+    for(int i = 0; i < angles.size(); ++i)
+    {
+        double expected = normalizeAngleFmod(angles[i]);
+        if(wrapDifference(expected, normalizeAngleExact(angles[i])) > BENCH_WRAP_TOLERANCE)
+        {
+            expected = normalizeAngleExact(angles[i]);
+            numFmodOff += 1;
+        }
+        double wrapped = normalizeAngle(angles[i]);
+        double diff = std::max(wrapDifference(wrapped, expected), std::abs(wrapped) - PI);
+        if(!(diff <= maxDiff))
+        {
+            maxDiff = std::isnan(diff) ? 1e300 : diff;
+            worstAngle = angles[i];
+        }
+    }
+    std::printf("angle wrap: %d angles checked, max difference %g at %.17g, fmod version off for %d\n",
+                (int)angles.size(), maxDiff, worstAngle, numFmodOff);
+
+    // float, against the long double wrap of the same float angle. Its error grows with the turns removed.
+    double maxFloatDiff = 0;
+    int numFloat = 0;
+    for(int i = 0; i < angles.size(); ++i)
+    {
+        float angle = angles[i];
+        if(std::abs(angle) > 2*PI*BENCH_WRAP_FLOAT_TURNS)
+        {
+            continue;
+        }
+        float wrapped = normalizeAngle(angle);
+        double diff = std::max(wrapDifference(wrapped, normalizeAngleExact(angle)), std::abs(wrapped) - PI - 1e-6);
+        maxFloatDiff = std::max(maxFloatDiff, std::isnan(diff) ? 1e300 : diff / (std::abs(angle) + PI));
+        numFloat += 1;
+    }
+    std::printf("angle wrap: %d float angles checked, max difference %g relative to the angle\n", numFloat, maxFloatDiff);
+    return maxDiff <= BENCH_WRAP_TOLERANCE && maxFloatDiff <= 4*std::numeric_limits<float>::epsilon();
+}
+
+// Runs a filter through BENCH_CHECK_FRAMES frames of markersPerFrame noisy markers, 10 noisy predictions apart.
+// Every filter gets the same noise, and adds the landmarks on their first sighting.
+template <typename Filter>
+void runCheckTrajectory(Filter &ekf, int markersPerFrame)
+{
+    SyntheticWorld world(BENCH_CHECK_LANDMARKS);
+    ekf.setRobotPose(world.x, world.y, world.th);
+    ekf.setLandmarkPriorVariance(100);
+    ekf.setMotionNoise(typename Filter::ModelVector(0.05, 0.05, 0.05).asDiagonal());
+    ekf.setSensorNoise(typename Filter::MeasurementVector(0.005, 0.005).asDiagonal());
+    ekf.setAngVelThresh(0.001);
+
+    std::mt19937 generator(1);
+    std::normal_distribution<double> noise(0, BENCH_CHECK_NOISE);
+    std::vector<LandmarkObservation> frame;
+    for(int k = 0; k < BENCH_CHECK_FRAMES; ++k)
+    {
+        for(int j = 0; j < 10; ++j)
+        {
+            world.step();
+            ekf.predict(world.linVel + noise(generator), world.angVel, world.deltaT);
+        }
+        frame.clear();
+        for(int j = 0; j < markersPerFrame; ++j)
+        {
+            LandmarkObservation obs = world.observe((k*markersPerFrame + j) % BENCH_CHECK_LANDMARKS);
+            obs.range += noise(generator);
+            obs.bearing = normalizeAngle(obs.bearing + noise(generator));
+            frame.push_back(obs);
+        }
+        ekf.update(frame);
+    }
+}
+
+// Largest difference between the states and between the variances of two filters, relative to the largest of b
+template <typename Filter>
+void filterDifference(const Filter &a, const EkfCore &b, double &statesDiff, double &variancesDiff)
+{
+    statesDiff = (a.getStates().template cast<double>() - b.getStates()).cwiseAbs().maxCoeff() /
+                 std::max(1.0, b.getStates().cwiseAbs().maxCoeff());
+    variancesDiff = (a.getVariances().template cast<double>() - b.getVariances()).cwiseAbs().maxCoeff() /
+                    std::max(1.0, b.getVariances().cwiseAbs().maxCoeff());
+}
+
+// Returns false, after printing the differences, if the low rank or the batched correction step is off from the dense
+// reference (see EkfSlam::setDenseCorrection()). The low rank step is checked on frames of BENCH_FRAME_MARKERS
+// markers, fused one at a time like the dense one. The batched step linearizes all the markers of a frame at the
+// state before it, so it only matches the sequential steps on frames of one marker.
+bool checkCorrections()
+{
+    const int frameSizes[2] = {1, BENCH_FRAME_MARKERS};
+    double maxDiff = 0;
+    for(int f = 0; f < 2; ++f)
+    {
+        int markersPerFrame = frameSizes[f];
+        EkfCore dense(BENCH_CHECK_LANDMARKS);
+        dense.setBatchCorrection(false);
+        dense.setDenseCorrection(true);
+        runCheckTrajectory(dense, markersPerFrame);
+
+        EkfCore lowRank(BENCH_CHECK_LANDMARKS);
+        lowRank.setBatchCorrection(false);
+        runCheckTrajectory(lowRank, markersPerFrame);
+        double statesDiff, variancesDiff;
+        filterDifference(lowRank, dense, statesDiff, variancesDiff);
+        std::printf("correction: %d markers per frame, low rank vs dense: states %g, variances %g\n",
+                    markersPerFrame, statesDiff, variancesDiff);
+        maxDiff = std::max(maxDiff, std::max(statesDiff, variancesDiff));
+
+        int numRejected = dense.getNumRejectedUpdates() + lowRank.getNumRejectedUpdates();
+        if(markersPerFrame == 1)
+        {
+            EkfCore batched(BENCH_CHECK_LANDMARKS);
+            batched.setBatchCorrection(true);
+            runCheckTrajectory(batched, markersPerFrame);
+            filterDifference(batched, dense, statesDiff, variancesDiff);
+            std::printf("correction: %d markers per frame, batched vs dense: states %g, variances %g\n",
+                        markersPerFrame, statesDiff, variancesDiff);
+            maxDiff = std::max(maxDiff, std::max(statesDiff, variancesDiff));
+            numRejected += batched.getNumRejectedUpdates();
+        }
+        if(numRejected > 0)
+        {
+            std::printf("correction: %d correction steps rejected\n", numRejected);
+            return false;
+        }
+    }
+    return maxDiff <= BENCH_CHECK_TOLERANCE; // Also false for NaN
+}
+
+// Returns false, after printing the differences, if the unscented filter in float is off from the one in double by
+// more than float rounding accumulated over the run, or rejects a correction step
+bool checkUnscentedFloat()
+{
+    EkfCore ukf(BENCH_CHECK_LANDMARKS);
+    ukf.setUnscented(true);
+    runCheckTrajectory(ukf, BENCH_FRAME_MARKERS);
+
+    EkfSlam<Eigen::Dynamic, float> ukfFloat(BENCH_CHECK_LANDMARKS);
+    ukfFloat.setUnscented(true);
+    runCheckTrajectory(ukfFloat, BENCH_FRAME_MARKERS);
+
+    double statesDiff, variancesDiff;
+    filterDifference(ukfFloat, ukf, statesDiff, variancesDiff);
+    int numRejected = ukf.getNumRejectedUpdates() + ukfFloat.getNumRejectedUpdates();
+    std::printf("correction: %d markers per frame, unscented float vs double: states %g, variances %g, %d rejected\n",
+                BENCH_FRAME_MARKERS, statesDiff, variancesDiff, numRejected);
+    return numRejected == 0 && std::max(statesDiff, variancesDiff) <= BENCH_CHECK_FLOAT_TOLERANCE;
+}
+
+void benchAngleWrap()
+{
+    std::vector<double> angles(BENCH_WRAP_ANGLES);
+    std::vector<double> wrapped(BENCH_WRAP_ANGLES);
+    for(int i = 0; i < BENCH_WRAP_ANGLES; ++i)
+    {
+        angles[i] = 40*std::sin(0.37*i); // A few turns either way, like unwrapped sums of headings
+    }
+
+    double sink = 0; // Keeps the results live
+    runBench(BENCH_WRAP_ANGLES, "wrap_fmod", [&](long i)
+    {
+        for(int j = 0; j < BENCH_WRAP_ANGLES; ++j)
+        {
+            wrapped[j] = normalizeAngleFmod(angles[j]);
+        }
+        sink += wrapped[i % BENCH_WRAP_ANGLES];
+    });
+    // The new ones have no branches, so their cost doesn't depend on the angles and they can wrap in place
+    wrapped = angles;
+    runBench(BENCH_WRAP_ANGLES, "wrap", [&](long i)
+    {
+        for(int j = 0; j < BENCH_WRAP_ANGLES; ++j)
+        {
+            wrapped[j] = normalizeAngle(wrapped[j]);
+        }
+        sink += wrapped[i % BENCH_WRAP_ANGLES];
+    });
+    if(sink == 12345.0)
+    {
+        std::printf("\n");
+    }
+}
+
+void benchLandmarkCount(int numLandmarks)
+{
+    SyntheticWorld world(numLandmarks);
+    EkfCore ekf(numLandmarks);
+    initFilter(ekf, world);
+
+    runBench(numLandmarks, "predict", [&](long)
+    {
+        world.step();
+        ekf.predict(world.linVel, world.angVel, world.deltaT);
+    });
+
+    runBench(numLandmarks, "correct", [&](long i)
+    {
+        LandmarkObservation obs = world.observe(i % numLandmarks);
+        ekf.correct(obs.landmarkId, obs.range, obs.bearing);
+    });
+
+    std::vector<LandmarkObservation> frame;
+    frame.reserve(BENCH_FRAME_MARKERS);
+    runBench(numLandmarks, "batch", [&](long i)
+    {
+        frame.clear();
+        for(int j = 0; j < BENCH_FRAME_MARKERS && j < numLandmarks; ++j)
+        {
+            frame.push_back(world.observe((i*BENCH_FRAME_MARKERS + j) % numLandmarks));
+        }
+        ekf.update(frame);
+    });
+
+    runBench(numLandmarks, "serialize", [&](long)
+    {
+        std::vector<double> statesData;
+        std::vector<double> variancesData;
+        packStates(ekf.getStates(), statesData);
+        packRowMajor(ekf.getVariances(), variancesData);
+    });
+
+    std::vector<float> marginalsData;
+    runBench(numLandmarks, "compact", [&](long)
+    {
+        packLandmarkMarginals(ekf.getVariances(), marginalsData);
+    });
+
+    EkfCore ukf(numLandmarks);
+    ukf.setUnscented(true);
+    initFilter(ukf, world);
+    runBench(numLandmarks, "ukf_pred", [&](long)
+    {
+        world.step();
+        ukf.predict(world.linVel, world.angVel, world.deltaT);
+    });
+
+    runBench(numLandmarks, "ukf_batch", [&](long i)
+    {
+        frame.clear();
+        for(int j = 0; j < BENCH_FRAME_MARKERS && j < numLandmarks; ++j)
+        {
+            frame.push_back(world.observe((i*BENCH_FRAME_MARKERS + j) % numLandmarks));
+        }
+        ukf.update(frame);
+    });
+
+    SeifSlam seif(numLandmarks, BENCH_SEIF_MAX_ACTIVE, 10);
+    initFilter(seif, world);
+    runBench(numLandmarks, "seif_pred", [&](long i)
+    {
+        world.step();
+        seif.predict(i*world.deltaT, world.linVel, world.angVel, world.deltaT);
+    });
+
+    runBench(numLandmarks, "seif_batch", [&](long i)
+    {
+        frame.clear();
+        for(int j = 0; j < BENCH_FRAME_MARKERS && j < numLandmarks; ++j)
+        {
+            frame.push_back(world.observe((i*BENCH_FRAME_MARKERS + j) % numLandmarks));
+        }
+        seif.update(frame);
+    });
+
+    if(ekf.getNumRejectedUpdates() + ukf.getNumRejectedUpdates() > 0)
+    {
+        std::printf("        %d correction steps rejected\n", ekf.getNumRejectedUpdates() + ukf.getNumRejectedUpdates());
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    std::vector<int> landmarkCounts;
+    bool bCheckOnly = false;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--check") == 0)
+        {
+            bCheckOnly = true;
+            continue;
+        }
+        landmarkCounts.push_back(std::atoi(argv[i]));
+    }
+    if(landmarkCounts.empty())
+    {
+        landmarkCounts.push_back(5);
+        landmarkCounts.push_back(50);
+        landmarkCounts.push_back(500);
+        landmarkCounts.push_back(2000);
+    }
+
+    bool bWrapOk = checkAngleWrap();
+    bool bCorrectionsOk = checkCorrections();
+    bool bFloatOk = checkUnscentedFloat();
+    if(!bWrapOk || !bCorrectionsOk || !bFloatOk)
+    {
+        return 1;
+    }
+    if(bCheckOnly)
+    {
+        return 0;
+    }
+
+    std::printf("%6s  %-10s %10s %14s %12s %10s\n", "N", "op", "iters", "ns/op", "bytes/op", "allocs/op");
+    benchAngleWrap();
+    for(int i = 0; i < landmarkCounts.size(); ++i)
+    {
+        benchLandmarkCount(landmarkCounts[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include "turtlebot3_gazebo/ekf_capture.h"
+
+#include <cstring>
+#include <stdint.h>
+
+
+static const char captureMagic[4] = {'E', 'K', 'F', 'C'};
+
+template <typename T>
+static void writeValue(std::ofstream &file, T value)
+{
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static bool readValue(std::ifstream &file, T &value)
+{
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+
+bool CaptureWriter::open(const std::string &path)
+{
+    file.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!file)
+    {
+        return false;
+    }
+    file.write(captureMagic, sizeof(captureMagic));
+    writeValue<uint32_t>(file, EKF_CAPTURE_VERSION);
+    return file.good();
+}
+
+void CaptureWriter::writeMotion(double stamp, double linVel, double angVel)
+{
+    writeValue<uint8_t>(file, CAPTURE_MOTION);
+    writeValue<double>(file, stamp);
+    writeValue<double>(file, linVel);
+    writeValue<double>(file, angVel);
+}
+
+void CaptureWriter::writeMarkers(double stamp, const std::vector<LandmarkObservation> &observations)
+{
+    writeValue<uint8_t>(file, CAPTURE_MARKERS);
+    writeValue<double>(file, stamp);
+    writeValue<uint32_t>(file, observations.size());
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        writeValue<int32_t>(file, observations[i].landmarkId);
+        writeValue<double>(file, observations[i].range);
+        writeValue<double>(file, observations[i].bearing);
+    }
+}
+
+void CaptureWriter::writeTruth(double stamp, double x, double y, double th)
+{
+    writeValue<uint8_t>(file, CAPTURE_TRUTH);
+    writeValue<double>(file, stamp);
+    writeValue<double>(file, x);
+    writeValue<double>(file, y);
+    writeValue<double>(file, th);
+}
+
+
+bool CaptureReader::open(const std::string &path)
+{
+    file.open(path.c_str(), std::ios::in | std::ios::binary);
+    if(!file)
+    {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version;
+    if(!file.read(magic, sizeof(magic)) || std::memcmp(magic, captureMagic, sizeof(magic)) != 0 ||
+       !readValue(file, version) || version != EKF_CAPTURE_VERSION)
+    {
+        std::cout << "Not an EKF capture (version " << EKF_CAPTURE_VERSION << "): " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Stops the reading on a bad record, so that a partial capture is not taken for a whole one
+bool CaptureReader::fail(const char *reason)
+{
+    std::cout << "Bad capture record " << numRecords << ": " << reason << std::endl;
+    bError = true;
+    return false;
+}
+
+bool CaptureReader::next(CaptureRecord &record)
+{
+    if(bError)
+    {
+        return false;
+    }
+
+    // The end of the file is only a clean end of the capture in between records
+    uint8_t type;
+    if(!readValue(file, type))
+    {
+        return file.eof() && file.gcount() == 0 ? false : fail("read error");
+    }
+    if(!readValue(file, record.stamp))
+    {
+        return fail("truncated");
+    }
+    record.type = type;
+
+    bool bComplete = true;
+    switch(record.type)
+    {
+        case CAPTURE_MOTION:
+            bComplete = readValue(file, record.linVel) && readValue(file, record.angVel);
+            break;
+
+        case CAPTURE_MARKERS:
+        {
+            // The count sizes the observations, so it is checked before anything gets allocated for it
+            uint32_t count;
+            if(!readValue(file, count))
+            {
+                return fail("truncated");
+            }
+            if(count > EKF_CAPTURE_MAX_OBSERVATIONS)
+            {
+                return fail("too many observations");
+            }
+            record.observations.resize(count);
+            for(int i = 0; i < count && bComplete; ++i)
+            {
+                int32_t landmarkId;
+                bComplete = readValue(file, landmarkId) && readValue(file, record.observations[i].range) &&
+                            readValue(file, record.observations[i].bearing);
+                record.observations[i].landmarkId = landmarkId;
+            }
+            break;
+        }
+
+        case CAPTURE_TRUTH:
+            bComplete = readValue(file, record.x) && readValue(file, record.y) && readValue(file, record.th);
+            break;
+
+        default:
+            return fail("unknown record type");
+    }
+    if(!bComplete)
+    {
+        return fail("truncated");
+    }
+    numRecords += 1;
+    return true;
+}
@@ -0,0 +1,118 @@
+#include "turtlebot3_gazebo/ekf_input_queue.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+
+// Heap order for a min heap on stamp
+static bool isLater(const EkfInput &a, const EkfInput &b)
+{
+    return a.stamp > b.stamp;
+}
+
+
+EkfInputQueue::EkfInputQueue(int capacity, double reorderWindow) :
+slots(std::max(capacity, 1)),
+head(0),
+count(0),
+bClosed(false),
+numDropped(0),
+reorderWindow(reorderWindow),
+newestStamp(-std::numeric_limits<double>::max()),
+lastPoppedStamp(-std::numeric_limits<double>::max()),
+numLate(0)
+{
+    pending.reserve(slots.size());
+    spare.reserve(slots.size());
+}
+
+bool EkfInputQueue::push(EkfInput &input)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(bClosed || count == slots.size())
+    {
+        numDropped += 1;
+        return false;
+    }
+    std::swap(input, slots[(head + count) % slots.size()]);
+    count += 1;
+    lastArrival = std::chrono::steady_clock::now();
+    notEmpty.notify_one();
+    return true;
+}
+
+// Moves everything on the ring into the pending heap. Called with the lock held.
+void EkfInputQueue::takeQueued()
+{
+    while(count > 0)
+    {
+        if(spare.empty())
+        {
+            spare.push_back(EkfInput());
+        }
+        pending.push_back(std::move(spare.back()));
+        spare.pop_back();
+        std::swap(pending.back(), slots[head]);
+        newestStamp = std::max(newestStamp, pending.back().stamp);
+        std::push_heap(pending.begin(), pending.end(), isLater);
+
+        head = (head + 1) % slots.size();
+        count -= 1;
+    }
+}
+
+bool EkfInputQueue::pop(EkfInput &input)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::chrono::duration<double> window(reorderWindow);
+    while(true)
+    {
+        takeQueued();
+        if(pending.empty())
+        {
+            if(bClosed)
+            {
+                return false;
+            }
+            notEmpty.wait(lock);
+            continue;
+        }
+
+        // The oldest input is due once an input reorderWindow newer has arrived, or once the inputs went quiet
+        std::chrono::duration<double> quiet = std::chrono::steady_clock::now() - lastArrival;
+        if(bClosed || newestStamp - pending.front().stamp >= reorderWindow || quiet >= window)
+        {
+            break;
+        }
+        notEmpty.wait_for(lock, window - quiet);
+    }
+
+    std::pop_heap(pending.begin(), pending.end(), isLater);
+    std::swap(input, pending.back());
+    spare.push_back(std::move(pending.back()));
+    pending.pop_back();
+
+    if(input.stamp < lastPoppedStamp)
+    {
+        numLate += 1;
+    }
+    else
+    {
+        lastPoppedStamp = input.stamp;
+    }
+    return true;
+}
+
+void EkfInputQueue::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    bClosed = true;
+    notEmpty.notify_all();
+}
+
+unsigned long EkfInputQueue::getNumDropped()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return numDropped;
+}
@@ -8,48 +8,15 @@
 #include <sensor_msgs/LaserScan.h> // Found it using "rostopic info /scan". Is located in /opt/ros/kinetic/include/sensor_msgs
 #include <vector>
 
+#include "turtlebot3_gazebo/angle.h" // normalizeAngle()
+#include "turtlebot3_gazebo/lidar_landmark.h"
 
 #define PI 3.14159265
 #define STATIC_INF std::numeric_limits<float>::max()
-
-
-
-double normalizeAngle(double angle)
-{
-	double output;
-	//double rem = std::abs(angle) % PI;
-	double rem = std::fmod(std::abs(angle), PI);
-	double quo = (std::abs(angle) - rem) / PI;
-
-	int oddQuo = std::fmod(quo, 2);
-	// Positive angle input or 0
-	if (angle >= 0)
-	{
-		if (oddQuo == 0)
-		{
-			output = rem;
-		}
-		else
-		{
-			output = -(PI - rem);
-		}
-	}
-	// Negative Angle received
-	else
-	{
-		if (oddQuo == 0)
-		{
-			output = -rem;
-		}
-		else
-		{
-			output = (PI - rem);
-		}
-	}
-
-	return output;
-}
-
+#define LIDAR_JUMP_DISTANCE 0.1 // [m] Gap between consecutive returns that splits two landmarks
+#define LIDAR_MIN_POINTS 3 // Fewer returns than this are not trusted as a landmark
+#define LIDAR_MAX_WIDTH 0.5 // [m] Wider clusters are walls, not landmarks
+#define LIDAR_RANGE_VARIANCE 0.0001 // [m^2] 1cm of range noise
 
 
 class TurtleEkf
@@ -192,101 +159,19 @@ public:
     // Also behaves as the sensorModel()
     static void cbLidar(const sensor_msgs::LaserScan::ConstPtr &msg)
     {
-        double angleMin = msg->angle_min;
-        double angleInc = msg->angle_increment;
-
-        // std::vector<double> lidarRange = msg->ranges;
-        std::vector<float> lidarRange = msg->ranges;
-        // std::vector<double> lidarIntensity = msg.intensities;
-
-        // std::cout << "--- LIDAR ---" << std::endl;
-        // for (float ray : lidarRange)
-        // {
-
-        //     // Considering only finite ranges
-        //     if (ray >= std::numeric_limits<float>::max())
-        //     {
-        //         std::cout << "LEL";
-        //         continue;
-        //     }
-        //     std::cout << ray << ", ";
-        // }
-        // std::cout << std::endl;
-        // std::cout << "--- /LIDAR ---" << std::endl;
-
-        //?? Assuming all lidar points belong to this one landmark
-        // So taking avg of the range and heading of these lidar points, for this single landmark
-        double avgRange = 0;
-        int ctr = 0;
-        for (int i = 0; i < lidarRange.size(); ++i)
-        {
-            if (lidarRange[i] < STATIC_INF)
-            {
-                avgRange += lidarRange[i];
-                ctr += 1;
-            }
-        }
-        avgRange /= ctr;
+        // Static since the callback is. Kept across scans so that the sin/cos tables and clusters get reused
+        static LidarSegmenter segmenter(LIDAR_JUMP_DISTANCE, LIDAR_MIN_POINTS, LIDAR_MAX_WIDTH, LIDAR_RANGE_VARIANCE);
+        static LidarClusterList clusters;
 
-        double headingStart = 0;
-        double headingStop = 0;
-        double headingMiddle = 0;
-        for (int i = 0; i < lidarRange.size()-1; ++i)
-        {
-            if(lidarRange[i] >= STATIC_INF && lidarRange[i+1] < STATIC_INF)
-            {
-                headingStart = (i+1)*angleInc;
-                break;
-            }
-        }
-        headingStart = normalizeAngle(headingStart);
+        // Each cluster of returns is one landmark, instead of averaging all the lidar points as the single landmark
+        segmenter.segment(msg->ranges, msg->angle_min, msg->angle_increment, msg->range_min, msg->range_max, clusters);
 
-        for (int i = 0; i < lidarRange.size()-1; ++i)
-        {
-            if(lidarRange[i] < STATIC_INF && lidarRange[i+1] >= STATIC_INF)
-            {
-                headingStop = i*angleInc;
-            }
-        }        
-        headingStop = normalizeAngle(headingStop);
-
-        // Heading points are in the positive half. Take avg and assign +ve sign
-        if ( (headingStart > 0) && (headingStart <= PI) && (headingStop > 0) && (headingStop <= PI) )
-        {
-            headingMiddle = std::abs(headingStop + headingStart) / 2.0;
-        }
-        // Heading points are in the negative half. Take avg and assign -ve sign
-        else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop < 0) && (headingStop >= -PI) )
-        {
-            headingMiddle = - std::abs(headingStop + headingStart) / 2.0;
-        }
-        // Start point is in positive half and stop is in the negative half. 
-        // Find actual measurement angle viz complement of direct angle. Half of this angle measurement to be added to start and normalized
-        else if ( (headingStart > 0) && (headingStart <= PI) && (headingStop < 0) && (headingStop >= -PI) )
-        {
-            double measurementAngle  = 2*PI - (std::abs(headingStart) + std::abs(headingStop));
-            headingMiddle = normalizeAngle( headingStart + measurementAngle/2.0 );
-        }
-        // Start point is in negative half and stop point is in the positive half
-        // Find angle range in between the start and stop points. Assign sign based on which is larger in magnitude
-        else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop > 0) && (headingStop <= PI) )
+        std::cout << "LIDARLIDARLIDAR" << std::endl;
+        for (int i = 0; i < clusters.size(); ++i)
         {
-            double measurementAngle  = std::abs(headingStart) + std::abs(headingStop);
-            if ( std::abs(headingStop) >= std::abs(headingStart) ) // Will fall on positive side
-            {
-                headingMiddle = + ( measurementAngle/2.0 - std::abs(headingStart) );
-            }
-            else // Will fall on negative side
-            {
-                headingMiddle = - ( measurementAngle/2.0 - std::abs(headingStop) );
-            }
+            std::cout << "Range, Angle, Points: " << clusters[i].range << ", " << clusters[i].bearing << ", " << clusters[i].numPoints << std::endl;
         }
 
-
-        std::cout << "LIDARLIDARLIDAR" << std::endl;
-        std::cout << "StartAngle, StopAngle, MidAngle: " << headingStart << ", " << headingStop << ", " << headingMiddle << std::endl;
-        std::cout << "Range, Angle: " << avgRange << ", " << headingMiddle << std::endl;
-
         // Eigen::VectorXd predictedStates = states; //?? May not be needed to make a copy.
 
         // landmarkId = 1; // Setting it manuall this time
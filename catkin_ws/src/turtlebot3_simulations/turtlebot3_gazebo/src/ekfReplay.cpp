@@ -0,0 +1,148 @@
+// Offline replay of a captured run (see ekf_capture.h) through the EKF, as fast as the CPU allows.
+// Time steps come from the record stamps instead of wall time, so a 10 minute run replays in seconds.
+// Usage: ekf_replay <capture file> [sequential] [unscented] [isam2]
+//   sequential: correct one marker at a time instead of the joint batched correction
+//   unscented: linearize with sigma points instead of the Jacobians (see EkfSlam::setUnscented())
+//   isam2: run the iSAM2 backend (see IsamSlam) instead of the EKF, on the same inputs and noise
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_capture.h"
+#include "turtlebot3_gazebo/ekf_slam.h"
+#include "turtlebot3_gazebo/isam_slam.h"
+#include "turtlebot3_gazebo/slam_backend.h"
+
+#define NUM_LANDMARKS 5 // Initial landmark capacity of the state, grows as more landmarks get seen
+#define HISTORY_SIZE 1 // Records are replayed in order, so no prediction is ever undone
+#define ISAM_RELINEARIZE_THRESH 0.1 // Same as the ~isam_relinearize_threshold default of the node
+
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        std::cout << "Usage: ekf_replay <capture file> [sequential] [unscented] [isam2]" << std::endl;
+        return 1;
+    }
+    bool bBatchCorrection = true;
+    bool bUnscented = false;
+    bool bIsam = false;
+    for(int i = 2; i < argc; ++i)
+    {
+        bBatchCorrection = bBatchCorrection && std::strcmp(argv[i], "sequential") != 0;
+        bUnscented = bUnscented || std::strcmp(argv[i], "unscented") == 0;
+        bIsam = bIsam || std::strcmp(argv[i], "isam2") == 0;
+    }
+
+    // Load the whole capture up front so that the timing below is of the filter only
+    CaptureReader reader;
+    if(!reader.open(argv[1]))
+    {
+        return 1;
+    }
+    std::vector<CaptureRecord> records;
+    CaptureRecord record;
+    while(reader.next(record))
+    {
+        records.push_back(record);
+    }
+    if(reader.failed())
+    {
+        // A partial run would give throughput and errors that look fine but aren't of the whole capture
+        std::cout << "Capture is truncated or corrupt after " << records.size() << " records, not replaying it" << std::endl;
+        return 1;
+    }
+    if(records.empty())
+    {
+        std::cout << "Empty capture" << std::endl;
+        return 1;
+    }
+
+    // Same filter settings as the ekf node
+    std::unique_ptr<SlamBackend> filter;
+    EkfBackend *ekfBackend = NULL;
+    if(bIsam)
+    {
+        filter.reset(new IsamSlam(NUM_LANDMARKS, ISAM_RELINEARIZE_THRESH, 1));
+    }
+    else
+    {
+        ekfBackend = new EkfBackend(NUM_LANDMARKS, HISTORY_SIZE);
+        ekfBackend->ekf.setBatchCorrection(bBatchCorrection);
+        ekfBackend->ekf.setUnscented(bUnscented);
+        filter.reset(ekfBackend);
+    }
+    filter->setRobotPose(0, 0, PI/2.0);
+    filter->setLandmarkPriorVariance(100);
+    filter->setMotionNoise(Eigen::Vector3d(0.05, 0.05, 0.05).asDiagonal());
+    filter->setSensorNoise(Eigen::Vector2d(0.005, 0.005).asDiagonal());
+    filter->setAngVelThresh(0.001);
+
+    int numPredictions = 0;
+    int numCorrections = 0;
+    int numObservations = 0;
+    int numTruth = 0;
+    double sqPosErrorSum = 0;
+    double posError = 0;
+    double thError = 0;
+    double prevT = records.front().stamp;
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+    for(int i = 0; i < records.size(); ++i)
+    {
+        const CaptureRecord &rec = records[i];
+        switch(rec.type)
+        {
+            case CAPTURE_MOTION:
+                filter->predict(rec.stamp, rec.linVel, rec.angVel, rec.stamp - prevT);
+                prevT = rec.stamp;
+                numPredictions += 1;
+                break;
+
+            case CAPTURE_MARKERS:
+                numObservations += filter->update(rec.observations);
+                numCorrections += 1;
+                break;
+
+            case CAPTURE_TRUTH:
+            {
+                Eigen::Ref<const Eigen::VectorXd> states = filter->getStates();
+                posError = std::sqrt( std::pow(states(0) - rec.x, 2) + std::pow(states(1) - rec.y, 2) );
+                thError = normalizeAngle(states(2) - rec.th);
+                sqPosErrorSum += posError*posError;
+                numTruth += 1;
+                break;
+            }
+        }
+    }
+    double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    double simTime = records.back().stamp - records.front().stamp;
+
+    std::cout << "Records: " << records.size() << " over " << simTime << " s" << std::endl;
+    std::cout << "Predictions: " << numPredictions << ", corrections: " << numCorrections << " (" << numObservations << " markers, ";
+    if(bIsam)
+    {
+        std::cout << "isam2, " << static_cast<IsamSlam *>(filter.get())->getNumKeyframes() << " keyframes)" << std::endl;
+    }
+    else
+    {
+        std::cout << (bBatchCorrection ? "batched" : "sequential") << (bUnscented ? ", unscented" : "") << ")"
+                  << ", rejected: " << ekfBackend->ekf.getNumRejectedUpdates() << std::endl;
+    }
+    std::cout << "Landmarks: " << filter->getNumLandmarks() << std::endl;
+    std::cout << "Wall time: " << wallTime << " s, " << (numPredictions + numCorrections) / wallTime << " updates/s, "
+              << simTime / wallTime << "x real time" << std::endl;
+    if(numTruth > 0)
+    {
+        std::cout << "Final error: " << posError << " m, " << thError*(180/PI) << " deg" << std::endl;
+        std::cout << "RMS position error: " << std::sqrt(sqPosErrorSum / numTruth) << " m" << std::endl;
+    }
+    std::cout << "Final states: " << filter->getStates().transpose() << std::endl;
+
+    return 0;
+}
@@ -8,52 +8,44 @@
 #include <sensor_msgs/LaserScan.h> // Found it using "rostopic info /scan". Is located in /opt/ros/kinetic/include/sensor_msgs
 #include <std_msgs/Header.h>
 #include <std_msgs/Float64MultiArray.h>
+#include <std_msgs/Int32MultiArray.h>
+#include <turtlebot3_gazebo/CompactCovariance.h> // Generated from msg/CompactCovariance.msg
+#include <string>
+#include <thread>
+#include <vector>
 
-#include <deque>
+#include <atomic>
 #include <limits>
 #include <math.h>
-#include <vector>
-
-#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
-
+#include <memory>
+
+#include "turtlebot3_gazebo/ekf_input_queue.h"
+#include "turtlebot3_gazebo/ekf_slam.h"
+#include "turtlebot3_gazebo/ekf_snapshot.h"
+#include "turtlebot3_gazebo/ekf_trace.h"
+#include "turtlebot3_gazebo/fast_slam.h"
+#include "turtlebot3_gazebo/isam_slam.h"
+#include "turtlebot3_gazebo/landmark_association.h"
+#include "turtlebot3_gazebo/landmark_initializer.h"
+#include "turtlebot3_gazebo/lidar_landmark.h"
+#include "turtlebot3_gazebo/seif_slam.h"
+#include "turtlebot3_gazebo/slam_backend.h"
+#include "turtlebot3_gazebo/submap_slam.h"
 
 #define PI 3.14159265
-
-double normalizeAngle(double angle)
-{
-	double output;
-	//double rem = std::abs(angle) % PI;
-	double rem = std::fmod(std::abs(angle), PI);
-	double quo = (std::abs(angle) - rem) / PI;
-
-	int oddQuo = std::fmod(quo, 2);
-	// Positive angle input or 0
-	if (angle >= 0)
-	{
-		if (oddQuo == 0)
-		{
-			output = rem;
-		}
-		else
-		{
-			output = -(PI - rem);
-		}
-	}
-	// Negative Angle received
-	else
-	{
-		if (oddQuo == 0)
-		{
-			output = -rem;
-		}
-		else
-		{
-			output = (PI - rem);
-		}
-	}
-
-	return output;
-}
+#define NUM_LANDMARKS 5 // Initial landmark capacity of the state, grows as more landmarks get seen
+#define INPUT_QUEUE_SIZE 256 // Inputs the filter thread can fall behind by before they get dropped
+#define REORDER_WINDOW 0.02 // [s] How long inputs are held back to sort them by stamp. Later markers go through the history
+#define HISTORY_SIZE 128 // Predictions that can be undone for a late marker, 1.28s of /cmd_vel at 100Hz
+#define ASSOCIATION_CELL 1.0 // [m] Grid cell of the landmark index, observations are only gated against landmarks this close
+#define ASSOCIATION_GATE 9.21 // Squared Mahalanobis distance, chi-square 99% for 2 dof
+#define ASSOCIATION_NEW_LANDMARK 13.82 // Beyond this from every landmark an observation is a new landmark, chi-square 99.9%
+#define ASSOCIATION_TENTATIVE_RADIUS 0.3 // [m] Same as the buffer of the landmark initializer
+#define ASSOCIATION_TENTATIVE_FRAMES 100 // Scans a landmark not in the state yet can go unseen before its id is reused
+#define ASSOCIATION_REBUILD_PERIOD 50 // Frames between rebuilds of the landmark index
+#define UNLABELLED_FIRST_ID 1024 // Ids given to landmarks seen without one, past the Aruco ids
+#define LIDAR_MIN_POINTS 3 // Returns a lidar landmark needs
+#define LIDAR_RANGE_VARIANCE 0.0001 // [m^2] 1cm of range noise
 
 
 
@@ -62,9 +54,12 @@ class TurtleEkf
 
 private:
     ros::NodeHandle n;
+    ros::NodeHandle pn; // Private handle for node params
     ros::Publisher turtle_vel;
     ros::Publisher turtle_states;
-    ros::Publisher turtle_variances;    
+    ros::Publisher turtle_variances;
+    ros::Publisher turtle_covariance;
+    ros::Publisher turtle_landmark_ids;
     ros::Subscriber turtle_odom;
     ros::Subscriber turtle_lidar;
     ros::Subscriber turtle_aruco;
@@ -72,97 +67,188 @@ private:
     double globalTStart;
     double prevT;
     double timeThresh;
-    double angVelThresh;
 
     double angVel;
     double linVel;
 
     float INF; // float type since lidar vals are in float
 
-    int numModelStates;
-    int numLandmarks;
-    int numTotStates;
-    int numComponents;
-
-    Eigen::VectorXd predictedStates; // Prev State vector also being maintained since while calc of variance, prevState vec would be reqd, 
-                                // but the states would have already been updated as per motion eqns
-    Eigen::VectorXd states; // ie. Corrected States
-    Eigen::MatrixXd predictedVariances;    
-    Eigen::MatrixXd variances;
-    Eigen::MatrixXd Fx;
-    Eigen::VectorXd bSeenLandmark;
-
-    Eigen::MatrixXd RmotionCovar;
-    Eigen::MatrixXd QsensorCovar;
+    // Filter core, picked by the ~backend param: "ekf" (EkfSlam with the history for late markers), "seif"
+    // (SeifSlam, constant time steps for large marker fields), "submap" (SubmapSlam, bounded steps for long runs),
+    // "fastslam" (FastSlam, particles with O(log N) landmark updates) or "isam2" (IsamSlam, incremental smoothing of
+    // the keyframes). Its state grows as new landmarks are seen.
+    std::unique_ptr<SlamBackend> filter;
 
     bool bTestMotionModelOnly;
-    bool bAllDebugPrint;
-    bool bSensorModelUpdating;
 
-    int landmarkTempLength;
-    double landmarkVarianceThresh;
-    std::map<int, std::deque<double>> landmarkTempListX; // (landmarkId, x coords)
-    std::map<int, std::deque<double>> landmarkTempListY; // (landmarkId, y coords)
+    // The callbacks only queue their inputs. The filter thread is the one thread that steps the filter, so the
+    // callbacks never wait on the correction step. Everything that reads the filter output goes through the snapshots.
+    EkfInputQueue inputs;
+    std::thread filterThread;
+    EkfInput motionInput; // Reused by each callback. ROS doesn't run a callback concurrently with itself
+    EkfInput markersInput;
+    EkfInput scanInput;
+    EkfSnapshotBuffer snapshots; // States only, after every filter step
+    EkfSnapshotBuffer covarianceSnapshots; // States and variances (or marginals), after the first filter step once requested
+    std::atomic<bool> bCovarianceRequested; // Set by the covariance timer, so that the variances are only copied (or recovered) at its rate
+    Eigen::MatrixXd landmarkMarginals; // Filter thread only, for the backends without cheap variances
+
+    // Outgoing messages, reused so that publishing doesn't reallocate their data
+    std_msgs::Int32MultiArray msgIds;
+    std_msgs::Float64MultiArray msgStates;
+    std_msgs::Float64MultiArray msgVariances;
+    turtlebot3_gazebo::CompactCovariance msgCovariance;
+    bool bPackedCovariance; // Also send the upper triangle of the variances in /turtle/covariance
+    ros::Timer statesTimer;
+    ros::Timer covarianceTimer;
+    unsigned long statesSeqSent; // Snapshot last sent by each timer
+    unsigned long covarianceSeqSent;
+
+    std::vector<LandmarkObservation> observations; // Markers of landmarks in the state. Reused across filter steps to avoid reallocating
+    std::vector<LandmarkObservation> frame; // Markers of the input being applied, with the ids from the association
+
+    // Ids for observations that come without one (landmarkId < 0). Needs the 2x2 innovation covariance, so only with
+    // the ekf and fastslam backends, the others drop them.
+    LandmarkAssociator associator;
+    bool bAssociation;
+
+    LandmarkMleInitializer landmarkInitializer; // Prior of new landmarks from their first few sightings
+
+    // Landmarks from /scan, with the ~use_scan param. Queued without ids, as observations for the association
+    LidarSegmenter segmenter;
+    LidarClusterList clusters; // Reused by cbLidar()
 
 public:
     TurtleEkf() :
     // INF(std::numeric_limits<float>::max()), // Using such a large number can make the inversion in the update step very sensitive to numerical errors
     INF(100),
-    numModelStates(3),
-    numLandmarks(5),
-    numTotStates(numModelStates + 2*numLandmarks),
-    numComponents(2),
-    predictedStates(Eigen::VectorXd::Zero(numTotStates)),
-    states(Eigen::VectorXd::Zero(numTotStates)),
-    predictedVariances(Eigen::MatrixXd::Zero(numTotStates, numTotStates)),    
-    variances(Eigen::MatrixXd::Zero(numTotStates, numTotStates)),
-    Fx (Eigen::MatrixXd::Zero(numModelStates, numTotStates)), 
-    bSeenLandmark(Eigen::VectorXd::Zero(numLandmarks)),
     bTestMotionModelOnly(0),
-    timeThresh(6), 
-    angVelThresh(0.001),
-    bAllDebugPrint(1),
-    bSensorModelUpdating(0),
-    landmarkVarianceThresh(0.1), // 0.3 meters buffer
-    landmarkTempLength(30)
+    timeThresh(6),
+    inputs(INPUT_QUEUE_SIZE, REORDER_WINDOW),
+    landmarkInitializer(30, 0.1), // 30 samples, 0.3 meters buffer. Set from the params below
+    associator(ASSOCIATION_CELL, ASSOCIATION_GATE, ASSOCIATION_NEW_LANDMARK, ASSOCIATION_TENTATIVE_RADIUS,
+               ASSOCIATION_TENTATIVE_FRAMES, ASSOCIATION_REBUILD_PERIOD, UNLABELLED_FIRST_ID),
+    segmenter(0.1, LIDAR_MIN_POINTS, 0.5, LIDAR_RANGE_VARIANCE), // Set from the params below
+    pn("~"),
+    bCovarianceRequested(true)
     {
+        std::string backend;
+        pn.param<std::string>("backend", backend, "ekf");
+        bAssociation = (backend != "seif" && backend != "submap" && backend != "isam2");
+        if(backend == "seif")
+        {
+            int maxActive, numRelaxPerStep;
+            pn.param("seif_max_active", maxActive, 6); // Landmarks linked to the robot, the steps are O(maxActive^3)
+            pn.param("seif_relax_per_step", numRelaxPerStep, 10); // Passive landmark means recovered per step
+            filter.reset(new SeifSlam(NUM_LANDMARKS, maxActive, numRelaxPerStep));
+        }
+        else if(backend == "fastslam")
+        {
+            int numParticles, numThreads;
+            pn.param("fastslam_particles", numParticles, 100);
+            pn.param("fastslam_threads", numThreads, 0); // Particles are split between this many threads, 0 for one per core
+            filter.reset(new FastSlam(NUM_LANDMARKS, numParticles, numThreads));
+        }
+        else if(backend == "isam2")
+        {
+            double relinearizeThreshold;
+            int relinearizeSkip;
+            pn.param("isam_relinearize_threshold", relinearizeThreshold, 0.1); // Variables that moved less keep their linearization
+            pn.param("isam_relinearize_skip", relinearizeSkip, 1); // Keyframes between relinearization checks
+            filter.reset(new IsamSlam(NUM_LANDMARKS, relinearizeThreshold, relinearizeSkip));
+        }
+        else if(backend == "submap")
+        {
+            int maxLandmarks;
+            double maxDistance; // [m]
+            pn.param("submap_max_landmarks", maxLandmarks, 20); // A new submap is started after this many landmarks
+            pn.param("submap_max_distance", maxDistance, 5.0); // or this distance travelled
+            SubmapSlam *submapBackend = new SubmapSlam(NUM_LANDMARKS, HISTORY_SIZE, maxLandmarks, maxDistance);
+            bool bBatchCorrection;
+            pn.param("batch_correction", bBatchCorrection, true);
+            submapBackend->ekf.setBatchCorrection(bBatchCorrection);
+            bool bUnscented;
+            pn.param("unscented", bUnscented, false);
+            submapBackend->ekf.setUnscented(bUnscented);
+            filter.reset(submapBackend);
+        }
+        else
+        {
+            if(backend != "ekf")
+            {
+                ROS_WARN_STREAM("Unknown backend " << backend << ", using ekf");
+            }
+            EkfBackend *ekfBackend = new EkfBackend(NUM_LANDMARKS, HISTORY_SIZE);
+            bool bBatchCorrection; // Fuse all markers of one MarkerArray in a single joint update
+            pn.param("batch_correction", bBatchCorrection, true);
+            ekfBackend->ekf.setBatchCorrection(bBatchCorrection);
+            bool bUnscented; // Linearize with sigma points instead of the Jacobians
+            pn.param("unscented", bUnscented, false);
+            ekfBackend->ekf.setUnscented(bUnscented);
+            filter.reset(ekfBackend);
+        }
+        int initWindow;
+        double initVarianceThresh; // [m^2]
+        pn.param("init_window", initWindow, 30); // Sightings a new landmark is initialized from
+        pn.param("init_variance_thresh", initVarianceThresh, 0.1); // Largest variance of those sightings, along any direction
+        landmarkInitializer.setWindow(initWindow, initVarianceThresh);
+        bool bUseScan;
+        double lidarJumpDistance, lidarMaxWidth; // [m]
+        pn.param("use_scan", bUseScan, false);
+        pn.param("lidar_jump_distance", lidarJumpDistance, 0.1); // Gap between returns that splits two landmarks
+        pn.param("lidar_max_width", lidarMaxWidth, 0.5); // Wider clusters are walls
+        segmenter = LidarSegmenter(lidarJumpDistance, LIDAR_MIN_POINTS, lidarMaxWidth, LIDAR_RANGE_VARIANCE);
+        if(bUseScan && !bAssociation)
+        {
+            ROS_WARN_STREAM("The " << backend << " backend can't associate the /scan landmarks, they will be dropped");
+        }
+        pn.param("packed_covariance", bPackedCovariance, false);
+        double statesRate, covarianceRate; // [Hz]
+        pn.param("states_rate", statesRate, 50.0);
+        pn.param("covariance_rate", covarianceRate, 2.0);
+        statesSeqSent = covarianceSeqSent = -1;
+        observations.reserve(NUM_LANDMARKS);
+        frame.reserve(NUM_LANDMARKS);
+        markersInput.observations.reserve(NUM_LANDMARKS);
+        scanInput.observations.reserve(NUM_LANDMARKS);
         ROS_INFO("Started Node: efk_singleBlock");
         ROS_INFO_STREAM("Started Node: efk_singleBlock");
 
         // Init the publishers and subscribers
         turtle_states = n.advertise<std_msgs::Float64MultiArray>("/turtle/states", 10);
-        turtle_variances = n.advertise<std_msgs::Float64MultiArray>("/turtle/variances", 10);
+        turtle_variances = n.advertise<std_msgs::Float64MultiArray>("/turtle/variances", 10); // Full matrix, only packed while subscribed to
+        turtle_covariance = n.advertise<turtlebot3_gazebo::CompactCovariance>("/turtle/covariance", 10);
+        statesTimer = n.createTimer(ros::Duration(1.0/statesRate), &TurtleEkf::cbPublishStates, this);
+        covarianceTimer = n.createTimer(ros::Duration(1.0/covarianceRate), &TurtleEkf::cbPublishCovariance, this);
+        turtle_landmark_ids = n.advertise<std_msgs::Int32MultiArray>("/turtle/landmark_ids", 10); // Aruco id of each landmark in /turtle/states
         turtle_motion = n.subscribe("/cmd_vel", 10, &TurtleEkf::cbMotionModel, this);  // turtle_odom = n.subscribe("/odom", 10, cbOdom);
         // turtle_odom = n.subscribe("/odom", 10, &TurtleEkf::cbOdom, this);  // turtle_odom = n.subscribe("/odom", 10, cbOdom);
         if(! bTestMotionModelOnly)
         {
-            // turtle_lidar = n.subscribe("/scan", 10, &TurtleEkf::cbLidar, this);  // turtle_lidar = n.subscribe("/scan", 10, cbLidar);
+            if(bUseScan)
+            {
+                turtle_lidar = n.subscribe("/scan", 10, &TurtleEkf::cbLidar, this);  // turtle_lidar = n.subscribe("/scan", 10, cbLidar);
+            }
             turtle_aruco = n.subscribe("/aruco_marker_publisher/markers", 10, &TurtleEkf::cbSensorModel, this);  // turtle_odom = n.subscribe("/odom", 10, cbOdom);
         }
 
         // Init theta to PI/2 as per X axis definition: perp to the right
-        predictedStates(2) = PI/2.0;        
-        states(2) = PI/2.0;
+        filter->setRobotPose(0, 0, PI/2.0);
 
         // Set landmark variances to inf
-        predictedVariances.bottomRightCorner(2*numLandmarks, 2*numLandmarks) = Eigen::MatrixXd::Constant(2*numLandmarks, 2*numLandmarks, INF);
-        predictedVariances.topRightCorner(numModelStates, 2*numLandmarks) = Eigen::MatrixXd::Constant(numModelStates, 2*numLandmarks, INF);
-        predictedVariances.bottomLeftCorner(2*numLandmarks, numModelStates) = Eigen::MatrixXd::Constant(2*numLandmarks, numModelStates, INF);
-        variances.bottomRightCorner(2*numLandmarks, 2*numLandmarks) = Eigen::MatrixXd::Constant(2*numLandmarks, 2*numLandmarks, INF);
-        variances.topRightCorner(numModelStates, 2*numLandmarks) = Eigen::MatrixXd::Constant(numModelStates, 2*numLandmarks, INF);
-        variances.bottomLeftCorner(2*numLandmarks, numModelStates) = Eigen::MatrixXd::Constant(2*numLandmarks, numModelStates, INF);
-
-        Fx.topLeftCorner(numModelStates, numModelStates) = Eigen::MatrixXd::Identity(numModelStates, numModelStates);
+        filter->setLandmarkPriorVariance(INF);
 
-        Eigen::VectorXd tmp1 (3);
+        Eigen::Vector3d tmp1;
         tmp1 << 0.05, 0.05, 0.05; // 0.05m 0.05m 0.05rad of variance
         // tmp1 << 0.05, 0.05, 0.005;
-        RmotionCovar = tmp1.asDiagonal();
+        filter->setMotionNoise(tmp1.asDiagonal());
 
-        Eigen::VectorXd tmp2 (2);
+        Eigen::Vector2d tmp2;
         tmp2 << 0.005, 0.005; // 0.005m 0.005m of variance. Lidar data is much more reliable from simulation that estimated motion model
         // tmp2 << 0.005, 0.005;
-        QsensorCovar = tmp2.asDiagonal();
+        filter->setSensorNoise(tmp2.asDiagonal());
+
+        filter->setAngVelThresh(0.001);
 
         globalTStart = ros::Time::now().toSec();
         prevT = globalTStart;
@@ -175,210 +261,144 @@ public:
     {
         std::cout << "INIT STATES" << std::endl;
         std::cout << "INF " << INF << std::endl;
-        std::cout << "numModelStates " << numModelStates << std::endl;
-        std::cout << "numLandmarks " << numLandmarks << std::endl;
-        std::cout << "numTotStates " << numTotStates << std::endl;
-        std::cout << "numComponents " << numComponents << std::endl;
-        std::cout << "predictedStates " << predictedStates << std::endl;
-        std::cout << "states " << states << std::endl;
-        std::cout << "predictedVariances " << predictedVariances << std::endl;
-        std::cout << "variances " << variances << std::endl;
-        std::cout << "Fx " << Fx << std::endl;
-        std::cout << "RmotionCovar " << RmotionCovar << std::endl;
-        std::cout << "QsensorCovar" << QsensorCovar << std::endl;
-
+        filter->display();
     }
 
     void cbMotionModel(const geometry_msgs::Twist &msg)
     {
+        motionInput.type = INPUT_MOTION;
+        motionInput.stamp = ros::Time::now().toSec(); // Twist has no header
+        motionInput.linVel = msg.linear.x;
+        motionInput.angVel = msg.angular.z;
+        inputs.push(motionInput);
+    };
 
-        //delta_t calc
-        double currT = ros::Time::now().toSec();
-        double deltaT = currT - prevT;
-        prevT = currT;
-
-        linVel = msg.linear.x;
-        angVel = msg.angular.z;
-
-        std::cout << "%%%%%%%%%%%%%" << std::endl;
-        std::cout << linVel << "," << angVel << std::endl;
-        std::cout << deltaT << "," << angVel*deltaT << std::endl;
-    
-        if (std::abs(angVel) > angVelThresh)
-        {
-            double r = linVel/angVel;
 
-            //?? ADD other condition of angles 
-            predictedStates(0) = states(0) + ( -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT) );
-            predictedStates(1) = states(1) + ( +r*cos(states(2)) - r*cos(states(2) + angVel*deltaT) );
-            predictedStates(2) = states(2) + angVel*deltaT;
+    void cbSensorModel(const aruco_msgs::MarkerArray::Ptr &msg)
+    {
+        EKF_TRACE(TRACE_MARKERS, msg->markers.size(), 0, 0, 0, 0);
 
-        }
-        else
+        markersInput.type = INPUT_MARKERS;
+        markersInput.stamp = msg->header.stamp.isZero() ? ros::Time::now().toSec() : msg->header.stamp.toSec(); // Time the image was taken
+        markersInput.observations.clear();
+        for(int i=0; i<msg->markers.size(); ++i)
         {
-            double dist = linVel*deltaT;
-            // ADD other condition of angles 
-            predictedStates(0) = states(0) - dist*cos(states(2));
-            predictedStates(1) = states(1) + dist*sin(states(2));
-            predictedStates(2) = states(2);
-
-            // double r = linVel*deltaT;
-            // predictedStates(0) = states(0) + ( -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT) );
-            // predictedStates(1) = states(1) + ( +r*cos(states(2)) - r*cos(states(2) + angVel*deltaT) );
-            // predictedStates(2) = states(2) + angVel*deltaT;
-
-        }
 
-        predictedStates(2) = normalizeAngle(predictedStates(2));
+            aruco_msgs::Marker &marker_i = msg->markers.at(i);
+            double x = marker_i.pose.pose.position.x;
+            double z = marker_i.pose.pose.position.z;
+            double avgRange = z;
+            double headingMiddle = -std::atan2(x,z); // negated so that angle is positive to the LHS of robot
 
-        if(bAllDebugPrint)
-        {
-            //??prt
-            std::cout << "Predicted states = " << std::endl;
-            std::cout << predictedStates << std::endl;
-            // std::cout << "X', Y', Th': " << states(0) << ", " << states(1) << ", " << states(2) << std::endl;
-        }
+            LandmarkObservation obs;
+            obs.landmarkId = marker_i.id; // Aruco id. Mapped to a slot in the state when the landmark is first added
+            obs.range = avgRange;
+            obs.bearing = headingMiddle;
+            markersInput.observations.push_back(obs);
 
-        // states = predictedStates;
-    // };
+        } // End for each landmark
 
-    // void motionModelVariance(double angVel, double linVel, double deltaT)
-    // {
-        double derivXTh, derivYTh;
-    
-        if (std::abs(angVel) > angVelThresh)
-        {
-            double r = linVel/angVel;
+        inputs.push(markersInput);
+    };
 
-            // Derivative of X and Y wrt Th
-            derivXTh = -r*cos(states(2)) + r*cos(states(2) + angVel*deltaT);
-            derivYTh = -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT);
-            // derivTh = 1 got from Identity addition
-        }
-        else
+    // Second sensor: each cluster of the scan is a landmark, without an id until the filter thread associates it
+    void cbLidar(const sensor_msgs::LaserScan::ConstPtr &msg)
+    {
+        segmenter.segment(msg->ranges, msg->angle_min, msg->angle_increment, msg->range_min, msg->range_max, clusters);
+        EKF_TRACE(TRACE_MARKERS, clusters.size(), 0, 0, 0, 0);
+        if(clusters.empty())
         {
-            double dist = linVel*deltaT;
-            // ADD other condition of angles 
-            derivXTh = dist*sin(states(2));
-            derivYTh = dist*cos(states(2));
-            // derivTh = 1 got from Identity addition
-
-            // double r = linVel*deltaT;
-            // // Derivative of X and Y wrt Th
-            // derivXTh = -r*cos(states(2)) + r*cos(states(2) + angVel*deltaT);
-            // derivYTh = -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT);
-            // // derivTh = 1 got from Identity addition
+            return;
         }
 
-        Eigen::MatrixXd tmp = Eigen::MatrixXd::Zero(numModelStates, numModelStates);
-        tmp(0,2) = derivXTh;
-        tmp(1,2) = derivYTh;
-        // Jacobian of non-linear motion model
-        Eigen::MatrixXd Gt =  Eigen::MatrixXd::Identity(numTotStates, numTotStates) + Fx.transpose() * tmp * Fx;
-
-        // Variance Calculation
-        // predictedVariances = Gt * variances * Gt.transpose(); // MUST add process/gaussian noise so that in Correction step, 
-                                                              //matrix inversion does not yield inv(0) and thus Nan after sometime
-        predictedVariances = Gt * variances * Gt.transpose() + Fx.transpose() * RmotionCovar * Fx;
-
-        if(bAllDebugPrint)
+        scanInput.type = INPUT_MARKERS;
+        scanInput.stamp = msg->header.stamp.isZero() ? ros::Time::now().toSec() : msg->header.stamp.toSec();
+        scanInput.observations.clear();
+        for(int i=0; i<clusters.size(); ++i)
         {
-            //??prt
-            // std::cout << tmp << std::endl;
-            std::cout << "Predicted variances = " << std::endl;
-            std::cout << predictedVariances << std::endl;
+            LandmarkObservation obs;
+            obs.landmarkId = -1;
+            obs.range = clusters[i].range;
+            obs.bearing = clusters[i].bearing; // base_scan is on base_footprint
+            obs.covariance = clusters[i].covariance; // From the spread of the returns, in place of the filter's Q
+            obs.bCovariance = true;
+            scanInput.observations.push_back(obs);
         }
 
-        // Perform motion update only if sensor model is not updating. Else midway through sensor model update,
-        // some states might get changed causing errors. ie. Ignore motionUpdate if in the middle of sensorUpdate
-        if(!bSensorModelUpdating)
+        inputs.push(scanInput);
+    };
+
+    // Filter thread. The only place the filter gets stepped, one input at a time in stamp order.
+    // Its output only goes to the snapshots, the timers below publish from those.
+    void filterLoop()
+    {
+        EkfInput input;
+        while(inputs.pop(input))
         {
-            states = predictedStates;
-            variances = predictedVariances;
-
-            //Send states to topic
-            std_msgs::Float64MultiArray msg;
-            // Set layout for multiarray
-            msg.layout.dim.push_back(std_msgs::MultiArrayDimension());  
-            msg.layout.dim[0].label = "states_length";
-            msg.layout.dim[0].size = states.size();
-            msg.layout.dim[0].stride = 1;
-            // Push data
-            msg.data.clear();
-            for(int i = 0; i < states.size(); ++i)
+            if(input.type == INPUT_MOTION)
             {
-                msg.data.push_back(states[i]); 
+                applyMotion(input);
             }
-            turtle_states.publish(msg);
-
-            //Send variances to topic
-            // Set layout for multiarray (Row major as per docs)
-            msg.layout.dim.push_back(std_msgs::MultiArrayDimension());  
-            msg.layout.dim[0].label = "variances_num_rows";            
-            msg.layout.dim[0].size = variances.rows();
-            msg.layout.dim[0].stride = variances.cols();
-            msg.layout.dim[1].label = "variances_num_cols";
-            msg.layout.dim[1].size = variances.cols();
-            msg.layout.dim[1].stride = 1;
-            // Push data
-            msg.data.clear();
-            for(int i = 0; i < variances.rows(); ++i)
+            else
             {
-                for(int j = 0; j < variances.cols(); ++j)
+                applyMarkers(input);
+            }
+            // Late markers get fused at their own time, but the predictions after them are applied again
+            double stamp = std::max(prevT, input.stamp);
+            snapshots.publish(filter->getStates(), filter->getLandmarkIds(), stamp);
+            if(bCovarianceRequested.exchange(false))
+            {
+                if(filter->hasCheapVariances())
+                {
+                    covarianceSnapshots.publish(filter->getStates(), filter->getVariances(), filter->getLandmarkIds(), stamp);
+                }
+                else
                 {
-                    // msg.data.push_back( variances.block(i,j,1,1) ); // mat.block(loc_row, loc_col, len_row, len_col) ... But this returns element in MatrixXd form
-                    msg.data.push_back( variances(i,j) ); // This returns just the element, in Float646/double form
+                    filter->getLandmarkMarginals(landmarkMarginals);
+                    covarianceSnapshots.publish(filter->getStates(), filter->getRobotVariances(), landmarkMarginals,
+                                                filter->getLandmarkIds(), stamp);
                 }
             }
-            turtle_variances.publish(msg);
         }
-
     };
 
-
-    void cbSensorModel(const aruco_msgs::MarkerArray::Ptr &msg)
+    void applyMotion(const EkfInput &input)
     {
-        std::cout << "ARUCOARUCO" << std::endl;
-        std::cout << msg->markers.size() << std::endl;
+        //delta_t calc
+        double deltaT = input.stamp - prevT;
+        prevT = input.stamp;
 
-        bSensorModelUpdating = 1;
-        predictedStates = states;
-        predictedVariances = variances;
+        linVel = input.linVel;
+        angVel = input.angVel;
 
+        filter->predict(input.stamp, linVel, angVel, deltaT); // Traced as TRACE_PREDICT
+    };
 
-        if(bAllDebugPrint)
-        {
-            std::cout << "Predicted states before correction step = " << std::endl;
-            std::cout << predictedStates << std::endl;
-            std::cout << "Predicted variances before correction step = " << std::endl;
-            std::cout << predictedVariances << std::endl;        
-        }
+    void applyMarkers(const EkfInput &input)
+    {
+        filter->rewind(input.stamp);
 
-        for(int i=0; i<msg->markers.size(); ++i)
+        frame.assign(input.observations.begin(), input.observations.end());
+        if(bAssociation)
         {
-
-            aruco_msgs::Marker &marker_i = msg->markers.at(i);
-            double x = marker_i.pose.pose.position.x;
-            double z = marker_i.pose.pose.position.z;
-            double avgRange = z;
-            double headingMiddle = -std::atan2(x,z); // negated so that angle is positive to the LHS of robot
-
-            int landmarkId = marker_i.id; //Was written for landmark indexes starting from 0. But Aruco markers from idx 1 are being used.
-            int stateIdx = numModelStates + 2*landmarkId;
-            std::cout << "Arucomarker idx, State idx" << std::endl;
-            std::cout << landmarkId << ", " << stateIdx << std::endl;
-            
-            if(landmarkId > 10) // Sometimes landmarkId 1023 detected. Condition to ignore such a detection.
+            associator.associate(*filter, frame);
+            const std::vector<int> &expiredIds = associator.getExpiredIds();
+            for(int i=0; i<expiredIds.size(); ++i)
             {
-                std::cout << "Detected bad aruco marker: " << landmarkId<< std::endl;
-                continue;
+                landmarkInitializer.clear(expiredIds[i]); // The id can come back for another landmark
             }
+        }
 
-            if(bAllDebugPrint)
+        observations.clear();
+        for(int i=0; i<frame.size(); ++i)
+        {
+            const LandmarkObservation &obs = frame[i];
+            if(obs.landmarkId < 0)
             {
-                std::cout << "stateIdx = " << stateIdx << std::endl;
+                continue; // No id, and too ambiguous to associate
             }
-            if ( !bSeenLandmark(landmarkId) ) // If landmark not seen before, set the prior of that landmark to global position of the landmark
+
+            if ( !filter->isLandmarkSeen(obs.landmarkId) ) // If landmark not seen before, set the prior of that landmark to global position of the landmark
             {
                 // Makes it heavily biased on this prior belief. So, use MLE and append from landmarkTempList when variance is small enough
                 // // NOTE: ujx is the state in states that corsp to this j-th landmark
@@ -394,239 +414,130 @@ public:
                 // bSeenLandmark(landmarkId) = 1;
 
                 // Max Likelihood Estimate
-                // For a Gaussian distribution this is the same as mean and variance
-                double landX = predictedStates(0) + avgRange * cos(headingMiddle + predictedStates(2));
-                double landY = predictedStates(1) + avgRange * sin(headingMiddle + predictedStates(2));
-                int sz = landmarkTempListX[landmarkId].size();
-
-                if( sz < landmarkTempLength)
-                {
-                    landmarkTempListX[landmarkId].push_back(landX);
-                    landmarkTempListY[landmarkId].push_back(landY);
-                }
-                else
-                {
-                    landmarkTempListX[landmarkId].pop_front(); // remove the oldest reading
-                    landmarkTempListY[landmarkId].pop_front(); // remove the oldest reading
-                    landmarkTempListX[landmarkId].push_back(landX);
-                    landmarkTempListY[landmarkId].push_back(landY);
-                }
-
-                //Calc mean
-                double meanX = 0;
-                double meanY = 0;
-                for (int i = 0; i<sz; ++i)
-                {
-                    meanX += landmarkTempListX[landmarkId][i];
-                    meanY += landmarkTempListY[landmarkId][i];
-                }
-                if (sz > 0)
-                {
-                    meanX /= sz;
-                    meanY /= sz;
-                }
-
-                //Calc variance
-                double varX = 0;
-                double varY = 0;
-                for (int i = 0; i<sz; ++i)
+                double landX, landY, meanX, meanY;
+                filter->landmarkFromObservation(obs.range, obs.bearing, landX, landY);
+                if( !landmarkInitializer.addSample(obs.landmarkId, landX, landY, meanX, meanY) ||
+                    filter->addLandmark(obs.landmarkId, meanX, meanY) < 0 )
                 {
-                    varX += std::pow( (landX - meanX), 2);
-                    varY += std::pow( (landY - meanY), 2);
-                }
-                if (sz)
-                {
-                    varX /= sz;
-                    varY /= sz;
-                }
-
-
-                // Initialize prior belief if variance is small enough
-                if( (sz >= landmarkTempLength) &&  // ensure sufficient number of samples of that landmark have been collected
-                    (varX < landmarkVarianceThresh && varY < landmarkVarianceThresh) ) // ensure the variance along x and y are within the threshold
-                {
-                    std::cout << "INITIALIZED prior for landmark: " << landmarkId << std::endl;
-                    std::cout << sz << std::endl;
-                    std::cout << meanX << ", " << meanY << std::endl;
-                    std::cout << varX << ", " << varY << std::endl;
-                    predictedStates(stateIdx) = meanX;
-                    predictedStates(stateIdx+1) = meanY;
-                    bSeenLandmark(landmarkId) = 1;
-                }
-                else
-                {
-                    std::cout << "NOT INITIALIZING prior for landmark: " << landmarkId << std::endl;
-                    std::cout << sz << std::endl;
-                    std::cout << meanX << ", " << meanY << std::endl;
-                    std::cout << varX << ", " << varY << std::endl;
-
                     continue; // prevent the rest of the update step from happening. Instead go to next landmark in the list of landmarks.
                 }
-
+                landmarkInitializer.clear(obs.landmarkId);
             }
 
-            double delx = predictedStates(stateIdx) - predictedStates(0);
-            double dely = predictedStates(stateIdx+1) - predictedStates(1);
-            double q = delx*delx + dely*dely;
-            if(bAllDebugPrint)
-            {
-                std::cout << "delx, dely and q = " << std::endl;
-                std::cout << delx << std::endl;
-                std::cout << dely << std::endl;
-                std::cout << q << std::endl;
-            }
+            observations.push_back(obs);
 
-            Eigen::VectorXd zj(2);
-            Eigen::VectorXd zjHat (2);
-            zj << avgRange, headingMiddle;
-            double tmpAngle = std::atan2(dely, delx) - predictedStates(2);
-            zjHat << std::sqrt(q) , normalizeAngle(tmpAngle);
-            if(bAllDebugPrint)
-            {
-                std::cout << "z and zHat = " << std::endl;
-                std::cout << zj << std::endl;
-                std::cout << zjHat << std::endl;
-            }
-
-            tmpPrint(zj, zjHat, stateIdx, tmpAngle);
-
-            Eigen::MatrixXd Fxj = Eigen::MatrixXd::Zero( (numModelStates + numComponents), numTotStates);        
-            Fxj.topLeftCorner(numModelStates,numModelStates) = Eigen::MatrixXd::Identity(numModelStates,numModelStates);
-            
-            Fxj(numModelStates, stateIdx) = 1;
-            Fxj(numModelStates+1, stateIdx+1) = 1;
-            if(bAllDebugPrint)
-            {
-                std::cout << "Fxj = " << std::endl;
-                std::cout << Fxj << std::endl;
-            }
-
-            // Partial differential of:
-            // zHat_x wrt modelX, modelY, modelTh, mx, my
-            // zHat_y wrt modelX, modelY, modelTh, mx, my
-            // H*z ==nt Cx or Hx in traditional state space model, but here input x for this step is estimated/expected sensor reading = zHat
-            Eigen::MatrixXd H (numComponents, numModelStates + numComponents);
-            Eigen::MatrixXd Hq (numComponents, numModelStates + numComponents);
-            H << 
-                -std::sqrt(q)*delx , -std::sqrt(q)*dely , 0    , std::sqrt(q)*delx   , std::sqrt(q)*dely ,
-                dely              , -delx               , -q   , -dely               , delx;        
-            Hq = (1/q) * H;
-            // H = H * (1/q);
-            // std::cout << "H = " << std::endl;
-            // std::cout << H << std::endl;
-
-            // (3+2)x(3+2n) = 5x5 for single landmark case, with each landmark being 2D
-            Eigen::MatrixXd HFxj (numTotStates, numTotStates);
-            Eigen::MatrixXd Htrans (numTotStates, numTotStates);
-            HFxj = Hq * Fxj;
-            if(bAllDebugPrint)
-            {
-                std::cout << "HFxj = " << std::endl; // Same as H since with only one obstacle, we get just F to be identity
-                std::cout << HFxj << std::endl;        
-            }
+        } // End for each landmark
 
-            Eigen::MatrixXd K (numTotStates, numComponents);
-            Eigen::MatrixXd tmp (numComponents, numComponents);
-            Eigen::MatrixXd tmpInv (numComponents, numComponents);
-            // tmp = HFxj * predictedVariances * HFxj.transpose(); // MUST add process/gaussian noise so that in Correction step, 
-                                                                //matrix inversion does not yield inv(0) and thus Nan after sometime
-            Htrans = HFxj.transpose();
-            tmp = HFxj * predictedVariances * Htrans + QsensorCovar;
-            tmpInv = tmp.inverse(); // As explained in the doc (http://eigen.tuxfamily.org/dox-devel/cl ... 030f79f9da), mat.inverse() returns the inverse of mat, keeping mat unchanged:
-            std::cout << "tmp Det" << std::endl;
-            std::cout << tmp.determinant() << std::endl;            
-            std::cout << "tmpInv" << std::endl;
-            std::cout << tmpInv << std::endl;
-            K = predictedVariances * Htrans * tmpInv; 
-
-            if(bAllDebugPrint)
-            {
-                std::cout << "K = " << std::endl;
-                std::cout << K << std::endl;
-            }
+        filter->update(observations);
+        filter->replay();
+        EKF_TRACE(TRACE_ROBOT, filter->getNumLandmarks(), filter->getStates()(0), filter->getStates()(1), filter->getStates()(2),
+                  filter->getRobotVariances().trace());
+    };
 
-            if( std::abs(tmp.determinant()) > 0.0001 ) // 10 power -4
-            {
-                predictedStates = predictedStates + K * (zj - zjHat);
-                Eigen::MatrixXd Iden (numTotStates, numTotStates);
-                Iden = Eigen::MatrixXd::Identity(numTotStates, numTotStates);
-                predictedVariances = ( Iden - K*HFxj) * predictedVariances;
-            }
-            else
-            {
-                std::cout << "UNSTABLE" << std::endl;
-            }
+    void start()
+    {
+        filterThread = std::thread(&TurtleEkf::filterLoop, this);
+    };
 
-        } // End for each landmark
+    // Applies what is still queued and waits for the filter thread to finish
+    void stop()
+    {
+        inputs.close();
+        filterThread.join();
+        std::cout << "Inputs dropped: " << inputs.getNumDropped() << ", out of order: " << inputs.getNumLate()
+                  << ", late markers: " << filter->getNumLate() << " (" << filter->getNumTooOld() << " too old to rewind)" << std::endl;
+    };
 
-        states = predictedStates;
-        variances = predictedVariances;
+    // Publishing stage. Runs off timers on the spinner threads and only reads the latest snapshot, so the filter
+    // thread never builds messages and the publish rates don't follow the input rates. A snapshot is only sent
+    // once per topic. The messages are kept across calls so that their buffers get reused.
+    void cbPublishStates(const ros::TimerEvent &event)
+    {
+        EkfSnapshotPtr snapshot = snapshots.latest();
+        if(!snapshot || snapshot->seq == statesSeqSent)
+        {
+            return;
+        }
+        statesSeqSent = snapshot->seq;
+        const Eigen::VectorXd &states = snapshot->states;
+        const std::vector<int> &landmarkIds = snapshot->landmarkIds;
+
+        //Send the landmark id of each slot, since landmarks are in the order they were first seen and not by id
+        msgIds.layout.dim.resize(1);
+        msgIds.layout.dim[0].label = "landmark_ids_length";
+        msgIds.layout.dim[0].size = landmarkIds.size();
+        msgIds.layout.dim[0].stride = 1;
+        msgIds.data.assign(landmarkIds.begin(), landmarkIds.end());
+        turtle_landmark_ids.publish(msgIds);
 
         //Send states to topic
-        std_msgs::Float64MultiArray msgSt;
         // Set layout for multiarray
-        msgSt.layout.dim.push_back(std_msgs::MultiArrayDimension());  
-        msgSt.layout.dim[0].label = "states_length";
-        msgSt.layout.dim[0].size = states.size();
-        msgSt.layout.dim[0].stride = 1;
+        msgStates.layout.dim.resize(1);
+        msgStates.layout.dim[0].label = "states_length";
+        msgStates.layout.dim[0].size = states.size();
+        msgStates.layout.dim[0].stride = 1;
         // Push data
-        msgSt.data.clear();
-        for(int i = 0; i < states.size(); ++i)
+        packStates(states, msgStates.data);
+        turtle_states.publish(msgStates);
+    };
+
+    // Sends the snapshot taken at the first filter step after the previous tick, and asks for the next one
+    void cbPublishCovariance(const ros::TimerEvent &event)
+    {
+        EkfSnapshotPtr snapshot = covarianceSnapshots.latest();
+        bCovarianceRequested = true;
+        if(!snapshot || snapshot->seq == covarianceSeqSent)
         {
-            msgSt.data.push_back(states[i]); 
+            return;
         }
-        turtle_states.publish(msgSt);
-
-        //Send variances to topic
-        // Set layout for multiarray (Row major as per docs)
-        msgSt.layout.dim.push_back(std_msgs::MultiArrayDimension());  
-        msgSt.layout.dim[0].label = "variances_num_rows";            
-        msgSt.layout.dim[0].size = variances.rows();
-        msgSt.layout.dim[0].stride = variances.cols();
-        msgSt.layout.dim[1].label = "variances_num_cols";
-        msgSt.layout.dim[1].size = variances.cols();
-        msgSt.layout.dim[1].stride = 1;
-        // Push data
-        msgSt.data.clear();
-        for(int i = 0; i < variances.rows(); ++i)
+        covarianceSeqSent = snapshot->seq;
+        const Eigen::MatrixXd &variances = snapshot->variances;
+        bool bFullVariances = variances.size() > 0; // Otherwise the backend only gave the marginals
+
+        //Send the robot block and the landmark marginals, O(numLandmarks) instead of O(numTotStates^2)
+        msgCovariance.header.stamp = ros::Time(snapshot->stamp);
+        msgCovariance.num_states = snapshot->states.size();
+        msgCovariance.num_landmarks = snapshot->landmarkIds.size();
+        for(int i = 0; i < 3; ++i)
         {
-            for(int j = 0; j < variances.cols(); ++j)
+            for(int j = 0; j < 3; ++j)
             {
-                // msgSt.data.push_back( variances.block(i,j,1,1) ); // mat.block(loc_row, loc_col, len_row, len_col) ... But this returns element in MatrixXd form
-                msgSt.data.push_back( variances(i,j) ); // This returns just the element, in Float646/double form
+                msgCovariance.robot[3*i+j] = bFullVariances ? variances(i,j) : snapshot->robotVariances(i,j);
             }
         }
-        turtle_variances.publish(msgSt);
-
-        bSensorModelUpdating = 0;
-
-        if(bAllDebugPrint)
+        if(bFullVariances)
         {
-            std::cout << "Corrected states and variances" << std::endl;
-            std::cout << states << std::endl;
-            std::cout << variances << std::endl;
+            packLandmarkMarginals(variances, msgCovariance.landmark_marginals);
         }
+        else
+        {
+            packMarginalBlocks(snapshot->landmarkMarginals, msgCovariance.landmark_marginals);
+        }
+        msgCovariance.upper_triangle.clear();
+        if(bPackedCovariance && bFullVariances)
+        {
+            packUpperTriangle(variances, msgCovariance.upper_triangle);
+        }
+        turtle_covariance.publish(msgCovariance);
 
+        //Send the full variances to topic, only while something subscribes to them
+        if(!bFullVariances || turtle_variances.getNumSubscribers() == 0)
+        {
+            return;
+        }
+        // Set layout for multiarray (Row major as per docs)
+        msgVariances.layout.dim.resize(2);
+        msgVariances.layout.dim[0].label = "variances_num_rows";
+        msgVariances.layout.dim[0].size = variances.rows();
+        msgVariances.layout.dim[0].stride = variances.cols();
+        msgVariances.layout.dim[1].label = "variances_num_cols";
+        msgVariances.layout.dim[1].size = variances.cols();
+        msgVariances.layout.dim[1].stride = 1;
+        // Push data
+        packRowMajor(variances, msgVariances.data);
+        turtle_variances.publish(msgVariances);
     };
 
-    void tmpPrint(Eigen::VectorXd z, Eigen::VectorXd zHat, int stateIdx, double tmpAngle)
-    {
-        std::cout << "-------------------------" << std::endl;
-        std::cout << "x, mX and y, mY" << std::endl;
-        std::cout << predictedStates(0) << ", " << predictedStates(1) << std::endl;
-        std::cout << predictedStates(stateIdx) << ", " << predictedStates(stateIdx+1) << std::endl;
-        std::cout << "diffs" << std::endl;
-        std::cout << predictedStates(stateIdx) - predictedStates(0) << ", " << predictedStates(stateIdx+1) - predictedStates(1) << std::endl;
-        std::cout << "theta" << std::endl;
-        std::cout << predictedStates(2) << ", " << states(2) << std::endl;
-        std::cout << "alpha" << std::endl;
-        std::cout << tmpAngle << std::endl;
-        std::cout << "z and zHat" << std::endl;
-        std::cout << z(0) << ", " << z(1)*(180/PI) << std::endl;
-        std::cout << zHat(0) << ", " << zHat(1)*(180/PI) << std::endl;
-        std::cout << "-------------------------" << std::endl;
-    }
-
 };
 
 
@@ -635,11 +546,24 @@ int main(int argc, char** argv)
     // Must perform ROS init before object creation, as node handles are created in the obj constructor
     ros::init(argc, argv, "ekf_sensorMle");
 
+    // Only written when built with -DEKF_TRACE=ON. Relative paths are in ~/.ros
+    std::string traceFile;
+    ros::NodeHandle pn("~");
+    pn.param<std::string>("trace_file", traceFile, "ekf_sensorMle_trace.bin");
+    EKF_TRACE_START(traceFile.c_str());
+
     TurtleEkf* turtlebot = new TurtleEkf(); // Init on heap so that large lidar data isn't an issue
     turtlebot->displayAll();
+    turtlebot->start();
 
-    ros::spin();
+    // The callbacks only queue inputs for the filter thread and the timers only read its snapshots, so they can run in parallel
+    ros::AsyncSpinner spinner(3);
+    spinner.start();
+    ros::waitForShutdown();
+    spinner.stop();
+    turtlebot->stop();
 
+    EKF_TRACE_STOP();
     return 0;
 }
 
@@ -651,4 +575,4 @@ int main(int argc, char** argv)
 // remains at inf, and only motion model is present so that stays fully certain at 0. Eqn wise, tmp happens to just stay really close to 0
 // Later see how it performs when some noise is incorporated. Noise to be added to v, w, th and to variance matrix as Rt.
 //?? Get rid of the the static functions in the class by using the "&" template in the subscriber description line
-//?? Replace all 2s everywhere with numLandmarkComponents OR numLandmarkDims
+//?? Replace all 2s everywhere with numLandmarkComponents OR numLandmarkDims
\ No newline at end of file
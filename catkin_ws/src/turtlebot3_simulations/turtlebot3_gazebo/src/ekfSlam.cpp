@@ -0,0 +1,57 @@
+#include "turtlebot3_gazebo/ekf_slam.h"
+
+
+void packStates(const Eigen::Ref<const Eigen::VectorXd> &states, std::vector<double> &data)
+{
+    data.assign(states.data(), states.data() + states.size());
+}
+
+void packRowMajor(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<double> &data)
+{
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrix;
+    data.resize(variances.size());
+    Eigen::Map<RowMajorMatrix>(data.data(), variances.rows(), variances.cols()) = variances;
+}
+
+void packLandmarkMarginals(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<float> &data)
+{
+    int numLandmarks = (variances.rows() - 3) / 2;
+    data.resize(4*numLandmarks);
+    for(int i = 0; i < numLandmarks; ++i)
+    {
+        int stateIdx = 3 + 2*i;
+        data[4*i] = variances(stateIdx, stateIdx);
+        data[4*i+1] = variances(stateIdx, stateIdx+1);
+        data[4*i+2] = variances(stateIdx+1, stateIdx);
+        data[4*i+3] = variances(stateIdx+1, stateIdx+1);
+    }
+}
+
+void packMarginalBlocks(const Eigen::Ref<const Eigen::MatrixXd> &marginals, std::vector<float> &data)
+{
+    int numLandmarks = marginals.cols() / 2;
+    data.resize(4*numLandmarks);
+    for(int i = 0; i < numLandmarks; ++i)
+    {
+        data[4*i] = marginals(0, 2*i);
+        data[4*i+1] = marginals(0, 2*i+1);
+        data[4*i+2] = marginals(1, 2*i);
+        data[4*i+3] = marginals(1, 2*i+1);
+    }
+}
+
+void packUpperTriangle(const Eigen::Ref<const Eigen::MatrixXd> &variances, std::vector<float> &data)
+{
+    int n = variances.rows();
+    data.resize((n*(n+1))/2);
+    float *out = data.data();
+    // Row i of the upper triangle is column i of the lower one, which is contiguous in the column major storage
+    for(int i = 0; i < n; ++i)
+    {
+        Eigen::Map<Eigen::VectorXf>(out, n - i) = variances.col(i).tail(n - i).cast<float>();
+        out += n - i;
+    }
+}
+
+
+template class EkfSlam<Eigen::Dynamic>;
@@ -0,0 +1,57 @@
+#include "turtlebot3_gazebo/ekf_snapshot.h"
+
+#include <atomic>
+
+
+// Back buffer, with the fields every snapshot has filled in
+EkfSnapshot &EkfSnapshotBuffer::beginPublish(const Eigen::Ref<const Eigen::VectorXd> &states, const std::vector<int> &landmarkIds,
+                                             double stamp)
+{
+    // The back buffer can only be reused once nothing but this buffer holds it. The front no longer points at it,
+    // so no reader can pick it up again after that.
+    std::shared_ptr<EkfSnapshot> &back = buffers[backIdx];
+    if(!back || back.use_count() > 1)
+    {
+        back = std::make_shared<EkfSnapshot>();
+    }
+    std::atomic_thread_fence(std::memory_order_acquire); // After the last reader let go of it
+
+    // Eigen only reallocates when the size changes, ie. when a landmark has been added
+    back->stamp = stamp;
+    back->seq = seq;
+    back->states = states;
+    back->landmarkIds.assign(landmarkIds.begin(), landmarkIds.end());
+    return *back;
+}
+
+void EkfSnapshotBuffer::endPublish()
+{
+    std::atomic_store(&front, EkfSnapshotPtr(buffers[backIdx]));
+    backIdx = 1 - backIdx;
+    seq += 1;
+}
+
+void EkfSnapshotBuffer::publish(const Eigen::Ref<const Eigen::VectorXd> &states, const Eigen::Ref<const Eigen::MatrixXd> &variances,
+                                const std::vector<int> &landmarkIds, double stamp)
+{
+    EkfSnapshot &back = beginPublish(states, landmarkIds, stamp);
+    back.variances = variances;
+    back.landmarkMarginals.resize(0, 0);
+    endPublish();
+}
+
+void EkfSnapshotBuffer::publish(const Eigen::Ref<const Eigen::VectorXd> &states, const std::vector<int> &landmarkIds, double stamp)
+{
+    publish(states, Eigen::MatrixXd(), landmarkIds, stamp);
+}
+
+void EkfSnapshotBuffer::publish(const Eigen::Ref<const Eigen::VectorXd> &states, const Eigen::Matrix3d &robotVariances,
+                                const Eigen::Ref<const Eigen::MatrixXd> &landmarkMarginals, const std::vector<int> &landmarkIds,
+                                double stamp)
+{
+    EkfSnapshot &back = beginPublish(states, landmarkIds, stamp);
+    back.variances.resize(0, 0);
+    back.robotVariances = robotVariances;
+    back.landmarkMarginals = landmarkMarginals;
+    endPublish();
+}
@@ -1,51 +1,16 @@
 #include <ros/ros.h>
 #include <geometry_msgs/Twist.h>
 // #include "/opt/ros/kinetic/include/eigen_stl_containers/eigen_stl_containers.h"
-#include "Eigen/Dense" // Added include library EIGEN_DIRS=/usr/include/eigen3
 #include <math.h>
 #include <limits>
 #include <nav_msgs/Odometry.h> // Found it using "rostopic info /odom". Is located in /opt/ros/kinetic/include/nav_msgs
 #include <sensor_msgs/LaserScan.h> // Found it using "rostopic info /scan". Is located in /opt/ros/kinetic/include/sensor_msgs
 #include <vector>
 
-#define PI 3.14159265
-
+#include "turtlebot3_gazebo/ekf_slam.h"
+#include "turtlebot3_gazebo/lidar_landmark.h"
 
-double normalizeAngle(double angle)
-{
-	double output;
-	//double rem = std::abs(angle) % PI;
-	double rem = std::fmod(std::abs(angle), PI);
-	double quo = (std::abs(angle) - rem) / PI;
-
-	int oddQuo = std::fmod(quo, 2);
-	// Positive angle input or 0
-	if (angle >= 0)
-	{
-		if (oddQuo == 0)
-		{
-			output = rem;
-		}
-		else
-		{
-			output = -(PI - rem);
-		}
-	}
-	// Negative Angle received
-	else
-	{
-		if (oddQuo == 0)
-		{
-			output = -rem;
-		}
-		else
-		{
-			output = (PI - rem);
-		}
-	}
-
-	return output;
-}
+#define PI 3.14159265
 
 
 
@@ -62,36 +27,18 @@ private:
 
     float INF; // float type since lidar vals are in float
 
-    int numModelStates;
-    int numLandmarks;
-    int numTotStates;
-    int numComponents;
+    // Filter core. The test world only has the one landmark
+    typedef EkfSlam<1> EkfCore;
+    EkfCore ekf;
 
-    Eigen::VectorXd predictedStates; // Prev State vector also being maintained since while calc of variance, prevState vec would be reqd, 
-                                // but the states would have already been updated as per motion eqns
-    Eigen::VectorXd states; // ie. Corrected States
-    Eigen::MatrixXd predictedVariances;    
-    Eigen::MatrixXd variances;
-    Eigen::MatrixXd Fx;
-    Eigen::VectorXd bSeenLandmark;
-
-    Eigen::MatrixXd RmotionCovar;
-    Eigen::MatrixXd QsensorCovar;
+    std::vector<LandmarkObservation> observations;
 
+    bool bAllDebugPrint;
 
 public:
     TurtleEkf() :
     INF(std::numeric_limits<float>::max()),
-    numModelStates(3),
-    numLandmarks(1),
-    numTotStates(numModelStates + 2*numLandmarks),
-    numComponents(2),
-    predictedStates(Eigen::VectorXd::Zero(numTotStates)),
-    states(Eigen::VectorXd::Zero(numTotStates)),
-    predictedVariances(Eigen::MatrixXd::Zero(numTotStates, numTotStates)),    
-    variances(Eigen::MatrixXd::Zero(numTotStates, numTotStates)),
-    Fx (Eigen::MatrixXd::Zero(numModelStates, numTotStates)), 
-    bSeenLandmark(Eigen::VectorXd::Zero(numLandmarks))
+    bAllDebugPrint(1)
     {
         ROS_INFO("Started Node: efk_singleBlock");
         ROS_INFO_STREAM("Started Node: efk_singleBlock");
@@ -102,28 +49,21 @@ public:
         turtle_lidar = n.subscribe("/scan", 10, &TurtleEkf::cbLidar, this);  // turtle_lidar = n.subscribe("/scan", 10, cbLidar);
 
         // Init theta to PI/2 as per X axis definition: perp to the right
-        predictedStates(2) = PI/2.0;        
-        states(2) = PI/2.0;
-        // predictedStates(2) = 0;
-        // states(2) = 0;
+        ekf.setRobotPose(0, 0, PI/2.0);
 
         // Set landmark variances to inf
-        predictedVariances.bottomRightCorner(2*numLandmarks, 2*numLandmarks) = Eigen::MatrixXd::Constant(2*numLandmarks, 2*numLandmarks, INF);
-        predictedVariances.topRightCorner(numModelStates, 2*numLandmarks) = Eigen::MatrixXd::Constant(numModelStates, 2*numLandmarks, INF);
-        predictedVariances.bottomLeftCorner(2*numLandmarks, numModelStates) = Eigen::MatrixXd::Constant(2*numLandmarks, numModelStates, INF);
-        variances.bottomRightCorner(2*numLandmarks, 2*numLandmarks) = Eigen::MatrixXd::Constant(2*numLandmarks, 2*numLandmarks, INF);
-        variances.topRightCorner(numModelStates, 2*numLandmarks) = Eigen::MatrixXd::Constant(numModelStates, 2*numLandmarks, INF);
-        variances.bottomLeftCorner(2*numLandmarks, numModelStates) = Eigen::MatrixXd::Constant(2*numLandmarks, numModelStates, INF);
-
-        Fx.topLeftCorner(numModelStates, numModelStates) = Eigen::MatrixXd::Identity(numModelStates, numModelStates);
+        ekf.setLandmarkPriorVariance(INF);
 
-        Eigen::VectorXd tmp1 (3);
+        Eigen::Vector3d tmp1;
         tmp1 << 0.05, 0.05, 0.05; // 0.05m 0.05m 0.05rad of variance
-        RmotionCovar = tmp1.asDiagonal();
+        ekf.setMotionNoise(tmp1.asDiagonal());
 
-        Eigen::VectorXd tmp2 (2);
+        Eigen::Vector2d tmp2;
         tmp2 << 0.005, 0.005; // 0.005m 0.005m of variance. Lidar data is much more reliable from simulation that estimated motion model
-        QsensorCovar = tmp2.asDiagonal();
+        ekf.setSensorNoise(tmp2.asDiagonal());
+
+        ekf.setAngVelThresh(0.001);
+        observations.reserve(1);
 
         globalTStart = ros::Time::now().toSec();
         prevT = globalTStart;
@@ -132,156 +72,18 @@ public:
 
     ~TurtleEkf() {};
 
-    void motionModel(double angVel, double linVel, double deltaT)
-    {
-    
-        if (angVel > 0.001)
-        {
-            double r = linVel/angVel;
-
-            //?? ADD other condition of angles 
-            predictedStates(0) = states(0) + ( -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT) );
-            predictedStates(1) = states(1) + ( +r*cos(states(2)) - r*cos(states(2) + angVel*deltaT) );
-            predictedStates(2) = states(2) + angVel*deltaT;
-        }
-        else
-        {
-            double dist = linVel*deltaT;
-
-            // ADD other condition of angles 
-            predictedStates(0) = states(0) - dist*cos(states(2));
-            predictedStates(1) = states(1) + dist*sin(states(2));
-            predictedStates(2) = states(2);
-        }
-
-        predictedStates(2) = normalizeAngle(predictedStates(2));
-
-        //??prt
-        std::cout << "Predicted states = " << std::endl;
-        std::cout << predictedStates << std::endl;
-        // std::cout << "X', Y', Th': " << states(0) << ", " << states(1) << ", " << states(2) << std::endl;
-
-        // return states;
-
-    };
-
-    void motionModelVariance(double angVel, double linVel, double deltaT)
+    void printPrediction()
     {
-        double derivXTh, derivYTh;
-    
-        if (angVel > 0.001)
-        {
-            double r = linVel/angVel;
-
-            // Derivative of X and Y wrt Th
-            derivXTh = -r*cos(states(2)) + r*cos(states(2) + angVel*deltaT);
-            derivYTh = -r*sin(states(2)) + r*sin(states(2) + angVel*deltaT);
-            // derivTh = 1 got from Identity addition
-        }
-        else
+        if(bAllDebugPrint)
         {
-            double dist = linVel*deltaT;
-
-            // ADD other condition of angles 
-            derivXTh = dist*sin(states(2));
-            derivYTh = dist*cos(states(2));
-            // derivTh = 1 got from Identity addition
+            //??prt
+            std::cout << "Predicted states = " << std::endl;
+            std::cout << ekf.getStates() << std::endl;
+            std::cout << "Predicted variances = " << std::endl;
+            std::cout << ekf.getVariances() << std::endl;
         }
-
-        Eigen::MatrixXd tmp = Eigen::MatrixXd::Zero(numModelStates, numModelStates);
-        tmp(0,2) = derivXTh;
-        tmp(1,2) = derivYTh;
-        // Jacobian of non-linear motion model
-        Eigen::MatrixXd Gt =  Eigen::MatrixXd::Identity(numTotStates, numTotStates) + Fx.transpose() * tmp * Fx;
-
-        // Variance Calculation
-        // predictedVariances = Gt * variances * Gt.transpose(); // MUST add process/gaussian noise so that in Correction step, 
-                                                              //matrix inversion does not yield inv(0) and thus Nan after sometime
-        predictedVariances = Gt * variances * Gt.transpose() + Fx.transpose() * RmotionCovar * Fx;
-
-        //??prt
-        // std::cout << tmp << std::endl;
-        std::cout << "Predicted variances = " << std::endl;
-        std::cout << predictedVariances << std::endl;
-
-        // return variances;
-
     };
 
-    // static std::vector<double> lidarRangeHeading(const std::vector<float> &lidarRange, const double angleInc)
-    std::vector<double> lidarRangeHeading(const std::vector<float> &lidarRange, const double angleInc)
-    {
-        double avgRange = 0;
-        int ctr = 0;
-        for (int i = 0; i < lidarRange.size(); ++i)
-        {
-            if (lidarRange[i] < INF)
-            {
-                avgRange += lidarRange[i];
-                ctr += 1;
-            }
-        }
-        avgRange /= ctr;
-
-        double headingStart = 0;
-        double headingStop = 0;
-        double headingMiddle = 0;
-        for (int i = 0; i < lidarRange.size()-1; ++i)
-        {
-            if(lidarRange[i] >= INF && lidarRange[i+1] < INF)
-            {
-                headingStart = (i+1)*angleInc;
-                break;
-            }
-        }
-        headingStart = normalizeAngle(headingStart);
-
-        for (int i = 0; i < lidarRange.size()-1; ++i)
-        {
-            if(lidarRange[i] < INF && lidarRange[i+1] >= INF)
-            {
-                headingStop = i*angleInc;
-            }
-        }        
-        headingStop = normalizeAngle(headingStop);
-
-        // Heading points are in the positive half. Take avg and assign +ve sign
-        if ( (headingStart > 0) && (headingStart <= PI) && (headingStop > 0) && (headingStop <= PI) )
-        {
-            headingMiddle = std::abs(headingStop + headingStart) / 2.0;
-        }
-        // Heading points are in the negative half. Take avg and assign -ve sign
-        else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop < 0) && (headingStop >= -PI) )
-        {
-            headingMiddle = - std::abs(headingStop + headingStart) / 2.0;
-        }
-        // Start point is in positive half and stop is in the negative half. 
-        // Find actual measurement angle viz complement of direct angle. Half of this angle measurement to be added to start and normalized
-        else if ( (headingStart > 0) && (headingStart <= PI) && (headingStop < 0) && (headingStop >= -PI) )
-        {
-            double measurementAngle  = 2*PI - (std::abs(headingStart) + std::abs(headingStop));
-            headingMiddle = normalizeAngle( headingStart + measurementAngle/2.0 );
-        }
-        // Start point is in negative half and stop point is in the positive half
-        // Find angle range in between the start and stop points. Assign sign based on which is larger in magnitude
-        else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop > 0) && (headingStop <= PI) )
-        {
-            double measurementAngle  = std::abs(headingStart) + std::abs(headingStop);
-            if ( std::abs(headingStop) >= std::abs(headingStart) ) // Will fall on positive side
-            {
-                headingMiddle = + ( measurementAngle/2.0 - std::abs(headingStart) );
-            }
-            else // Will fall on negative side
-            {
-                headingMiddle = - ( measurementAngle/2.0 - std::abs(headingStop) );
-            }
-        }
-
-        std::vector<double> output = {avgRange, headingMiddle};
-        return output;
-    }
-
-
     // Also behaves as the sensorModel()
     //OR instead of making it static, might be able to use: 
     //https://answers.ros.org/question/282259/ros-class-with-callback-methods/
@@ -289,108 +91,44 @@ public:
     // static void cbLidar(const sensor_msgs::LaserScan::ConstPtr &msg)
     void cbLidar(const sensor_msgs::LaserScan::ConstPtr &msg)
     {
-        double angleMin = msg->angle_min;
         double angleInc = msg->angle_increment;
-        std::vector<float> lidarRange = msg->ranges;
 
-        std::vector<double> landmarkMeasurement = lidarRangeHeading(lidarRange, angleInc);
+        std::vector<double> landmarkMeasurement = lidarRangeHeading(msg->ranges, angleInc, INF);
         double avgRange = landmarkMeasurement[0];
         double headingMiddle = landmarkMeasurement[1];
 
-        std::cout << "Predicted states before correction step = " << std::endl;
-        std::cout << predictedStates << std::endl;
-        std::cout << "Predicted variances before correction step = " << std::endl;
-        std::cout << predictedVariances << std::endl;        
-
-//// Begin For loop for each landmark
-
-        //?? Setting a landmark manually for now. Will need a loop actually
-        int landmarkId = 0;
-        int stateIdx = (numModelStates-1) + (landmarkId+1);
-        std::cout << "stateIdx = " << stateIdx << std::endl;
-        if ( !bSeenLandmark(landmarkId) ) // If landmark not seen before, set the prior of that landmark to global position of the landmark
+        if( !(std::abs(avgRange) >= INF) )
         {
-            // NOTE: ujx is the state in states that corsp to this j-th landmark
-
-            // u_jx = u_tx + r*cos(phi + u_tth)
-            // landmark_x = robot_x + r*cos(phi + robot_heading)
-            predictedStates(stateIdx) = predictedStates(0) + avgRange * cos(headingMiddle + predictedStates(2));
-            predictedStates(stateIdx+1) = predictedStates(1) + avgRange * sin(headingMiddle + predictedStates(2));
+            if(bAllDebugPrint)
+            {
+                std::cout << "Predicted states before correction step = " << std::endl;
+                std::cout << ekf.getStates() << std::endl;
+                std::cout << "Predicted variances before correction step = " << std::endl;
+                std::cout << ekf.getVariances() << std::endl;
+            }
 
-            std::cout << "ONE TIME STATES" << std::endl;
-            std::cout << predictedStates << std::endl;
+            //?? Setting a landmark manually for now. Will need a loop actually
+            LandmarkObservation obs;
+            obs.landmarkId = 0;
+            obs.range = avgRange;
+            obs.bearing = headingMiddle;
+            observations.clear();
+            observations.push_back(obs);
 
-            bSeenLandmark(landmarkId) = 1;
+            // If landmark not seen before, the prior of that landmark gets set to global position of the landmark
+            ekf.update(observations);
+        }
+        else
+        {
+            std::cout << ">>> No Obstacle in Lidar Range" << std::endl;
         }
 
-        double delx = predictedStates(stateIdx) - predictedStates(0);
-        double dely = predictedStates(stateIdx+1) - predictedStates(1);
-        double q = delx*delx + dely*dely;
-        std::cout << "delx, dely and q = " << std::endl;
-        std::cout << delx << std::endl;
-        std::cout << dely << std::endl;
-        std::cout << q << std::endl;
-
-
-        Eigen::VectorXd zj(2);
-        Eigen::VectorXd zjHat (2);
-        zj << avgRange, headingMiddle;
-        zjHat << std::sqrt(q) , ( std::atan2(dely, delx) - predictedStates(2) );
-        std::cout << "z and zHat = " << std::endl;
-        std::cout << zj << std::endl;
-        std::cout << zjHat << std::endl;
-
-        Eigen::MatrixXd Fxj = Eigen::MatrixXd::Zero( (numModelStates + numComponents), numTotStates);        
-        Fxj.topLeftCorner(numModelStates,numModelStates) = Eigen::MatrixXd::Identity(numModelStates,numModelStates);
-        
-        Fxj(numModelStates, numModelStates + landmarkId) = 1;
-        Fxj(numModelStates+1, numModelStates + landmarkId+1) = 1;
-        std::cout << "Fxj = " << std::endl;
-        std::cout << Fxj << std::endl;
-
-        // Partial differential of:
-        // zHat_x wrt modelX, modelY, modelTh, mx, my
-        // zHat_y wrt modelX, modelY, modelTh, mx, my
-        // H*z ==nt Cx or Hx in traditional state space model, but here input x for this step is estimated/expected sensor reading = zHat
-        Eigen::MatrixXd H (numComponents, numTotStates);
-        H << 
-            -std::sqrt(q)*delx , -std::sqrt(q)*dely , 0    , std::sqrt(q)*delx   , std::sqrt(q)*dely ,
-            dely              , -delx               , -1   , -dely               , delx;        
-        H = (1/q) * H;
-        // std::cout << "H = " << std::endl;
-        // std::cout << H << std::endl;
-
-        // (3+2)x(3+2n) = 5x5 for single landmark case, with each landmark being 2D
-        Eigen::MatrixXd HFxj (numTotStates, numTotStates);
-        HFxj = H * Fxj;
-        std::cout << "HFxj = " << std::endl; // Same as H since with only one obstacle, we get just F to be identity
-        std::cout << HFxj << std::endl;        
-
-        Eigen::MatrixXd K (numTotStates, numComponents);
-        Eigen::MatrixXd tmp (numComponents, numComponents);
-        Eigen::MatrixXd tmpInv (numComponents, numComponents);
-        // tmp = HFxj * predictedVariances * HFxj.transpose(); // MUST add process/gaussian noise so that in Correction step, 
-                                                            //matrix inversion does not yield inv(0) and thus Nan after sometime
-        tmp = HFxj * predictedVariances * HFxj.transpose() + QsensorCovar;
-        tmpInv = tmp.inverse();
-        K = predictedVariances*HFxj.transpose()*tmpInv; 
-
-        std::cout << "K = " << std::endl;
-        std::cout << K << std::endl;
-
-        predictedStates = predictedStates + K * (zj - zjHat);
-        Eigen::MatrixXd I (numTotStates, numTotStates);
-        I = Eigen::MatrixXd::Identity(numTotStates, numTotStates);
-        predictedVariances = ( I - K*HFxj) * predictedVariances;
-        
-//// End For loop for each landmark
-
-        states = predictedStates;
-        variances = predictedVariances;
-
-        std::cout << "Corrected states and variances" << std::endl;
-        std::cout << states << std::endl;
-        std::cout << variances << std::endl;
+        if(bAllDebugPrint)
+        {
+            std::cout << "Corrected states and variances" << std::endl;
+            std::cout << ekf.getStates() << std::endl;
+            std::cout << ekf.getVariances() << std::endl;
+        }
 
     };
 
@@ -443,8 +181,8 @@ public:
         // std::cout << "rad, time: " << linVel/angVel << ", " << deltaT << std::endl;
 
         // Call the motion model and pass lin and angular vel
-        motionModel(angVel, linVel, deltaT);
-        motionModelVariance(angVel, linVel, deltaT);
+        ekf.predict(linVel, angVel, deltaT);
+        printPrediction();
 
     };
 
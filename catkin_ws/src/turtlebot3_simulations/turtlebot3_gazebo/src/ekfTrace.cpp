@@ -0,0 +1,201 @@
+#include "turtlebot3_gazebo/ekf_trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+static const char traceMagic[4] = {'E', 'K', 'F', 'T'};
+
+// Single producer (the owning thread), single consumer (the drain thread) ring of trace records.
+// head and tail only ever increase, and are padded apart so that the two threads don't share a cache line.
+struct EkfTraceRing
+{
+    EkfTraceRecord records[EKF_TRACE_RING_SIZE];
+    std::atomic<uint64_t> head; // Next record to write. Only written by the producer
+    char headPad[64];
+    std::atomic<uint64_t> tail; // Next record to read. Only written by the consumer
+    char tailPad[64];
+    std::atomic<uint64_t> numDropped;
+    uint16_t thread;
+
+    explicit EkfTraceRing(uint16_t threadNum) : head(0), tail(0), numDropped(0), thread(threadNum) {};
+
+    void push(const EkfTraceRecord &record)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) == EKF_TRACE_RING_SIZE)
+        {
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        records[h & (EKF_TRACE_RING_SIZE - 1)] = record;
+        head.store(h + 1, std::memory_order_release);
+    };
+
+    // Writes out everything pushed so far, in at most two contiguous pieces. Returns the number of records written.
+    uint64_t drain(std::FILE *file)
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        uint64_t count = h - t;
+        uint64_t start = t & (EKF_TRACE_RING_SIZE - 1);
+        uint64_t first = std::min<uint64_t>(count, EKF_TRACE_RING_SIZE - start);
+        std::fwrite(records + start, sizeof(EkfTraceRecord), first, file);
+        std::fwrite(records, sizeof(EkfTraceRecord), count - first, file);
+        tail.store(h, std::memory_order_release);
+        return count;
+    };
+};
+
+// Rings are never freed, since their threads may still hold on to them after tracing stops
+static std::mutex traceRingsMutex;
+static std::vector<EkfTraceRing*> traceRings;
+static thread_local EkfTraceRing *threadRing = NULL;
+
+static std::atomic<bool> bTraceEnabled(false);
+static std::atomic<bool> bTraceStopping(false);
+static std::thread traceDrainThread;
+static std::FILE *traceFile = NULL;
+
+
+static EkfTraceRing *registerThreadRing()
+{
+    std::lock_guard<std::mutex> lock(traceRingsMutex);
+    EkfTraceRing *ring = new EkfTraceRing(traceRings.size());
+    traceRings.push_back(ring);
+    return ring;
+}
+
+static uint64_t drainAll()
+{
+    std::vector<EkfTraceRing*> rings;
+    {
+        std::lock_guard<std::mutex> lock(traceRingsMutex);
+        rings = traceRings;
+    }
+    uint64_t count = 0;
+    for(int i = 0; i < rings.size(); ++i)
+    {
+        count += rings[i]->drain(traceFile);
+    }
+    return count;
+}
+
+static void drainLoop()
+{
+    while(!bTraceStopping.load(std::memory_order_acquire))
+    {
+        if(drainAll() == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(EKF_TRACE_DRAIN_PERIOD_MS));
+        }
+    }
+}
+
+
+void ekfTraceEmit(int event, int id, double a, double b, double c, double d)
+{
+    if(!bTraceEnabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    if(threadRing == NULL)
+    {
+        threadRing = registerThreadRing();
+    }
+
+    EkfTraceRecord record;
+    record.stampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    record.event = event;
+    record.thread = threadRing->thread;
+    record.id = id;
+    record.values[0] = a;
+    record.values[1] = b;
+    record.values[2] = c;
+    record.values[3] = d;
+    threadRing->push(record);
+}
+
+bool ekfTraceStart(const char *path)
+{
+    if(traceFile != NULL)
+    {
+        return false;
+    }
+    traceFile = std::fopen(path, "wb");
+    if(traceFile == NULL)
+    {
+        std::cout << "Could not open trace file " << path << std::endl;
+        return false;
+    }
+    uint32_t version = EKF_TRACE_VERSION;
+    uint32_t recordSize = sizeof(EkfTraceRecord);
+    std::fwrite(traceMagic, sizeof(traceMagic), 1, traceFile);
+    std::fwrite(&version, sizeof(version), 1, traceFile);
+    std::fwrite(&recordSize, sizeof(recordSize), 1, traceFile);
+
+    // Skip whatever was left in the rings from a previous trace
+    {
+        std::lock_guard<std::mutex> lock(traceRingsMutex);
+        for(int i = 0; i < traceRings.size(); ++i)
+        {
+            traceRings[i]->tail.store(traceRings[i]->head.load());
+        }
+    }
+
+    bTraceStopping = false;
+    traceDrainThread = std::thread(drainLoop);
+    bTraceEnabled = true;
+    return true;
+}
+
+void ekfTraceStop()
+{
+    if(traceFile == NULL)
+    {
+        return;
+    }
+    bTraceEnabled = false;
+    bTraceStopping = true;
+    traceDrainThread.join();
+    drainAll();
+
+    uint64_t numDropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(traceRingsMutex);
+        for(int i = 0; i < traceRings.size(); ++i)
+        {
+            numDropped += traceRings[i]->numDropped.exchange(0);
+        }
+    }
+    if(numDropped > 0)
+    {
+        std::cout << "Trace dropped " << numDropped << " records, the rings filled up faster than they were drained" << std::endl;
+    }
+
+    std::fclose(traceFile);
+    traceFile = NULL;
+}
+
+const char *ekfTraceEventName(int event)
+{
+    switch(event)
+    {
+        case TRACE_PREDICT: return "predict";
+        case TRACE_LANDMARK_ADDED: return "landmark_added";
+        case TRACE_OBSERVATION: return "observation";
+        case TRACE_INNOVATION: return "innovation";
+        case TRACE_CORRECT: return "correct";
+        case TRACE_CORRECT_BATCH: return "correct_batch";
+        case TRACE_MARKERS: return "markers";
+        case TRACE_ROBOT: return "robot";
+    }
+    return "unknown";
+}
@@ -0,0 +1,64 @@
+// Prints a trace file written by the filter (see ekf_trace.h) as text, one record per line in time order.
+// Usage: ekf_trace_dump <trace file>
+//   columns: time since the first record [s], thread, event, id, values
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "turtlebot3_gazebo/ekf_trace.h"
+
+
+bool isEarlier(const EkfTraceRecord &a, const EkfTraceRecord &b)
+{
+    return a.stampNs < b.stampNs;
+}
+
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        std::printf("Usage: ekf_trace_dump <trace file>\n");
+        return 1;
+    }
+
+    std::FILE *file = std::fopen(argv[1], "rb");
+    if(file == NULL)
+    {
+        std::printf("Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    uint32_t recordSize = 0;
+    if(std::fread(magic, sizeof(magic), 1, file) != 1 || std::memcmp(magic, "EKFT", sizeof(magic)) != 0 ||
+       std::fread(&version, sizeof(version), 1, file) != 1 || std::fread(&recordSize, sizeof(recordSize), 1, file) != 1 ||
+       version != EKF_TRACE_VERSION || recordSize != sizeof(EkfTraceRecord))
+    {
+        std::printf("%s is not a version %d trace\n", argv[1], EKF_TRACE_VERSION);
+        std::fclose(file);
+        return 1;
+    }
+
+    std::vector<EkfTraceRecord> records;
+    EkfTraceRecord record;
+    while(std::fread(&record, sizeof(record), 1, file) == 1)
+    {
+        records.push_back(record);
+    }
+    std::fclose(file);
+
+    // Records of different threads are only in order per thread
+    std::stable_sort(records.begin(), records.end(), isEarlier);
+
+    for(int i = 0; i < records.size(); ++i)
+    {
+        const EkfTraceRecord &r = records[i];
+        std::printf("%12.6f %2d %-15s %6d % .9g % .9g % .9g % .9g\n", 1e-9*(r.stampNs - records.front().stampNs),
+                    r.thread, ekfTraceEventName(r.event), r.id, r.values[0], r.values[1], r.values[2], r.values[3]);
+    }
+    return 0;
+}
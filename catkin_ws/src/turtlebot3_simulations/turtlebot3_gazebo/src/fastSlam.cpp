@@ -0,0 +1,697 @@
+#include "turtlebot3_gazebo/fast_slam.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#define FASTSLAM_RESAMPLE_THRESH 0.5 // Resample once the effective number of particles drops below this fraction of them
+#define FASTSLAM_MIN_PREDICT_PER_CHUNK 256 // A prediction is ~100 flops per particle, waking a worker for fewer costs more than it saves
+#define FASTSLAM_MIN_UPDATE_PER_CHUNK 8
+#define FASTSLAM_SEED 1 // Generator of thread t is seeded with FASTSLAM_SEED + t, so that runs can be repeated
+
+
+// Expected (range, bearing) of a landmark from a pose, and its Jacobians wrt the pose and the landmark. Same model
+// as EkfSlam::observationModel(). False if the landmark is on top of the robot.
+static bool observationModel(const Eigen::Vector3d &pose, const Eigen::Vector2d &landmark, Eigen::Vector2d &expected,
+                             Eigen::Matrix<double, 2, 3> &Hx, Eigen::Matrix2d &Hm)
+{
+    double delx = landmark(0) - pose(0);
+    double dely = landmark(1) - pose(1);
+    double q = delx*delx + dely*dely;
+    if(q < std::numeric_limits<double>::epsilon())
+    {
+        return false;
+    }
+    double sqrtQ = std::sqrt(q);
+
+    expected << sqrtQ, normalizeAngle(std::atan2(dely, delx) - pose(2));
+    Hx << -delx/sqrtQ , -dely/sqrtQ , 0  ,
+          dely/q      , -delx/q     , -1 ;
+    Hm << delx/sqrtQ  , dely/sqrtQ  ,
+          -dely/q     , delx/q      ;
+    return true;
+}
+
+
+FastSlam::FastSlam(int initialCapacity, int numParticles, int numThreads) :
+depth(0),
+RmotionCovar(Eigen::Matrix3d::Zero()),
+QsensorCovar(Eigen::Matrix2d::Identity()),
+angVelThresh(0.001),
+landmarkPriorVariance(std::numeric_limits<float>::max()),
+lastPredictStamp(-std::numeric_limits<double>::max()),
+numLate(0),
+numResamples(0),
+workGeneration(0),
+numWorking(0),
+numChunks(1),
+bStopping(false),
+work(WORK_PREDICT),
+workLinVel(0),
+workAngVel(0),
+workDeltaT(0),
+workObservations(NULL),
+robotMean(Eigen::Vector3d::Zero()),
+states(Eigen::VectorXd::Zero(NumModelStates)),
+landmarkMarginals(NumComponents, 0),
+bVariancesValid(false)
+{
+    numParticles = std::max(numParticles, 1);
+    Particle p;
+    p.pose.setZero();
+    p.poseVariances.setZero();
+    p.weight = 1.0 / numParticles;
+    p.logLikelihood = 0;
+    particles.assign(numParticles, p);
+    resampled.reserve(numParticles);
+    landmarkIds.reserve(std::max(initialCapacity, 1));
+    landmarkSlots.reserve(std::max(initialCapacity, 1));
+
+    if(numThreads <= 0)
+    {
+        numThreads = std::thread::hardware_concurrency();
+    }
+    this->numThreads = std::max(1, std::min(numThreads, numParticles));
+    for(int t = 0; t < this->numThreads; ++t)
+    {
+        generators.push_back(std::mt19937(FASTSLAM_SEED + t));
+    }
+    workUsed.resize(this->numThreads);
+    for(int t = 1; t < this->numThreads; ++t)
+    {
+        workers.push_back(std::thread(&FastSlam::workLoop, this, t));
+    }
+}
+
+FastSlam::~FastSlam()
+{
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        bStopping = true;
+    }
+    workCondition.notify_all();
+    for(int t = 0; t < workers.size(); ++t)
+    {
+        workers[t].join();
+    }
+}
+
+// Leaf of slot, or NULL if the map has none
+const FastSlam::MapNode *FastSlam::findLeaf(const MapNode *root, int depth, int slot)
+{
+    const MapNode *node = root;
+    for(int level = depth - 1; node && level >= 0; --level)
+    {
+        node = node->child[(slot >> level) & 1].get();
+    }
+    return node;
+}
+
+// Leaf of slot that the caller can change. The nodes on its path that are shared with other maps are copied, so
+// that the other maps don't see the change, and the missing ones are created.
+FastSlam::MapNode *FastSlam::mutableLeaf(MapPtr &root, int depth, int slot)
+{
+    Eigen::aligned_allocator<MapNode> allocator;
+    MapPtr *link = &root;
+    for(int level = depth; ; --level)
+    {
+        if(!*link)
+        {
+            *link = std::allocate_shared<MapNode>(allocator);
+        }
+        else if(link->use_count() > 1)
+        {
+            // Only this map's copy of the parent points to it, if the parent was unshared or just copied. The copy
+            // shares the children, which get copied in turn further down.
+            *link = std::allocate_shared<MapNode>(allocator, **link);
+        }
+        if(level == 0)
+        {
+            return link->get();
+        }
+        link = &(*link)->child[(slot >> (level - 1)) & 1];
+    }
+}
+
+// Leaf of slot in a map whose path to it was unshared by mutableLeaf(), so that the caller can change it without
+// copying. Reads no use counts, so unlike mutableLeaf() it can run on the worker threads.
+FastSlam::MapNode *FastSlam::ownedLeaf(MapNode *root, int depth, int slot)
+{
+    return const_cast<MapNode *>(findLeaf(root, depth, slot));
+}
+
+// Adds weight times the leaf means under node, which holds the slots from firstSlot on, to their landmark states
+void FastSlam::gatherMeans(const MapNode *node, int depth, int firstSlot, double weight, Eigen::VectorXd &states)
+{
+    if(!node)
+    {
+        return;
+    }
+    if(depth == 0)
+    {
+        states.segment<NumComponents>(NumModelStates + NumComponents*firstSlot) += weight * node->mean;
+        return;
+    }
+    gatherMeans(node->child[0].get(), depth - 1, firstSlot, weight, states);
+    gatherMeans(node->child[1].get(), depth - 1, firstSlot + (1 << (depth - 1)), weight, states);
+}
+
+void FastSlam::workLoop(int thread)
+{
+    unsigned long generationSeen = 0;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(workMutex);
+            while(!bStopping && workGeneration == generationSeen)
+            {
+                workCondition.wait(lock);
+            }
+            if(bStopping)
+            {
+                return;
+            }
+            generationSeen = workGeneration;
+        }
+        if(thread < numChunks)
+        {
+            runChunk(thread);
+        }
+        {
+            std::lock_guard<std::mutex> lock(workMutex);
+            numWorking -= 1;
+        }
+        doneCondition.notify_one();
+    }
+}
+
+// Runs the step on the particles split between the threads, with at least minPerChunk particles per thread, and
+// waits for all of them
+void FastSlam::runParallel(Work work, int minPerChunk)
+{
+    this->work = work;
+    numChunks = std::min(numThreads, std::max(1, (int)particles.size() / minPerChunk));
+    if(numChunks == 1)
+    {
+        runChunk(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        numWorking = workers.size();
+        workGeneration += 1;
+    }
+    workCondition.notify_all();
+    runChunk(0);
+    std::unique_lock<std::mutex> lock(workMutex);
+    while(numWorking > 0)
+    {
+        doneCondition.wait(lock);
+    }
+}
+
+void FastSlam::runChunk(int chunk)
+{
+    int begin = particles.size() * chunk / numChunks;
+    int end = particles.size() * (chunk + 1) / numChunks;
+    for(int i = begin; i < end; ++i)
+    {
+        if(work == WORK_PREDICT)
+        {
+            predictParticle(particles[i]);
+        }
+        else
+        {
+            updateParticle(particles[i], generators[chunk], workUsed[chunk]);
+        }
+    }
+}
+
+void FastSlam::setRobotPose(double x, double y, double th)
+{
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        particles[i].pose << x, y, th;
+        particles[i].poseVariances.setZero();
+    }
+    robotMean << x, y, th;
+    bVariancesValid = false;
+}
+
+void FastSlam::landmarkFromObservation(double range, double bearing, double &landX, double &landY) const
+{
+    landX = robotMean(0) + range * std::cos(bearing + robotMean(2));
+    landY = robotMean(1) + range * std::sin(bearing + robotMean(2));
+}
+
+int FastSlam::addLandmark(int landmarkId, double landX, double landY)
+{
+    std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(landmarkId);
+    if(it != landmarkSlots.end())
+    {
+        return it->second;
+    }
+
+    int slot = landmarkIds.size();
+    if(slot >= (1 << depth))
+    {
+        // One more level, the current maps become the left halves
+        Eigen::aligned_allocator<MapNode> allocator;
+        for(int i = 0; i < particles.size(); ++i)
+        {
+            if(particles[i].map)
+            {
+                MapPtr root = std::allocate_shared<MapNode>(allocator);
+                root->child[0] = particles[i].map;
+                particles[i].map = root;
+            }
+        }
+        depth += 1;
+    }
+
+    // Landmark in the frame of the mean pose
+    double c = std::cos(robotMean(2));
+    double s = std::sin(robotMean(2));
+    double forward = c*(landX - robotMean(0)) + s*(landY - robotMean(1));
+    double left = -s*(landX - robotMean(0)) + c*(landY - robotMean(1));
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        Particle &p = particles[i];
+        MapNode *leaf = mutableLeaf(p.map, depth, slot);
+        double cp = std::cos(p.pose(2));
+        double sp = std::sin(p.pose(2));
+        leaf->mean << p.pose(0) + cp*forward - sp*left,
+                      p.pose(1) + sp*forward + cp*left;
+        leaf->variances = landmarkPriorVariance * Eigen::Matrix2d::Identity();
+    }
+
+    landmarkSlots[landmarkId] = slot;
+    landmarkIds.push_back(landmarkId);
+    states.conservativeResize(NumModelStates + NumComponents*landmarkIds.size());
+    landmarkMarginals.conservativeResize(NumComponents, NumComponents*landmarkIds.size());
+    refreshLandmark(slot);
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_LANDMARK_ADDED, landmarkId, landX, landY, slot, 1 << depth);
+    return slot;
+}
+
+void FastSlam::predict(double stamp, double linVel, double angVel, double deltaT)
+{
+    lastPredictStamp = std::max(lastPredictStamp, stamp);
+    workLinVel = linVel;
+    workAngVel = angVel;
+    workDeltaT = deltaT;
+    runParallel(WORK_PREDICT, FASTSLAM_MIN_PREDICT_PER_CHUNK);
+    computeRobotMean();
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_PREDICT, NumModelStates + NumComponents*landmarkIds.size(), linVel, angVel, deltaT, robotMean(2));
+}
+
+// Same model and Jacobian Gr = I + Delta as EkfSlam::predict(), on the Gaussian pose of the particle
+void FastSlam::predictParticle(Particle &p) const
+{
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d Gr;
+    velocityMotion(p.pose(2), workLinVel, workAngVel, workDeltaT, angVelThresh, delta, Gr);
+    p.poseVariances = Gr * p.poseVariances * Gr.transpose() + RmotionCovar;
+    p.pose += delta;
+    p.pose(2) = normalizeAngle(p.pose(2));
+}
+
+int FastSlam::rewind(double stamp)
+{
+    if(stamp < lastPredictStamp)
+    {
+        numLate += 1;
+    }
+    return 0;
+}
+
+int FastSlam::update(const std::vector<LandmarkObservation> &observations)
+{
+    if(observations.empty())
+    {
+        return 0;
+    }
+
+    // New landmarks first, they change every map
+    workSlots.resize(observations.size());
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        const LandmarkObservation &obs = observations[k];
+        if(!isLandmarkSeen(obs.landmarkId))
+        {
+            double landX, landY;
+            landmarkFromObservation(obs.range, obs.bearing, landX, landY);
+            addLandmark(obs.landmarkId, landX, landY);
+        }
+        workSlots[k] = landmarkSlots[obs.landmarkId];
+    }
+
+    // Copy on write of the observed paths, here on one thread. In the workers, mutableLeaf() would decide it from
+    // the use counts of nodes that other workers are copying at the same time, which are only approximate there.
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        for(int k = 0; k < observations.size(); ++k)
+        {
+            if(findLeaf(particles[i].map.get(), depth, workSlots[k]))
+            {
+                mutableLeaf(particles[i].map, depth, workSlots[k]);
+            }
+        }
+    }
+
+    for(int t = 0; t < workUsed.size(); ++t)
+    {
+        workUsed[t].assign(observations.size(), 0);
+    }
+    workObservations = &observations;
+    runParallel(WORK_UPDATE, FASTSLAM_MIN_UPDATE_PER_CHUNK);
+    workObservations = NULL;
+
+    int numUsed = 0;
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        for(int t = 0; t < workUsed.size(); ++t)
+        {
+            if(workUsed[t][k])
+            {
+                numUsed += 1;
+                break;
+            }
+        }
+    }
+
+    normalizeWeights();
+    resample();
+    computeRobotMean();
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        refreshLandmark(workSlots[k]);
+    }
+    bVariancesValid = false;
+    return numUsed;
+}
+
+// FastSLAM 2.0 correction of one particle (table 13.3) with all the observations of the frame
+void FastSlam::updateParticle(Particle &p, std::mt19937 &generator, std::vector<char> &used) const
+{
+    const std::vector<LandmarkObservation> &observations = *workObservations;
+    Eigen::Vector2d expected, nu;
+    Eigen::Matrix<double, 2, 3> Hx;
+    Eigen::Matrix2d Hm;
+
+    // Importance weight, the likelihood of the observations at the predicted pose: N(nu; 0, Hx P Hx^T + Hm Sigma Hm^T + Q)
+    p.logLikelihood = 0;
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        const MapNode *leaf = findLeaf(p.map.get(), depth, workSlots[k]);
+        if(!leaf || !observationModel(p.pose, leaf->mean, expected, Hx, Hm))
+        {
+            continue;
+        }
+        nu << observations[k].range - expected(0), normalizeAngle(observations[k].bearing - expected(1));
+        Eigen::Matrix2d L = Hx * p.poseVariances * Hx.transpose() + Hm * leaf->variances * Hm.transpose() + QsensorCovar;
+        p.logLikelihood -= 0.5 * nu.dot(L.inverse() * nu) + 0.5 * std::log(4*PI*PI * L.determinant());
+    }
+
+    // Proposal: the predicted pose corrected by each observation in turn, with the landmarks held fixed. In
+    // Kalman form, which is the same as (Hx^T Qj^-1 Hx + P^-1)^-1 but also works for a pose with no variance.
+    Eigen::Vector3d mean = p.pose;
+    Eigen::Matrix3d covariance = p.poseVariances;
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        const MapNode *leaf = findLeaf(p.map.get(), depth, workSlots[k]);
+        if(!leaf || !observationModel(mean, leaf->mean, expected, Hx, Hm))
+        {
+            continue;
+        }
+        nu << observations[k].range - expected(0), normalizeAngle(observations[k].bearing - expected(1));
+        Eigen::Matrix2d Qj = QsensorCovar + Hm * leaf->variances * Hm.transpose();
+        Eigen::Matrix<double, 3, 2> K = covariance * Hx.transpose() * (Hx * covariance * Hx.transpose() + Qj).inverse();
+        mean += K * nu;
+        covariance -= K * Hx * covariance;
+        covariance = 0.5 * (covariance + covariance.transpose());
+    }
+
+    // Sample the pose, x = mean + V * sqrt(D) * n
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen;
+    eigen.computeDirect(covariance);
+    std::normal_distribution<double> normal;
+    Eigen::Vector3d n(normal(generator), normal(generator), normal(generator));
+    p.pose = mean + eigen.eigenvectors() * eigen.eigenvalues().cwiseMax(0).cwiseSqrt().cwiseProduct(n);
+    p.pose(2) = normalizeAngle(p.pose(2));
+    p.poseVariances.setZero();
+
+    // Landmark EKFs at the sampled pose, in place as update() has unshared their paths
+    for(int k = 0; k < observations.size(); ++k)
+    {
+        MapNode *leaf = ownedLeaf(p.map.get(), depth, workSlots[k]);
+        if(!leaf || !observationModel(p.pose, leaf->mean, expected, Hx, Hm))
+        {
+            continue;
+        }
+        used[k] = 1;
+        nu << observations[k].range - expected(0), normalizeAngle(observations[k].bearing - expected(1));
+        Eigen::Matrix2d S = Hm * leaf->variances * Hm.transpose() + QsensorCovar;
+        Eigen::Matrix2d K = leaf->variances * Hm.transpose() * S.inverse();
+        leaf->mean += K * nu;
+        leaf->variances -= K * Hm * leaf->variances;
+        leaf->variances = 0.5 * (leaf->variances + leaf->variances.transpose());
+    }
+}
+
+void FastSlam::normalizeWeights()
+{
+    double maxLogLikelihood = -std::numeric_limits<double>::max();
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        maxLogLikelihood = std::max(maxLogLikelihood, particles[i].logLikelihood);
+    }
+    double sum = 0;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        particles[i].weight *= std::exp(particles[i].logLikelihood - maxLogLikelihood);
+        sum += particles[i].weight;
+    }
+    if(!(sum > 0) || !std::isfinite(sum))
+    {
+        std::cout << "FastSLAM weights degenerate, reset to uniform" << std::endl;
+        for(int i = 0; i < particles.size(); ++i)
+        {
+            particles[i].weight = 1.0 / particles.size();
+        }
+        return;
+    }
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        particles[i].weight /= sum;
+    }
+}
+
+double FastSlam::getNumEffective() const
+{
+    double sumSquares = 0;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        sumSquares += particles[i].weight * particles[i].weight;
+    }
+    return 1.0 / sumSquares;
+}
+
+// Low variance sampler (table 4.4). A copied particle shares the map of the one it was copied from
+void FastSlam::resample()
+{
+    int numParticles = particles.size();
+    if(getNumEffective() >= FASTSLAM_RESAMPLE_THRESH * numParticles)
+    {
+        return;
+    }
+
+    std::uniform_real_distribution<double> uniform(0, 1.0 / numParticles);
+    double r = uniform(generators[0]);
+    double c = particles[0].weight;
+    int i = 0;
+    resampled.clear();
+    for(int m = 0; m < numParticles; ++m)
+    {
+        double u = r + (double)m / numParticles;
+        while(u > c && i < numParticles - 1)
+        {
+            i += 1;
+            c += particles[i].weight;
+        }
+        resampled.push_back(particles[i]);
+        resampled.back().weight = 1.0 / numParticles;
+    }
+    particles.swap(resampled);
+    resampled.clear(); // Drops the old references, so that the maps that were not picked get freed and the ones that were picked are only shared where needed
+    numResamples += 1;
+}
+
+void FastSlam::computeRobotMean()
+{
+    double x = 0, y = 0, sinTh = 0, cosTh = 0;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const Particle &p = particles[i];
+        x += p.weight * p.pose(0);
+        y += p.weight * p.pose(1);
+        sinTh += p.weight * std::sin(p.pose(2));
+        cosTh += p.weight * std::cos(p.pose(2));
+    }
+    robotMean << x, y, std::atan2(sinTh, cosTh);
+}
+
+// Weighted mean and marginal of the landmark in slot over the particles, O(M * log N)
+void FastSlam::refreshLandmark(int slot)
+{
+    Eigen::Vector2d mean(Eigen::Vector2d::Zero());
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const MapNode *leaf = findLeaf(particles[i].map.get(), depth, slot);
+        if(leaf)
+        {
+            mean += particles[i].weight * leaf->mean;
+        }
+    }
+
+    // Spread of the particles around the mean, plus their variances
+    Eigen::Matrix2d marginal(Eigen::Matrix2d::Zero());
+    Eigen::Vector2d deviation;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const MapNode *leaf = findLeaf(particles[i].map.get(), depth, slot);
+        if(leaf)
+        {
+            deviation = leaf->mean - mean;
+            marginal += particles[i].weight * (deviation * deviation.transpose() + leaf->variances);
+        }
+    }
+
+    states.segment<NumComponents>(NumModelStates + NumComponents*slot) = mean;
+    landmarkMarginals.block<NumComponents, NumComponents>(0, NumComponents*slot) = marginal;
+}
+
+bool FastSlam::innovation(int landmarkId, double range, double bearing, Eigen::Vector2d &nu, Eigen::Matrix2d &S)
+{
+    std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(landmarkId);
+    if(it == landmarkSlots.end())
+    {
+        return false;
+    }
+
+    // Bearings are averaged as offsets from the first particle's, so that they don't wrap
+    Eigen::Vector2d expected, sumExpected(Eigen::Vector2d::Zero());
+    Eigen::Matrix2d sumSquares(Eigen::Matrix2d::Zero());
+    Eigen::Matrix<double, 2, 3> Hx;
+    Eigen::Matrix2d Hm;
+    double sumWeights = 0;
+    double reference = 0;
+    bool bReference = false;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const Particle &p = particles[i];
+        const MapNode *leaf = findLeaf(p.map.get(), depth, it->second);
+        if(!leaf || !observationModel(p.pose, leaf->mean, expected, Hx, Hm))
+        {
+            continue;
+        }
+        if(!bReference)
+        {
+            reference = expected(1);
+            bReference = true;
+        }
+        expected(1) = normalizeAngle(expected(1) - reference);
+        sumExpected += p.weight * expected;
+        sumSquares += p.weight * (Hx * p.poseVariances * Hx.transpose() + Hm * leaf->variances * Hm.transpose() + expected * expected.transpose());
+        sumWeights += p.weight;
+    }
+    if(sumWeights <= 0)
+    {
+        return false;
+    }
+
+    Eigen::Vector2d meanExpected = sumExpected / sumWeights;
+    S = sumSquares / sumWeights - meanExpected * meanExpected.transpose() + QsensorCovar;
+    nu << range - meanExpected(0), normalizeAngle(bearing - (reference + meanExpected(1)));
+    return true;
+}
+
+Eigen::Ref<const Eigen::VectorXd> FastSlam::getStates()
+{
+    states.head<NumModelStates>() = robotMean;
+    return states;
+}
+
+Eigen::Ref<const Eigen::MatrixXd> FastSlam::getVariances()
+{
+    if(bVariancesValid)
+    {
+        return variances;
+    }
+
+    for(int slot = 0; slot < landmarkIds.size(); ++slot)
+    {
+        refreshLandmark(slot);
+    }
+    getStates();
+    int n = states.size();
+    variances.setZero(n, n);
+    Eigen::VectorXd deviation(n);
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const Particle &p = particles[i];
+
+        // Spread of the particles around the mean, lower triangle only
+        deviation.head<NumModelStates>() = p.pose - robotMean;
+        deviation(2) = normalizeAngle(deviation(2));
+        deviation.tail(n - NumModelStates) = -states.tail(n - NumModelStates);
+        gatherMeans(p.map.get(), depth, 0, 1.0, deviation);
+        variances.selfadjointView<Eigen::Lower>().rankUpdate(deviation, p.weight);
+
+        // and the variances of the particle itself, which has no cross terms
+        variances.topLeftCorner<NumModelStates, NumModelStates>() += p.weight * p.poseVariances;
+        for(int slot = 0; slot < landmarkIds.size(); ++slot)
+        {
+            const MapNode *leaf = findLeaf(p.map.get(), depth, slot);
+            if(leaf)
+            {
+                int idx = NumModelStates + NumComponents*slot;
+                variances.block<NumComponents, NumComponents>(idx, idx) += p.weight * leaf->variances;
+            }
+        }
+    }
+    variances.triangularView<Eigen::StrictlyUpper>() = variances.transpose();
+    bVariancesValid = true;
+    return variances;
+}
+
+Eigen::Matrix3d FastSlam::getRobotVariances()
+{
+    Eigen::Matrix3d robotVariances(Eigen::Matrix3d::Zero());
+    Eigen::Vector3d deviation;
+    for(int i = 0; i < particles.size(); ++i)
+    {
+        const Particle &p = particles[i];
+        deviation = p.pose - robotMean;
+        deviation(2) = normalizeAngle(deviation(2));
+        robotVariances += p.weight * (deviation * deviation.transpose() + p.poseVariances);
+    }
+    return robotVariances;
+}
+
+void FastSlam::display() const
+{
+    std::cout << "numModelStates " << (int)NumModelStates << std::endl;
+    std::cout << "numLandmarks " << landmarkIds.size() << std::endl;
+    std::cout << "numParticles " << particles.size() << std::endl;
+    std::cout << "numThreads " << numThreads << std::endl;
+    std::cout << "mapDepth " << depth << std::endl;
+    std::cout << "landmarkPriorVariance " << landmarkPriorVariance << std::endl;
+    std::cout << "robotMean " << robotMean.transpose() << std::endl;
+    std::cout << "RmotionCovar " << RmotionCovar << std::endl;
+    std::cout << "QsensorCovar " << QsensorCovar << std::endl;
+}
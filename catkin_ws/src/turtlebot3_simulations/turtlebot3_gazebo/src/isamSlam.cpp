@@ -0,0 +1,262 @@
+#include "turtlebot3_gazebo/isam_slam.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#include <gtsam/geometry/Rot2.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/sam/BearingRangeFactor.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+
+#define ISAM_PRIOR_SIGMA 1e-3 // [m, rad] Of the first keyframe, which the EKF starts at with no variance
+#define ISAM_MIN_VARIANCE 1e-9 // [m^2, rad^2] Added to the odometry variances, which are singular if R is
+
+using gtsam::symbol_shorthand::L; // Landmarks, by landmarkId
+using gtsam::symbol_shorthand::X; // Keyframes
+
+
+static gtsam::ISAM2Params isamParams(double relinearizeThreshold, int relinearizeSkip)
+{
+    gtsam::ISAM2Params params;
+    params.relinearizeThreshold = relinearizeThreshold;
+    params.relinearizeSkip = std::max(relinearizeSkip, 1);
+    params.enableRelinearization = true;
+    return params;
+}
+
+
+IsamSlam::IsamSlam(int initialCapacity, double relinearizeThreshold, int relinearizeSkip) :
+isam(isamParams(relinearizeThreshold, relinearizeSkip)),
+numKeyframes(0),
+RmotionCovar(Eigen::Matrix3d::Zero()),
+QsensorCovar(Eigen::Matrix2d::Identity()),
+angVelThresh(0.001),
+landmarkPriorVariance(std::numeric_limits<float>::max()),
+lastPredictStamp(-std::numeric_limits<double>::max()),
+numLate(0),
+motionGr(Eigen::Matrix3d::Identity()),
+motionVariances(Eigen::Matrix3d::Zero()),
+bMoved(false),
+states(Eigen::VectorXd::Zero(NumModelStates)),
+bVariancesValid(false)
+{
+    landmarkIds.reserve(initialCapacity);
+    landmarkSlots.reserve(initialCapacity);
+}
+
+void IsamSlam::setRobotPose(double x, double y, double th)
+{
+    if(numKeyframes > 0)
+    {
+        std::cout << "Robot pose set after the first keyframe, ignored" << std::endl;
+        return;
+    }
+    keyframePose = gtsam::Pose2(x, y, th);
+    robotPose = keyframePose;
+    motionGr.setIdentity();
+    motionVariances.setZero();
+    bMoved = false;
+    bVariancesValid = false;
+}
+
+void IsamSlam::landmarkFromObservation(double range, double bearing, double &landX, double &landY) const
+{
+    landX = robotPose.x() + range * std::cos(bearing + robotPose.theta());
+    landY = robotPose.y() + range * std::sin(bearing + robotPose.theta());
+}
+
+int IsamSlam::addLandmark(int landmarkId, double landX, double landY)
+{
+    std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(landmarkId);
+    if(it != landmarkSlots.end())
+    {
+        return it->second;
+    }
+
+    int slot = landmarkIds.size();
+    landmarkSlots[landmarkId] = slot;
+    landmarkIds.push_back(landmarkId);
+
+    // Handed to isam with the next keyframe
+    gtsam::Point2 landmark(landX, landY);
+    newValues.insert(L(landmarkId), landmark);
+    newFactors.emplace_shared<gtsam::PriorFactor<gtsam::Point2> >(L(landmarkId), landmark,
+        gtsam::noiseModel::Isotropic::Variance(NumComponents, landmarkPriorVariance));
+    states.conservativeResize(NumModelStates + NumComponents*landmarkIds.size());
+    states.segment<NumComponents>(NumModelStates + NumComponents*slot) << landX, landY;
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_LANDMARK_ADDED, landmarkId, landX, landY, slot, (int)landmarkIds.capacity());
+    return slot;
+}
+
+// Same model and Jacobian Gr as EkfSlam::predict(), from the last keyframe
+void IsamSlam::predict(double stamp, double linVel, double angVel, double deltaT)
+{
+    lastPredictStamp = std::max(lastPredictStamp, stamp);
+
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d Gr;
+    double th = robotPose.theta();
+    velocityMotion(th, linVel, angVel, deltaT, angVelThresh, delta, Gr);
+    motionVariances = Gr * motionVariances * Gr.transpose() + RmotionCovar;
+    motionGr = Gr * motionGr;
+    robotPose = gtsam::Pose2(robotPose.x() + delta(0), robotPose.y() + delta(1), normalizeAngle(th + delta(2)));
+    bMoved = true;
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_PREDICT, NumModelStates + NumComponents*landmarkIds.size(), linVel, angVel, deltaT, robotPose.theta());
+}
+
+int IsamSlam::rewind(double stamp)
+{
+    if(stamp < lastPredictStamp)
+    {
+        numLate += 1;
+    }
+    return 0;
+}
+
+// Starts the graph with the prior on the first keyframe, and adds a keyframe at robotPose if the robot moved since
+// the last one
+void IsamSlam::addKeyframe()
+{
+    if(numKeyframes == 0)
+    {
+        newValues.insert(X(0), keyframePose);
+        newFactors.emplace_shared<gtsam::PriorFactor<gtsam::Pose2> >(X(0), keyframePose,
+            gtsam::noiseModel::Isotropic::Sigma(NumModelStates, ISAM_PRIOR_SIGMA));
+        numKeyframes = 1;
+    }
+    if(!bMoved)
+    {
+        return;
+    }
+
+    // BetweenFactor<Pose2> takes its error in the frame of the new pose, and the motion variances are in the world
+    // frame
+    Eigen::Matrix3d A = Eigen::Matrix3d::Identity();
+    A.topLeftCorner<2, 2>() = robotPose.rotation().matrix().transpose();
+    Eigen::Matrix3d odometryVariances = A * motionVariances * A.transpose() + ISAM_MIN_VARIANCE * Eigen::Matrix3d::Identity();
+    newFactors.emplace_shared<gtsam::BetweenFactor<gtsam::Pose2> >(X(numKeyframes - 1), X(numKeyframes),
+        keyframePose.between(robotPose), gtsam::noiseModel::Gaussian::Covariance(odometryVariances));
+    newValues.insert(X(numKeyframes), robotPose);
+    numKeyframes += 1;
+
+    keyframePose = robotPose;
+    motionGr.setIdentity();
+    motionVariances.setZero();
+    bMoved = false;
+}
+
+int IsamSlam::update(const std::vector<LandmarkObservation> &observations)
+{
+    if(observations.empty())
+    {
+        return 0;
+    }
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        const LandmarkObservation &obs = observations[i];
+        if(!isLandmarkSeen(obs.landmarkId))
+        {
+            double landX, landY;
+            landmarkFromObservation(obs.range, obs.bearing, landX, landY);
+            addLandmark(obs.landmarkId, landX, landY);
+        }
+    }
+
+    addKeyframe();
+    gtsam::Key pose = X(numKeyframes - 1);
+
+    // BearingRange measurements are (bearing, range), the other way round from LandmarkObservation
+    Eigen::Matrix2d bearingRangeVariances;
+    bearingRangeVariances << QsensorCovar(1, 1), QsensorCovar(1, 0),
+                             QsensorCovar(0, 1), QsensorCovar(0, 0);
+    gtsam::SharedNoiseModel sensorNoise = gtsam::noiseModel::Gaussian::Covariance(bearingRangeVariances);
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        const LandmarkObservation &obs = observations[i];
+        newFactors.emplace_shared<gtsam::BearingRangeFactor<gtsam::Pose2, gtsam::Point2> >(pose, L(obs.landmarkId),
+            gtsam::Rot2::fromAngle(obs.bearing), obs.range, sensorNoise);
+    }
+
+    isam.update(newFactors, newValues);
+    newFactors.resize(0);
+    newValues.clear();
+
+    // The keyframe is the robot pose until the next prediction
+    keyframePose = isam.calculateEstimate<gtsam::Pose2>(pose);
+    robotPose = keyframePose;
+
+    // Landmark estimates, one variable at a time. Each is its linearization point plus its part of the delta that
+    // the update has already solved for, so this doesn't go over the whole graph like calculateEstimate() does.
+    for(int i = 0; i < landmarkIds.size(); ++i)
+    {
+        gtsam::Point2 landmark = isam.calculateEstimate<gtsam::Point2>(L(landmarkIds[i]));
+        states.segment<NumComponents>(NumModelStates + NumComponents*i) << landmark.x(), landmark.y();
+    }
+    bVariancesValid = false;
+    return observations.size();
+}
+
+Eigen::Ref<const Eigen::VectorXd> IsamSlam::getStates()
+{
+    states.head<NumModelStates>() << robotPose.x(), robotPose.y(), robotPose.theta();
+    return states;
+}
+
+Eigen::Ref<const Eigen::MatrixXd> IsamSlam::getVariances()
+{
+    if(!bVariancesValid)
+    {
+        int n = NumModelStates + NumComponents*landmarkIds.size();
+        variances.setZero(n, n);
+
+        variances.topLeftCorner<NumModelStates, NumModelStates>() = getRobotVariances();
+
+        for(int i = 0; i < landmarkIds.size(); ++i)
+        {
+            gtsam::Key key = L(landmarkIds[i]);
+            int stateIdx = NumModelStates + NumComponents*i;
+            if(isam.getLinearizationPoint().exists(key))
+            {
+                variances.block<NumComponents, NumComponents>(stateIdx, stateIdx) = isam.marginalCovariance(key);
+            }
+            else
+            {
+                variances.block<NumComponents, NumComponents>(stateIdx, stateIdx) = landmarkPriorVariance * Eigen::Matrix2d::Identity();
+            }
+        }
+        bVariancesValid = true;
+    }
+    return variances;
+}
+
+// Marginal of the keyframe, in its own frame, to the world frame and moved on by the motion since. The last
+// keyframe is near the root of the Bayes tree, so its marginal only takes a few cliques.
+Eigen::Matrix3d IsamSlam::getRobotVariances()
+{
+    Eigen::Matrix3d robotVariances = motionVariances;
+    gtsam::Key pose = X(std::max(numKeyframes - 1, 0));
+    if(isam.getLinearizationPoint().exists(pose))
+    {
+        Eigen::Matrix3d B = Eigen::Matrix3d::Identity();
+        B.topLeftCorner<2, 2>() = keyframePose.rotation().matrix();
+        Eigen::Matrix3d keyframeVariances = isam.marginalCovariance(pose);
+        robotVariances += motionGr * B * keyframeVariances * B.transpose() * motionGr.transpose();
+    }
+    return robotVariances;
+}
+
+void IsamSlam::display() const
+{
+    std::cout << "numModelStates " << (int)NumModelStates << std::endl;
+    std::cout << "numLandmarks " << landmarkIds.size() << std::endl;
+    std::cout << "numKeyframes " << numKeyframes << std::endl;
+    std::cout << "landmarkPriorVariance " << landmarkPriorVariance << std::endl;
+    std::cout << "robotPose " << robotPose.x() << " " << robotPose.y() << " " << robotPose.theta() << std::endl;
+    std::cout << "RmotionCovar " << RmotionCovar << std::endl;
+    std::cout << "QsensorCovar " << QsensorCovar << std::endl;
+}
@@ -0,0 +1,260 @@
+#include "turtlebot3_gazebo/landmark_association.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+LandmarkAssociator::LandmarkAssociator(double cellSize, double gateThresh, double newLandmarkThresh,
+                                       double tentativeRadius, int tentativeFrames, int rebuildPeriod, int firstId) :
+cellSize(cellSize),
+gateThresh(gateThresh),
+newLandmarkThresh(std::max(newLandmarkThresh, gateThresh)),
+tentativeRadius(std::min(tentativeRadius, cellSize)),
+tentativeFrames(std::max(tentativeFrames, 1)),
+rebuildPeriod(std::max(rebuildPeriod, 1)),
+nextId(firstId),
+numFrames(0)
+{
+}
+
+long long LandmarkAssociator::cellKey(double x, double y) const
+{
+    long long cx = (long long)std::floor(x / cellSize);
+    long long cy = (long long)std::floor(y / cellSize);
+    return (cx << 32) ^ (cy & 0xffffffffLL);
+}
+
+LandmarkAssociator::Entry &LandmarkAssociator::entry(int landmarkId)
+{
+    if(landmarkId >= entries.size())
+    {
+        Entry empty = {0, 0, 0, 0, -1, false};
+        entries.resize(landmarkId + 1, empty);
+    }
+    return entries[landmarkId];
+}
+
+// Moves a landmark to (x, y), changing cells only if it left its cell
+void LandmarkAssociator::index(int landmarkId, double x, double y)
+{
+    Entry &e = entry(landmarkId);
+    long long cell = cellKey(x, y);
+    if(!e.bIndexed || cell != e.cell)
+    {
+        unindex(landmarkId);
+        cells[cell].push_back(landmarkId);
+        e.cell = cell;
+        e.bIndexed = true;
+    }
+    e.x = x;
+    e.y = y;
+}
+
+// Takes a landmark out of its cell, and the cell out of the grid once it is empty
+void LandmarkAssociator::unindex(int landmarkId)
+{
+    Entry &e = entries[landmarkId];
+    if(!e.bIndexed)
+    {
+        return;
+    }
+    std::unordered_map<long long, std::vector<int> >::iterator it = cells.find(e.cell);
+    it->second.erase(std::find(it->second.begin(), it->second.end(), landmarkId));
+    if(it->second.empty())
+    {
+        cells.erase(it);
+    }
+    e.bIndexed = false;
+}
+
+// Drops the tentative landmarks last seen more than tentativeFrames frames ago, and forgets the ones the filter
+// has added since
+void LandmarkAssociator::expireTentative(const SlamBackend &filter)
+{
+    expiredIds.clear();
+    int numKept = 0;
+    for(int i = 0; i < tentativeIds.size(); ++i)
+    {
+        int landmarkId = tentativeIds[i];
+        if(filter.isLandmarkSeen(landmarkId))
+        {
+            continue;
+        }
+        if(numFrames - entries[landmarkId].takenFrame > tentativeFrames)
+        {
+            unindex(landmarkId);
+            Entry empty = {0, 0, 0, 0, -1, false};
+            entries[landmarkId] = empty;
+            freeIds.push_back(landmarkId);
+            expiredIds.push_back(landmarkId);
+            continue;
+        }
+        tentativeIds[numKept] = landmarkId;
+        numKept += 1;
+    }
+    tentativeIds.resize(numKept);
+}
+
+// Landmarks in the 3x3 cells around (x, y), ie. at least all of those within cellSize
+void LandmarkAssociator::findNear(double x, double y, std::vector<int> &landmarkIds) const
+{
+    landmarkIds.clear();
+    for(int dx = -1; dx <= 1; ++dx)
+    {
+        for(int dy = -1; dy <= 1; ++dy)
+        {
+            std::unordered_map<long long, std::vector<int> >::const_iterator it = cells.find(cellKey(x + dx*cellSize, y + dy*cellSize));
+            if(it != cells.end())
+            {
+                landmarkIds.insert(landmarkIds.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+}
+
+void LandmarkAssociator::rebuild(const std::vector<int> &landmarkIds, const Eigen::Ref<const Eigen::VectorXd> &states)
+{
+    for(int i = 0; i < landmarkIds.size(); ++i)
+    {
+        index(landmarkIds[i], states(3 + 2*i), states(4 + 2*i));
+    }
+}
+
+int LandmarkAssociator::associate(SlamBackend &filter, std::vector<LandmarkObservation> &observations)
+{
+    int numUnlabelled = 0;
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        numUnlabelled += observations[i].landmarkId < 0;
+    }
+    expiredIds.clear();
+    if(numUnlabelled == 0)
+    {
+        return 0;
+    }
+
+    if(numFrames % rebuildPeriod == 0)
+    {
+        rebuild(filter.getLandmarkIds(), filter.getStates());
+    }
+    numFrames += 1;
+    expireTentative(filter);
+
+    // Gating against the landmarks in the state
+    matches.clear();
+    minDistances.assign(observations.size(), std::numeric_limits<double>::max());
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        const LandmarkObservation &obs = observations[i];
+        if(obs.landmarkId >= 0)
+        {
+            continue;
+        }
+        double x, y;
+        filter.landmarkFromObservation(obs.range, obs.bearing, x, y);
+        findNear(x, y, candidates);
+        for(int k = 0; k < candidates.size(); ++k)
+        {
+            int landmarkId = candidates[k];
+            Eigen::Vector2d nu;
+            Eigen::Matrix2d S;
+            if(!filter.isLandmarkSeen(landmarkId) || !filter.innovation(landmarkId, obs.range, obs.bearing, nu, S))
+            {
+                continue;
+            }
+
+            // The innovation gives the current mean of the landmark back, z - nu being where it is expected
+            double meanX, meanY;
+            filter.landmarkFromObservation(obs.range - nu(0), obs.bearing - nu(1), meanX, meanY);
+            index(landmarkId, meanX, meanY);
+
+            // nu^T * S^-1 * nu with the 2x2 inverse written out
+            double det = S(0, 0)*S(1, 1) - S(0, 1)*S(1, 0);
+            if(det <= 0)
+            {
+                continue;
+            }
+            double distance = (S(1, 1)*nu(0)*nu(0) - (S(0, 1) + S(1, 0))*nu(0)*nu(1) + S(0, 0)*nu(1)*nu(1)) / det;
+            minDistances[i] = std::min(minDistances[i], distance);
+            if(distance < gateThresh)
+            {
+                Match match = {distance, i, landmarkId};
+                matches.push_back(match);
+            }
+        }
+    }
+
+    // Closest pairs first, each landmark and observation used once
+    std::sort(matches.begin(), matches.end());
+    int numAssociated = 0;
+    for(int k = 0; k < matches.size(); ++k)
+    {
+        LandmarkObservation &obs = observations[matches[k].observation];
+        Entry &e = entry(matches[k].landmarkId);
+        if(obs.landmarkId >= 0 || e.takenFrame == numFrames)
+        {
+            continue;
+        }
+        obs.landmarkId = matches[k].landmarkId;
+        e.takenFrame = numFrames;
+        numAssociated += 1;
+    }
+
+    // New landmarks, through the tentative ones
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        LandmarkObservation &obs = observations[i];
+        if(obs.landmarkId >= 0 || minDistances[i] < newLandmarkThresh)
+        {
+            continue;
+        }
+        double x, y;
+        filter.landmarkFromObservation(obs.range, obs.bearing, x, y);
+        findNear(x, y, candidates);
+        int best = -1;
+        double bestDistance = tentativeRadius;
+        for(int k = 0; k < candidates.size(); ++k)
+        {
+            const Entry &e = entries[candidates[k]];
+            double distance = std::sqrt((e.x - x)*(e.x - x) + (e.y - y)*(e.y - y));
+            if(distance < bestDistance && e.takenFrame != numFrames && !filter.isLandmarkSeen(candidates[k]))
+            {
+                best = candidates[k];
+                bestDistance = distance;
+            }
+        }
+        if(best < 0)
+        {
+            if(freeIds.empty())
+            {
+                best = nextId;
+                nextId += 1;
+            }
+            else
+            {
+                best = freeIds.back();
+                freeIds.pop_back();
+            }
+            tentativeIds.push_back(best);
+        }
+
+        Entry &e = entry(best);
+        e.count += 1;
+        index(best, e.x + (x - e.x)/e.count, e.y + (y - e.y)/e.count);
+        e.takenFrame = numFrames;
+        obs.landmarkId = best;
+        numAssociated += 1;
+    }
+    return numAssociated;
+}
+
+int LandmarkAssociator::getNumIndexed() const
+{
+    int numIndexed = 0;
+    for(int i = 0; i < entries.size(); ++i)
+    {
+        numIndexed += entries[i].bIndexed;
+    }
+    return numIndexed;
+}
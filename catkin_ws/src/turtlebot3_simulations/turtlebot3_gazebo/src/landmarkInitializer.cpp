@@ -0,0 +1,109 @@
+#include "turtlebot3_gazebo/landmark_initializer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+
+LandmarkMleInitializer::LandmarkMleInitializer(int windowLength, double varianceThresh)
+{
+    setWindow(windowLength, varianceThresh);
+}
+
+void LandmarkMleInitializer::setWindow(int windowLength, double varianceThresh)
+{
+    this->windowLength = std::max(windowLength, 1);
+    this->varianceThresh = varianceThresh;
+    windows.clear();
+    samples.clear();
+}
+
+void LandmarkMleInitializer::addToMoments(Window &window, double x, double y)
+{
+    window.count += 1;
+    double dx = x - window.meanX;
+    double dy = y - window.meanY;
+    window.meanX += dx / window.count;
+    window.meanY += dy / window.count;
+    window.momentXX += dx * (x - window.meanX);
+    window.momentYY += dy * (y - window.meanY);
+    window.momentXY += dx * (y - window.meanY);
+}
+
+void LandmarkMleInitializer::removeFromMoments(Window &window, double x, double y)
+{
+    window.count -= 1;
+    if(window.count == 0)
+    {
+        window.meanX = window.meanY = 0;
+        window.momentXX = window.momentYY = window.momentXY = 0;
+        return;
+    }
+    double dx = x - window.meanX;
+    double dy = y - window.meanY;
+    window.meanX -= dx / window.count;
+    window.meanY -= dy / window.count;
+    window.momentXX -= dx * (x - window.meanX);
+    window.momentYY -= dy * (y - window.meanY);
+    window.momentXY -= dx * (y - window.meanY);
+}
+
+bool LandmarkMleInitializer::addSample(int landmarkId, double landX, double landY, double &meanX, double &meanY)
+{
+    Eigen::Matrix2d covariance;
+    return addSample(landmarkId, landX, landY, meanX, meanY, covariance);
+}
+
+bool LandmarkMleInitializer::addSample(int landmarkId, double landX, double landY, double &meanX, double &meanY, Eigen::Matrix2d &covariance)
+{
+    if(landmarkId < 0)
+    {
+        return false;
+    }
+    if(landmarkId >= windows.size())
+    {
+        Window empty = {0, 0, 0, 0, 0, 0, 0};
+        windows.resize(landmarkId + 1, empty);
+        samples.resize(2 * windowLength * windows.size());
+    }
+
+    Window &window = windows[landmarkId];
+    double *sample = &samples[2 * (landmarkId * windowLength + window.next)];
+    if(window.count == windowLength)
+    {
+        removeFromMoments(window, sample[0], sample[1]); // remove the oldest reading
+    }
+    sample[0] = landX;
+    sample[1] = landY;
+    addToMoments(window, landX, landY);
+    window.next = (window.next + 1) % windowLength;
+
+    meanX = window.meanX;
+    meanY = window.meanY;
+    covariance << window.momentXX, window.momentXY,
+                  window.momentXY, window.momentYY;
+    covariance /= window.count;
+
+    // Initialize prior belief once the window is full and the covariance is small enough along any direction
+    double halfTrace = 0.5 * (covariance(0, 0) + covariance(1, 1));
+    double halfDiff = 0.5 * (covariance(0, 0) - covariance(1, 1));
+    double maxVariance = halfTrace + std::sqrt(halfDiff * halfDiff + covariance(0, 1) * covariance(0, 1));
+    if(window.count >= windowLength && maxVariance < varianceThresh)
+    {
+        std::cout << "INITIALIZED prior for landmark: " << landmarkId << std::endl;
+        std::cout << window.count << std::endl;
+        std::cout << meanX << ", " << meanY << std::endl;
+        std::cout << covariance(0, 0) << ", " << covariance(1, 1) << ", " << covariance(0, 1) << std::endl;
+        return true;
+    }
+    return false;
+}
+
+void LandmarkMleInitializer::clear(int landmarkId)
+{
+    if(landmarkId >= 0 && landmarkId < windows.size())
+    {
+        Window empty = {0, 0, 0, 0, 0, 0, 0};
+        windows[landmarkId] = empty;
+    }
+}
@@ -0,0 +1,235 @@
+#include "turtlebot3_gazebo/lidar_landmark.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "turtlebot3_gazebo/ekf_slam.h" // normalizeAngle() and PI
+
+
+std::vector<double> lidarRangeHeading(const std::vector<float> &lidarRange, double angleInc, float INF)
+{
+    double avgRange = 0;
+    int ctr = 0;
+    for (int i = 0; i < lidarRange.size(); ++i)
+    {
+        if (lidarRange[i] < INF)
+        {
+            avgRange += lidarRange[i];
+            ctr += 1;
+        }
+    }
+    if(ctr <= 3) // Not enough number of reliable lidar reflections
+    {
+        avgRange = INF;
+    }
+    else
+    {
+        avgRange /= ctr;
+    }
+
+    double headingStart = 0;
+    double headingStop = 0;
+    double headingMiddle = 0;
+    for (int i = 0; i < lidarRange.size()-1; ++i)
+    {
+        if(lidarRange[i] >= INF && lidarRange[i+1] < INF)
+        {
+            headingStart = (i+1)*angleInc;
+            break;
+        }
+    }
+    headingStart = normalizeAngle(headingStart);
+
+    for (int i = 0; i < lidarRange.size()-1; ++i)
+    {
+        if(lidarRange[i] < INF && lidarRange[i+1] >= INF)
+        {
+            headingStop = i*angleInc;
+        }
+    }        
+    headingStop = normalizeAngle(headingStop);
+
+    // Heading points are in the positive half. Take avg and assign +ve sign
+    if ( (headingStart > 0) && (headingStart <= PI) && (headingStop > 0) && (headingStop <= PI) )
+    {
+        headingMiddle = std::abs(headingStop + headingStart) / 2.0;
+    }
+    // Heading points are in the negative half. Take avg and assign -ve sign
+    else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop < 0) && (headingStop >= -PI) )
+    {
+        headingMiddle = - std::abs(headingStop + headingStart) / 2.0;
+    }
+    // Start point is in positive half and stop is in the negative half. 
+    // Find actual measurement angle viz complement of direct angle. Half of this angle measurement to be added to start and normalized
+    else if ( (headingStart > 0) && (headingStart <= PI) && (headingStop < 0) && (headingStop >= -PI) )
+    {
+        double measurementAngle  = 2*PI - (std::abs(headingStart) + std::abs(headingStop));
+        headingMiddle = normalizeAngle( headingStart + measurementAngle/2.0 );
+    }
+    // Start point is in negative half and stop point is in the positive half
+    // Find angle range in between the start and stop points. Assign sign based on which is larger in magnitude
+    else if ( (headingStart < 0) && (headingStart >= -PI) && (headingStop > 0) && (headingStop <= PI) )
+    {
+        double measurementAngle  = std::abs(headingStart) + std::abs(headingStop);
+        if ( std::abs(headingStop) >= std::abs(headingStart) ) // Will fall on positive side
+        {
+            headingMiddle = + ( measurementAngle/2.0 - std::abs(headingStart) );
+        }
+        else // Will fall on negative side
+        {
+            headingMiddle = - ( measurementAngle/2.0 - std::abs(headingStop) );
+        }
+    }
+
+    std::vector<double> output = {avgRange, headingMiddle};
+    return output;
+}
+
+LidarSegmenter::LidarSegmenter(double jumpDistance, int minPoints, double maxWidth, double rangeVariance) :
+jumpDistance(jumpDistance),
+minPoints(std::max(minPoints, 1)),
+maxWidth(maxWidth),
+rangeVariance(rangeVariance),
+tableAngleMin(0),
+tableAngleInc(0)
+{
+}
+
+void LidarSegmenter::setAngles(double angleMin, double angleInc, int numRays)
+{
+    if(cosTable.size() == numRays && tableAngleMin == angleMin && tableAngleInc == angleInc)
+    {
+        return;
+    }
+    tableAngleMin = angleMin;
+    tableAngleInc = angleInc;
+    cosTable.resize(numRays);
+    sinTable.resize(numRays);
+    pointsX.resize(numRays);
+    pointsY.resize(numRays);
+    for(int i = 0; i < numRays; ++i)
+    {
+        double angle = angleMin + i*angleInc;
+        cosTable(i) = std::cos(angle);
+        sinTable(i) = std::sin(angle);
+    }
+}
+
+bool LidarSegmenter::toCluster(const Segment &segment, double angleInc, LidarCluster &cluster) const
+{
+    double widthX = segment.lastX - segment.firstX;
+    double widthY = segment.lastY - segment.firstY;
+    if(segment.count < minPoints || widthX*widthX + widthY*widthY > maxWidth*maxWidth)
+    {
+        return false;
+    }
+
+    double meanX = segment.sumX / segment.count;
+    double meanY = segment.sumY / segment.count;
+    double range = std::sqrt(meanX*meanX + meanY*meanY);
+    if(range <= 0)
+    {
+        return false;
+    }
+    Eigen::Matrix2d spread;
+    spread << segment.sumXX/segment.count - meanX*meanX, segment.sumXY/segment.count - meanX*meanY,
+              segment.sumXY/segment.count - meanX*meanY, segment.sumYY/segment.count - meanY*meanY;
+    Eigen::Matrix2d J; // d(range, bearing) / d(x, y)
+    J << meanX/range, meanY/range,
+         -meanY/(range*range), meanX/(range*range);
+
+    cluster.range = range;
+    cluster.bearing = std::atan2(meanY, meanX);
+    cluster.covariance = J * spread * J.transpose();
+    cluster.covariance(0, 0) += rangeVariance;
+    cluster.covariance(1, 1) += angleInc*angleInc;
+    cluster.numPoints = segment.count;
+    return true;
+}
+
+int LidarSegmenter::segment(const std::vector<float> &ranges, double angleMin, double angleInc, float rangeMin, float rangeMax,
+                            LidarClusterList &clusters)
+{
+    int numRays = ranges.size();
+    clusters.clear();
+    segments.clear();
+    if(numRays == 0)
+    {
+        return 0;
+    }
+    setAngles(angleMin, angleInc, numRays);
+
+    // Polar to Cartesian, packets of rays at a time. Rays out of range give garbage points that are skipped below
+    Eigen::Map<const Eigen::ArrayXf> r(ranges.data(), numRays);
+    pointsX = r * cosTable;
+    pointsY = r * sinTable;
+
+    // Single pass over the rays
+    float jump2 = jumpDistance*jumpDistance;
+    Segment *current = 0;
+    for(int i = 0; i < numRays; ++i)
+    {
+        float range = ranges[i];
+        if(!(range >= rangeMin && range <= rangeMax)) // Also false for NaN
+        {
+            continue;
+        }
+        float x = pointsX(i);
+        float y = pointsY(i);
+        if(current)
+        {
+            float dx = x - current->lastX;
+            float dy = y - current->lastY;
+            if(dx*dx + dy*dy > jump2)
+            {
+                current = 0;
+            }
+        }
+        if(!current)
+        {
+            Segment empty = {0, 0, 0, 0, 0, 0, x, y, x, y};
+            segments.push_back(empty);
+            current = &segments.back();
+        }
+        current->count += 1;
+        current->sumX += x;
+        current->sumY += y;
+        current->sumXX += x*x;
+        current->sumYY += y*y;
+        current->sumXY += x*y;
+        current->lastX = x;
+        current->lastY = y;
+    }
+
+    // The first and last clusters of a full turn are the same object if the gap over the last ray isn't a jump
+    bool bFullTurn = numRays*std::abs(angleInc) >= 2*PI - std::abs(angleInc)/2;
+    if(bFullTurn && segments.size() > 1)
+    {
+        Segment &first = segments.front();
+        const Segment &last = segments.back();
+        float dx = first.firstX - last.lastX;
+        float dy = first.firstY - last.lastY;
+        if(dx*dx + dy*dy <= jump2)
+        {
+            first.count += last.count;
+            first.sumX += last.sumX;
+            first.sumY += last.sumY;
+            first.sumXX += last.sumXX;
+            first.sumYY += last.sumYY;
+            first.sumXY += last.sumXY;
+            first.firstX = last.firstX;
+            first.firstY = last.firstY;
+            segments.pop_back();
+        }
+    }
+
+    LidarCluster cluster;
+    for(int i = 0; i < segments.size(); ++i)
+    {
+        if(toCluster(segments[i], std::abs(angleInc), cluster))
+        {
+            clusters.push_back(cluster);
+        }
+    }
+    return clusters.size();
+}
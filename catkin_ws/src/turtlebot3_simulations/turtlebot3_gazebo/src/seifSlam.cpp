@@ -0,0 +1,524 @@
+#include "turtlebot3_gazebo/seif_slam.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#define SEIF_ROBOT_PRIOR_INFO 1e6 // Information of the initial robot pose. The EKF starts it at zero variance, which has no information form
+
+
+SeifSlam::SeifSlam(int initialCapacity, int maxActive, int numRelaxPerStep) :
+robotInfo(SEIF_ROBOT_PRIOR_INFO * Eigen::Matrix3d::Identity()),
+robotInfoVector(Eigen::Vector3d::Zero()),
+robotMean(Eigen::Vector3d::Zero()),
+RmotionCovar(Eigen::Matrix3d::Zero()),
+QsensorInfo(Eigen::Matrix2d::Identity()),
+angVelThresh(0.001),
+landmarkPriorVariance(std::numeric_limits<float>::max()),
+maxActive(std::max(maxActive, 1)),
+numRelaxPerStep(std::max(numRelaxPerStep, 0)),
+nextRelaxSlot(0),
+lastPredictStamp(-std::numeric_limits<double>::max()),
+numLate(0),
+bVariancesValid(false)
+{
+    landmarks.reserve(std::max(initialCapacity, 1));
+    landmarkIds.reserve(std::max(initialCapacity, 1));
+    landmarkSlots.reserve(std::max(initialCapacity, 1));
+    activeSlots.reserve(this->maxActive + 1);
+    localSlots.reserve(this->maxActive + 1);
+}
+
+void SeifSlam::setRobotPose(double x, double y, double th)
+{
+    robotMean << x, y, th;
+    robotInfoVector = robotInfo * robotMean;
+    for(int i = 0; i < activeSlots.size(); ++i)
+    {
+        robotInfoVector += landmarks[activeSlots[i]].robotLink * landmarks[activeSlots[i]].mean;
+    }
+    bVariancesValid = false;
+}
+
+void SeifSlam::landmarkFromObservation(double range, double bearing, double &landX, double &landY) const
+{
+    landX = robotMean(0) + range * std::cos(bearing + robotMean(2));
+    landY = robotMean(1) + range * std::sin(bearing + robotMean(2));
+}
+
+// The prior has landmarkPriorVariance along x and y and no links to the robot or the other landmarks
+int SeifSlam::addLandmark(int landmarkId, double landX, double landY)
+{
+    std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(landmarkId);
+    if(it != landmarkSlots.end())
+    {
+        return it->second;
+    }
+
+    int slot = landmarks.size();
+    Landmark lm;
+    lm.info = (1.0 / landmarkPriorVariance) * Eigen::Matrix2d::Identity();
+    lm.mean << landX, landY;
+    lm.infoVector = lm.info * lm.mean;
+    lm.robotLink.setZero();
+    lm.bActive = false;
+    landmarks.push_back(lm);
+    landmarkSlots[landmarkId] = slot;
+    landmarkIds.push_back(landmarkId);
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_LANDMARK_ADDED, landmarkId, landX, landY, slot, landmarks.capacity());
+    return slot;
+}
+
+Eigen::Matrix2d *SeifSlam::findLink(int slot, int otherSlot)
+{
+    LinkList &links = landmarks[slot].links;
+    for(int i = 0; i < links.size(); ++i)
+    {
+        if(links[i].slot == otherSlot)
+        {
+            return &links[i].info;
+        }
+    }
+    return NULL;
+}
+
+void SeifSlam::setLink(int slot, int otherSlot, const Eigen::Matrix2d &info)
+{
+    Eigen::Matrix2d *link = findLink(slot, otherSlot);
+    if(link)
+    {
+        *link = info;
+        *findLink(otherSlot, slot) = info.transpose();
+        return;
+    }
+    if(info.isZero(0))
+    {
+        return; // Never linked, keep it that way
+    }
+
+    Link newLink;
+    newLink.slot = otherSlot;
+    newLink.info = info;
+    landmarks[slot].links.push_back(newLink);
+    newLink.slot = slot;
+    newLink.info = info.transpose();
+    landmarks[otherSlot].links.push_back(newLink);
+}
+
+void SeifSlam::gatherLocal()
+{
+    int n = NumModelStates + NumComponents*localSlots.size();
+    localInfo.setZero(n, n);
+    localInfoVector.resize(n);
+    localMean.resize(n);
+
+    localInfo.topLeftCorner<NumModelStates, NumModelStates>() = robotInfo;
+    localInfoVector.head<NumModelStates>() = robotInfoVector;
+    localMean.head<NumModelStates>() = robotMean;
+    for(int i = 0; i < localSlots.size(); ++i)
+    {
+        const Landmark &lm = landmarks[localSlots[i]];
+        int idx = NumModelStates + NumComponents*i;
+        localInfo.block<NumModelStates, NumComponents>(0, idx) = lm.robotLink;
+        localInfo.block<NumComponents, NumModelStates>(idx, 0) = lm.robotLink.transpose();
+        localInfo.block<NumComponents, NumComponents>(idx, idx) = lm.info;
+        localInfoVector.segment<NumComponents>(idx) = lm.infoVector;
+        localMean.segment<NumComponents>(idx) = lm.mean;
+
+        for(int j = i+1; j < localSlots.size(); ++j)
+        {
+            const Eigen::Matrix2d *link = findLink(localSlots[i], localSlots[j]);
+            if(link)
+            {
+                int jdx = NumModelStates + NumComponents*j;
+                localInfo.block<NumComponents, NumComponents>(idx, jdx) = *link;
+                localInfo.block<NumComponents, NumComponents>(jdx, idx) = link->transpose();
+            }
+        }
+    }
+}
+
+// Writes the local block back. The upper triangle is taken, so that the stored blocks stay exactly symmetric.
+void SeifSlam::scatterLocal()
+{
+    robotInfo = localInfo.topLeftCorner<NumModelStates, NumModelStates>().selfadjointView<Eigen::Upper>();
+    robotInfoVector = localInfoVector.head<NumModelStates>();
+    robotMean = localMean.head<NumModelStates>();
+    for(int i = 0; i < localSlots.size(); ++i)
+    {
+        Landmark &lm = landmarks[localSlots[i]];
+        int idx = NumModelStates + NumComponents*i;
+        lm.robotLink = localInfo.block<NumModelStates, NumComponents>(0, idx);
+        lm.info = localInfo.block<NumComponents, NumComponents>(idx, idx).selfadjointView<Eigen::Upper>();
+        lm.infoVector = localInfoVector.segment<NumComponents>(idx);
+        lm.mean = localMean.segment<NumComponents>(idx);
+
+        for(int j = i+1; j < localSlots.size(); ++j)
+        {
+            int jdx = NumModelStates + NumComponents*j;
+            setLink(localSlots[i], localSlots[j], localInfo.block<NumComponents, NumComponents>(idx, jdx));
+        }
+    }
+}
+
+// Motion update in information form (Probabilistic Robotics, table 12.3), on the local block of the robot and the
+// active landmarks, which is the only part of Omega and xi it changes since the robot has no other links.
+void SeifSlam::predict(double stamp, double linVel, double angVel, double deltaT)
+{
+    lastPredictStamp = std::max(lastPredictStamp, stamp);
+
+    Eigen::Vector3d delta;
+    Eigen::Matrix3d Gr;
+    velocityMotion(robotMean(2), linVel, angVel, deltaT, angVelThresh, delta, Gr);
+
+    localSlots = activeSlots;
+    gatherLocal();
+
+    // Phi = G^-T * Omega * G^-1. Delta is zero but for the top of its th column, so Delta^2 = 0, G^-1 = I - Delta,
+    Eigen::Matrix3d GrInv = Eigen::Matrix3d::Identity();
+    GrInv(0,2) = -Gr(0,2);
+    GrInv(1,2) = -Gr(1,2);
+    // and only the robot rows and columns change. Those are filled in from Omega_:r * G^-1, so that no 3xN
+    // temporaries get allocated on every prediction.
+    int n = localInfo.rows();
+    localGain.noalias() = localInfo.leftCols<NumModelStates>() * GrInv;
+    Eigen::Matrix3d robotBlock = GrInv.transpose() * localGain.topRows<NumModelStates>();
+    localNewInfo = localInfo;
+    localNewInfo.leftCols<NumModelStates>() = localGain;
+    localNewInfo.topRightCorner(NumModelStates, n - NumModelStates) = localGain.bottomRows(n - NumModelStates).transpose();
+    localNewInfo.topLeftCorner<NumModelStates, NumModelStates>() = robotBlock;
+
+    // Omega_bar = Phi - kappa, kappa = Phi_:r * (R^-1 + Phi_rr)^-1 * Phi_r:
+    // with (R^-1 + Phi_rr)^-1 = R * (I + Phi_rr * R)^-1, which doesn't need R to be invertible
+    Eigen::Matrix3d noiseGain = RmotionCovar *
+        (Eigen::Matrix3d::Identity() + localNewInfo.topLeftCorner<NumModelStates, NumModelStates>() * RmotionCovar).inverse();
+    localRobotCols = localNewInfo.leftCols<NumModelStates>();
+    localGain.noalias() = localRobotCols * noiseGain;
+    localNewInfo.noalias() -= localGain * localRobotCols.transpose();
+
+    // xi_bar = xi + Omega_bar * mu_bar - Omega * mu, the same as table 12.3 but with the heading of mu_bar wrapped
+    localInfoVector.noalias() -= localInfo * localMean;
+    localMean.head<NumModelStates>() += delta;
+    localMean(2) = normalizeAngle(localMean(2));
+    localInfoVector.noalias() += localNewInfo * localMean;
+    localInfo.swap(localNewInfo);
+    scatterLocal();
+
+    bVariancesValid = false;
+    EKF_TRACE(TRACE_PREDICT, NumModelStates + NumComponents*landmarks.size(), linVel, angVel, deltaT, robotMean(2));
+}
+
+int SeifSlam::rewind(double stamp)
+{
+    if(stamp < lastPredictStamp)
+    {
+        numLate += 1;
+    }
+    return 0;
+}
+
+int SeifSlam::update(const std::vector<LandmarkObservation> &observations)
+{
+    int numUsed = 0;
+    for(int i = 0; i < observations.size(); ++i)
+    {
+        const LandmarkObservation &obs = observations[i];
+        std::unordered_map<int, int>::const_iterator it = landmarkSlots.find(obs.landmarkId);
+        int slot;
+        if(it == landmarkSlots.end())
+        {
+            double landX, landY;
+            landmarkFromObservation(obs.range, obs.bearing, landX, landY);
+            slot = addLandmark(obs.landmarkId, landX, landY);
+        }
+        else
+        {
+            slot = it->second;
+        }
+        numUsed += correct(slot, obs.range, obs.bearing);
+    }
+
+    sparsify();
+    recoverMeans();
+    bVariancesValid = false;
+    return numUsed;
+}
+
+// Measurement update (table 12.4). All observations of a frame are linearized at the same means, so that the frame
+// is fused jointly, like EkfSlam::correctBatch().
+bool SeifSlam::correct(int slot, double range, double bearing)
+{
+    Landmark &lm = landmarks[slot];
+    double delx = lm.mean(0) - robotMean(0);
+    double dely = lm.mean(1) - robotMean(1);
+    double q = delx*delx + dely*dely;
+    if(q < std::numeric_limits<double>::epsilon())
+    {
+        std::cout << "Landmark on top of the robot, correction skipped: " << landmarkIds[slot] << std::endl;
+        return false;
+    }
+    double sqrtQ = std::sqrt(q);
+
+    // Same model and Jacobian wrt (x, y, th, mx, my) as EkfSlam::observationModel()
+    Eigen::Vector2d innovation(range - sqrtQ, normalizeAngle(bearing - (std::atan2(dely, delx) - robotMean(2))));
+    Eigen::Matrix<double, NumComponents, NumModelStates + NumComponents> H;
+    H <<
+        -sqrtQ*delx , -sqrtQ*dely , 0  , sqrtQ*delx , sqrtQ*dely ,
+        dely        , -delx       , -q , -dely      , delx;
+    H *= (1/q);
+
+    Eigen::Matrix<double, NumModelStates + NumComponents, 1> mu;
+    mu << robotMean, lm.mean;
+    Eigen::Matrix<double, NumModelStates + NumComponents, NumComponents> HtQinv = H.transpose() * QsensorInfo;
+    Eigen::Matrix<double, NumModelStates + NumComponents, NumModelStates + NumComponents> infoAdd = HtQinv * H;
+    Eigen::Matrix<double, NumModelStates + NumComponents, 1> infoVectorAdd = HtQinv * (innovation + H * mu);
+
+    robotInfo += infoAdd.topLeftCorner<NumModelStates, NumModelStates>();
+    lm.robotLink += infoAdd.topRightCorner<NumModelStates, NumComponents>();
+    lm.info += infoAdd.bottomRightCorner<NumComponents, NumComponents>();
+    robotInfoVector += infoVectorAdd.head<NumModelStates>();
+    lm.infoVector += infoVectorAdd.tail<NumComponents>();
+    activate(slot);
+    EKF_TRACE(TRACE_CORRECT, landmarkIds[slot], innovation(0), innovation(1), 0, NumModelStates + NumComponents*landmarks.size());
+    return true;
+}
+
+// Moves slot to the back of the active landmarks, as the one seen last
+void SeifSlam::activate(int slot)
+{
+    Landmark &lm = landmarks[slot];
+    if(lm.bActive)
+    {
+        activeSlots.erase(std::find(activeSlots.begin(), activeSlots.end(), slot));
+    }
+    lm.bActive = true;
+    activeSlots.push_back(slot);
+}
+
+// Sparsification (table 12.5). The landmarks beyond maxActive that were seen longest ago (m0) lose their robot links.
+// The posterior p(x, m) = p(x | m) p(m) is approximated by p(x | m+, m- = mu-) p(m), where m+ are the landmarks that
+// stay active and m- the passive ones. In information form that is
+//   Omega~ = C + A - B
+// with all three from the local block of the robot, m+ and m0, which conditions on m- at their means:
+//   A  robot and m+, with m0 marginalized out
+//   B  m+, with the robot and m0 marginalized out          (A - B is p(x | m+, m-))
+//   C  m+ and m0, with the robot marginalized out          (p(m), the rest of Omega doesn't change)
+// and xi~ = xi + (Omega~ - Omega) * mu. Costs a few factorizations of at most 3 + 2*(maxActive+numCut) states.
+void SeifSlam::sparsify()
+{
+    int numCut = activeSlots.size() - maxActive;
+    if(numCut <= 0)
+    {
+        return;
+    }
+
+    // Local block ordered robot, m+, m0
+    localSlots.assign(activeSlots.begin() + numCut, activeSlots.end());
+    localSlots.insert(localSlots.end(), activeSlots.begin(), activeSlots.begin() + numCut);
+    gatherLocal();
+    int n = localInfo.rows();
+    int numKept = NumModelStates + NumComponents*maxActive;
+    int numKeptLandmarkStates = numKept - NumModelStates;
+    int numCutStates = n - numKept;
+
+    // A = Omega_kk - Omega_kc * Omega_cc^-1 * Omega_ck, with k the robot and m+, c m0
+    localLdlt.compute(localInfo.bottomRightCorner(numCutStates, numCutStates));
+    localGain = localLdlt.solve(localInfo.bottomLeftCorner(numCutStates, numKept));
+    localMarginal = localInfo.topLeftCorner(numKept, numKept);
+    localMarginal.noalias() -= localInfo.topRightCorner(numKept, numCutStates) * localGain;
+
+    // C = Omega - Omega_:r * Omega_rr^-1 * Omega_r:, whose robot rows and columns are zero
+    Eigen::Matrix3d robotInfoInv = localInfo.topLeftCorner<NumModelStates, NumModelStates>().inverse();
+    localRobotCols = localInfo.leftCols<NumModelStates>();
+    localNewInfo = localInfo;
+    localNewInfo.noalias() -= localRobotCols * robotInfoInv * localRobotCols.transpose();
+    localNewInfo.topRows<NumModelStates>().setZero();
+    localNewInfo.leftCols<NumModelStates>().setZero();
+
+    // + A - B, with B = A_pp - A_pr * A_rr^-1 * A_rp, ie. A - B is A with A_pp replaced by A_pr * A_rr^-1 * A_rp
+    Eigen::Matrix3d marginalRobotInv = localMarginal.topLeftCorner<NumModelStates, NumModelStates>().inverse();
+    localRobotCols = localMarginal.bottomLeftCorner(numKeptLandmarkStates, NumModelStates);
+    localMarginal.bottomRightCorner(numKeptLandmarkStates, numKeptLandmarkStates).noalias() =
+        localRobotCols * marginalRobotInv * localRobotCols.transpose();
+    localNewInfo.topLeftCorner(numKept, numKept) += localMarginal;
+
+    localInfoVector.noalias() += localNewInfo * localMean;
+    localInfoVector.noalias() -= localInfo * localMean;
+    localInfo.swap(localNewInfo);
+
+    for(int i = 0; i < numCut; ++i)
+    {
+        landmarks[activeSlots[i]].bActive = false;
+    }
+    activeSlots.erase(activeSlots.begin(), activeSlots.begin() + numCut);
+    scatterLocal();
+}
+
+// Amortized mean recovery. The robot and the active landmarks are solved for exactly from their local block,
+//   Omega_LL * mu_L = xi_L - Omega_LP * mu_P
+// with the passive landmarks P held at their means (the robot has no links to them). Then numRelaxPerStep passive
+// landmarks get one Gauss-Seidel step each, mu_m = Omega_mm^-1 * (xi_m - sum_k Omega_mk * mu_k).
+void SeifSlam::recoverMeans()
+{
+    localSlots = activeSlots;
+    gatherLocal();
+    for(int i = 0; i < localSlots.size(); ++i)
+    {
+        int idx = NumModelStates + NumComponents*i;
+        const LinkList &links = landmarks[localSlots[i]].links;
+        for(int k = 0; k < links.size(); ++k)
+        {
+            if(!landmarks[links[k].slot].bActive)
+            {
+                localInfoVector.segment<NumComponents>(idx) -= links[k].info * landmarks[links[k].slot].mean;
+            }
+        }
+    }
+    localLdlt.compute(localInfo);
+    if(localLdlt.info() == Eigen::Success)
+    {
+        localMean = localLdlt.solve(localInfoVector);
+        robotMean = localMean.head<NumModelStates>();
+        for(int i = 0; i < localSlots.size(); ++i)
+        {
+            landmarks[localSlots[i]].mean = localMean.segment<NumComponents>(NumModelStates + NumComponents*i);
+        }
+        wrapRobotHeading();
+    }
+
+    int numLandmarks = landmarks.size();
+    for(int i = 0; i < std::min(numRelaxPerStep, numLandmarks); ++i)
+    {
+        Landmark &lm = landmarks[nextRelaxSlot];
+        nextRelaxSlot = (nextRelaxSlot + 1) % numLandmarks;
+        if(lm.bActive)
+        {
+            continue;
+        }
+        Eigen::Vector2d rhs = lm.infoVector;
+        for(int k = 0; k < lm.links.size(); ++k)
+        {
+            rhs -= lm.links[k].info * landmarks[lm.links[k].slot].mean;
+        }
+        lm.mean = lm.info.inverse() * rhs;
+    }
+}
+
+// The recovered heading can come out just beyond +-PI. Wrapping it moves mu, so xi = Omega * mu moves along
+// the th column of Omega, which is only non-zero for the robot and the active landmarks.
+void SeifSlam::wrapRobotHeading()
+{
+    double wrapped = normalizeAngle(robotMean(2));
+    double shift = wrapped - robotMean(2);
+    if(shift == 0)
+    {
+        return;
+    }
+    robotMean(2) = wrapped;
+    robotInfoVector += robotInfo.col(2) * shift;
+    for(int i = 0; i < activeSlots.size(); ++i)
+    {
+        Landmark &lm = landmarks[activeSlots[i]];
+        lm.infoVector += lm.robotLink.row(2).transpose() * shift;
+    }
+}
+
+Eigen::Ref<const Eigen::VectorXd> SeifSlam::getStates()
+{
+    states.resize(NumModelStates + NumComponents*landmarks.size());
+    states.head<NumModelStates>() = robotMean;
+    for(int i = 0; i < landmarks.size(); ++i)
+    {
+        states.segment<NumComponents>(NumModelStates + NumComponents*i) = landmarks[i].mean;
+    }
+    return states;
+}
+
+Eigen::Ref<const Eigen::MatrixXd> SeifSlam::getVariances()
+{
+    if(bVariancesValid)
+    {
+        return variances;
+    }
+
+    // Dense Omega in the variances storage, then inverted in place
+    int n = NumModelStates + NumComponents*landmarks.size();
+    variances.setZero(n, n);
+    variances.topLeftCorner<NumModelStates, NumModelStates>() = robotInfo;
+    for(int i = 0; i < landmarks.size(); ++i)
+    {
+        const Landmark &lm = landmarks[i];
+        int idx = NumModelStates + NumComponents*i;
+        variances.block<NumModelStates, NumComponents>(0, idx) = lm.robotLink;
+        variances.block<NumComponents, NumModelStates>(idx, 0) = lm.robotLink.transpose();
+        variances.block<NumComponents, NumComponents>(idx, idx) = lm.info;
+        for(int k = 0; k < lm.links.size(); ++k)
+        {
+            variances.block<NumComponents, NumComponents>(idx, NumModelStates + NumComponents*lm.links[k].slot) = lm.links[k].info;
+        }
+    }
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(variances);
+    variances.setIdentity();
+    ldlt.solveInPlace(variances);
+    bVariancesValid = true;
+    return variances;
+}
+
+Eigen::Matrix3d SeifSlam::getRobotVariances()
+{
+    localSlots = activeSlots;
+    gatherLocal();
+    localLdlt.compute(localInfo);
+    localRobotCols.setIdentity(localInfo.rows(), NumModelStates);
+    localLdlt.solveInPlace(localRobotCols);
+    return localRobotCols.topRows<NumModelStates>();
+}
+
+void SeifSlam::getLandmarkMarginals(Eigen::MatrixXd &marginals)
+{
+    marginals.resize(NumComponents, NumComponents*landmarks.size());
+    for(int slot = 0; slot < landmarks.size(); ++slot)
+    {
+        const LinkList &links = landmarks[slot].links;
+        localSlots.resize(1 + links.size());
+        localSlots[0] = slot;
+        for(int k = 0; k < links.size(); ++k)
+        {
+            localSlots[1 + k] = links[k].slot;
+        }
+        gatherLocal();
+        localLdlt.compute(localInfo);
+        localMarginal.setZero(localInfo.rows(), NumComponents);
+        localMarginal.block<NumComponents, NumComponents>(NumModelStates, 0).setIdentity();
+        localLdlt.solveInPlace(localMarginal);
+        marginals.block<NumComponents, NumComponents>(0, NumComponents*slot) =
+            localMarginal.block<NumComponents, NumComponents>(NumModelStates, 0);
+    }
+}
+
+int SeifSlam::getNumLinks() const
+{
+    int numLinks = 0;
+    for(int i = 0; i < landmarks.size(); ++i)
+    {
+        numLinks += landmarks[i].links.size();
+    }
+    return numLinks / 2;
+}
+
+void SeifSlam::display() const
+{
+    std::cout << "numModelStates " << (int)NumModelStates << std::endl;
+    std::cout << "numLandmarks " << landmarks.size() << std::endl;
+    std::cout << "maxActive " << maxActive << std::endl;
+    std::cout << "numActive " << activeSlots.size() << std::endl;
+    std::cout << "numLinks " << getNumLinks() << std::endl;
+    std::cout << "numRelaxPerStep " << numRelaxPerStep << std::endl;
+    std::cout << "landmarkPriorVariance " << landmarkPriorVariance << std::endl;
+    std::cout << "robotMean " << robotMean.transpose() << std::endl;
+    std::cout << "robotInfo " << robotInfo << std::endl;
+    std::cout << "RmotionCovar " << RmotionCovar << std::endl;
+    std::cout << "QsensorInfo " << QsensorInfo << std::endl;
+}
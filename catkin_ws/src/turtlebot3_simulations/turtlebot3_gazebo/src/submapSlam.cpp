@@ -0,0 +1,529 @@
+#include "turtlebot3_gazebo/submap_slam.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+
+
+// Pose composition a (+) b, ie. pose b given relative to pose a, in the frame of a
+static Eigen::Vector3d composePose(const Eigen::Vector3d &a, const Eigen::Vector3d &b)
+{
+    double c = std::cos(a(2));
+    double s = std::sin(a(2));
+    return Eigen::Vector3d(a(0) + c*b(0) - s*b(1), a(1) + s*b(0) + c*b(1), normalizeAngle(a(2) + b(2)));
+}
+
+// Jacobians of a (+) b wrt a and b
+static void composePoseJacobians(const Eigen::Vector3d &a, const Eigen::Vector3d &b, Eigen::Matrix3d &Ja, Eigen::Matrix3d &Jb)
+{
+    double c = std::cos(a(2));
+    double s = std::sin(a(2));
+    Ja << 1 , 0 , -s*b(0) - c*b(1) ,
+          0 , 1 , c*b(0) - s*b(1)  ,
+          0 , 0 , 1;
+    Jb << c , -s , 0 ,
+          s , c  , 0 ,
+          0 , 0  , 1;
+}
+
+// Jacobians of a point m given in the frame of pose a, moved to the frame a is in, wrt a and m
+static void pointJacobians(const Eigen::Vector3d &a, const Eigen::Vector2d &m, Eigen::Matrix<double, 2, 3> &Ja, Eigen::Matrix2d &Jm)
+{
+    double c = std::cos(a(2));
+    double s = std::sin(a(2));
+    Ja << 1 , 0 , -s*m(0) - c*m(1) ,
+          0 , 1 , c*m(0) - s*m(1);
+    Jm << c , -s ,
+          s , c;
+}
+
+
+SubmapSlam::SubmapSlam(int initialCapacity, int historySize, int maxLandmarks, double maxDistance) :
+ekf(std::min(initialCapacity, maxLandmarks)),
+history(historySize),
+maxLandmarks(std::max(maxLandmarks, 1)),
+maxDistance(maxDistance),
+distance(0),
+baseMean(Eigen::Vector3d::Zero()),
+baseVariances(Eigen::Matrix3d::Zero()),
+numFinished(0),
+bStopping(false)
+{
+    std::shared_ptr<Submap> global = std::make_shared<Submap>();
+    global->index = 0;
+    global->states = Eigen::VectorXd::Zero(3);
+    global->variances = Eigen::MatrixXd::Zero(3, 3);
+    std::atomic_store(&joined, SubmapPtr(global));
+    joinedSeen = global;
+    joinThread = std::thread(&SubmapSlam::joinLoop, this);
+}
+
+// Joins what is still queued, so that no submap gets lost
+SubmapSlam::~SubmapSlam()
+{
+    {
+        std::lock_guard<std::mutex> lock(joinMutex);
+        bStopping = true;
+    }
+    joinCondition.notify_all();
+    joinThread.join();
+}
+
+void SubmapSlam::setRobotPose(double x, double y, double th)
+{
+    baseMean << x, y, th;
+    if(numFinished == 0)
+    {
+        std::shared_ptr<Submap> global = std::make_shared<Submap>(*joinedSeen);
+        global->states.head<3>() = baseMean;
+        std::atomic_store(&joined, SubmapPtr(global));
+        joinedSeen = global;
+    }
+}
+
+void SubmapSlam::toWorld(const Eigen::Vector3d &base, double localX, double localY, double &x, double &y) const
+{
+    double c = std::cos(base(2));
+    double s = std::sin(base(2));
+    x = base(0) + c*localX - s*localY;
+    y = base(1) + s*localX + c*localY;
+}
+
+void SubmapSlam::landmarkFromObservation(double range, double bearing, double &landX, double &landY) const
+{
+    double localX, localY;
+    ekf.landmarkFromObservation(range, bearing, localX, localY);
+    toWorld(baseMean, localX, localY, landX, landY);
+}
+
+int SubmapSlam::assignSlot(int landmarkId)
+{
+    std::unordered_map<int, int>::const_iterator it = globalSlots.find(landmarkId);
+    if(it != globalSlots.end())
+    {
+        return it->second;
+    }
+    int slot = globalIds.size();
+    globalSlots[landmarkId] = slot;
+    globalIds.push_back(landmarkId);
+    return slot;
+}
+
+// Global slots of the landmarks added to the current submap since the last call
+void SubmapSlam::syncCurrentSlots()
+{
+    const std::vector<int> &localIds = ekf.getLandmarkIds();
+    for(int i = currentSlots.size(); i < localIds.size(); ++i)
+    {
+        currentSlots.push_back(assignSlot(localIds[i]));
+    }
+}
+
+int SubmapSlam::addLandmark(int landmarkId, double landX, double landY)
+{
+    // World frame to the current submap, base^-1 (+) m
+    double c = std::cos(baseMean(2));
+    double s = std::sin(baseMean(2));
+    double dx = landX - baseMean(0);
+    double dy = landY - baseMean(1);
+    if(ekf.addLandmark(landmarkId, c*dx + s*dy, -s*dx + c*dy) < 0)
+    {
+        return -1;
+    }
+    syncCurrentSlots();
+    return globalSlots[landmarkId];
+}
+
+void SubmapSlam::predict(double stamp, double linVel, double angVel, double deltaT)
+{
+    syncJoined();
+    if(distance >= maxDistance)
+    {
+        finishSubmap();
+    }
+    history.predict(ekf, stamp, linVel, angVel, deltaT);
+    distance += std::abs(linVel*deltaT);
+}
+
+// Landmarks seen before in another submap are added to the current one again, at their observed position. The
+// join fuses the two estimates.
+int SubmapSlam::update(const std::vector<LandmarkObservation> &observations)
+{
+    syncJoined();
+    int numUsed = ekf.update(observations);
+    syncCurrentSlots();
+    if(ekf.getNumLandmarks() >= maxLandmarks)
+    {
+        finishSubmap();
+    }
+    return numUsed;
+}
+
+// Hands the current submap to the join thread and starts a new one at the robot pose. If this happens between a
+// rewind() and replay(), the predictions undone are applied again on the new submap, after the late marker.
+void SubmapSlam::finishSubmap()
+{
+    std::shared_ptr<Submap> done = std::make_shared<Submap>();
+    done->index = numFinished;
+    done->states = ekf.getStates();
+    done->variances = ekf.getVariances();
+    done->landmarkIds = ekf.getLandmarkIds();
+    done->landmarkSlots = currentSlots;
+    done->baseMean = baseMean;
+    done->baseVariances = baseVariances;
+
+    Eigen::Matrix3d Ja, Jb;
+    Eigen::Vector3d robot = done->states.head<3>();
+    composePoseJacobians(baseMean, robot, Ja, Jb);
+    baseMean = composePose(baseMean, robot);
+    baseVariances = Ja * baseVariances * Ja.transpose() + Jb * done->variances.topLeftCorner<3, 3>() * Jb.transpose();
+
+    pending.push_back(done);
+    {
+        std::lock_guard<std::mutex> lock(joinMutex);
+        toJoin.push_back(done);
+    }
+    joinCondition.notify_all();
+
+    numFinished += 1;
+    ekf.reset(0, 0, 0);
+    currentSlots.clear();
+    history.replay(ekf);
+    distance = 0;
+}
+
+// Picks up the latest global map from the join thread
+void SubmapSlam::syncJoined()
+{
+    SubmapPtr global = std::atomic_load(&joined);
+    if(global == joinedSeen)
+    {
+        return;
+    }
+    joinedSeen = global;
+    while(!pending.empty() && pending.front()->index < global->index)
+    {
+        pending.pop_front();
+    }
+    if(pending.empty())
+    {
+        // Everything finished is joined, so the end of the global map is the base of the current submap, now
+        // corrected by the landmarks the submaps had in common
+        baseMean = global->states.head<3>();
+        baseVariances = global->variances.topLeftCorner<3, 3>();
+    }
+
+    int numSlots = 0;
+    for(int i = 0; i < global->landmarkSlots.size(); ++i)
+    {
+        numSlots = std::max(numSlots, global->landmarkSlots[i] + 1);
+    }
+    joinedStates.setZero(2*numSlots);
+    bJoinedSlots.assign(numSlots, false);
+    for(int i = 0; i < global->landmarkSlots.size(); ++i)
+    {
+        int slot = global->landmarkSlots[i];
+        joinedStates.segment<2>(2*slot) = global->states.segment<2>(3 + 2*i);
+        bJoinedSlots[slot] = true;
+    }
+}
+
+void SubmapSlam::joinLoop()
+{
+    while(true)
+    {
+        SubmapPtr local;
+        {
+            std::unique_lock<std::mutex> lock(joinMutex);
+            joinCondition.wait(lock, [this] { return bStopping || !toJoin.empty(); });
+            if(toJoin.empty())
+            {
+                return;
+            }
+            local = toJoin.front();
+            toJoin.pop_front();
+        }
+
+        std::shared_ptr<Submap> global = std::make_shared<Submap>(*std::atomic_load(&joined));
+        joinMaps(*global, *local);
+        global->index = local->index + 1;
+        std::atomic_store(&joined, SubmapPtr(global));
+        {
+            std::lock_guard<std::mutex> lock(joinMutex); // So that waitForJoins() can't miss the notification
+        }
+        joinCondition.notify_all();
+    }
+}
+
+void SubmapSlam::waitForJoins()
+{
+    {
+        std::unique_lock<std::mutex> lock(joinMutex);
+        joinCondition.wait(lock, [this] { return std::atomic_load(&joined)->index >= numFinished; });
+    }
+    syncJoined();
+}
+
+// Sequential map joining. With B the pose at the end of the global map G and L the local map in B's frame:
+//   robot     B (+) r_L                    the new end of the global map
+//   G landmarks as they are
+//   L landmarks B (+) m_L
+// The two maps are independent, so P = A * P_G * A^T + R * P_L * R^T, where A only mixes the B rows of P_G into the
+// new rows and R is block diagonal (rotations). Both are applied by blocks, in O(N^2).
+// Landmarks in both maps are then fused by an ideal measurement m_G - (B (+) m_L) = 0 of all of them at once, and
+// the local copies removed.
+void SubmapSlam::joinMaps(Submap &global, const Submap &local)
+{
+    int nG = global.states.size();
+    int nL = local.states.size();
+    int numLocalLandmarks = (nL - 3)/2;
+    int n = nG + nL - 3;
+    Eigen::Vector3d base = global.states.head<3>();
+
+    Eigen::VectorXd x(n);
+    Eigen::Matrix3d Ja, Jb;
+    Eigen::Vector3d robot = local.states.head<3>();
+    x.head<3>() = composePose(base, robot);
+    composePoseJacobians(base, robot, Ja, Jb);
+    x.segment(3, nG - 3) = global.states.tail(nG - 3);
+
+    std::vector<Eigen::Matrix<double, 2, 3>, Eigen::aligned_allocator<Eigen::Matrix<double, 2, 3> > > Jm(numLocalLandmarks);
+    Eigen::Matrix2d rot;
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        Eigen::Vector2d m = local.states.segment<2>(3 + 2*i);
+        pointJacobians(base, m, Jm[i], rot);
+        x.segment<2>(nG + 2*i) = base.head<2>() + rot * m;
+    }
+
+    // M = A * P_G, then P = M * A^T
+    Eigen::MatrixXd M(n, nG);
+    M.topRows(3) = Ja * global.variances.topRows(3);
+    M.middleRows(3, nG - 3) = global.variances.bottomRows(nG - 3);
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        M.middleRows(nG + 2*i, 2) = Jm[i] * global.variances.topRows(3);
+    }
+    Eigen::MatrixXd P(n, n);
+    P.leftCols(3) = M.leftCols(3) * Ja.transpose();
+    P.middleCols(3, nG - 3) = M.rightCols(nG - 3);
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        P.middleCols(nG + 2*i, 2) = M.leftCols(3) * Jm[i].transpose();
+    }
+
+    // + R * P_L * R^T. The local robot goes to rows 0-2, the local landmarks to rows nG onwards
+    Eigen::MatrixXd RPL = local.variances;
+    RPL.topRows(3) = Jb * local.variances.topRows(3);
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        RPL.middleRows(3 + 2*i, 2) = rot * local.variances.middleRows(3 + 2*i, 2);
+    }
+    RPL.leftCols(3) = RPL.leftCols(3) * Jb.transpose();
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        RPL.middleCols(3 + 2*i, 2) = RPL.middleCols(3 + 2*i, 2) * rot.transpose();
+    }
+    P.topLeftCorner(3, 3) += RPL.topLeftCorner(3, 3);
+    P.block(0, nG, 3, nL - 3) += RPL.topRightCorner(3, nL - 3);
+    P.block(nG, 0, nL - 3, 3) += RPL.bottomLeftCorner(nL - 3, 3);
+    P.bottomRightCorner(nL - 3, nL - 3) += RPL.bottomRightCorner(nL - 3, nL - 3);
+
+    // Landmarks in both maps: (state index in G, state index of the local copy)
+    std::unordered_map<int, int> globalIdx;
+    for(int i = 0; i < global.landmarkSlots.size(); ++i)
+    {
+        globalIdx[global.landmarkSlots[i]] = 3 + 2*i;
+    }
+    std::vector<int> dupGlobal, dupLocal;
+    std::vector<bool> bKeep(n, true);
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        std::unordered_map<int, int>::const_iterator it = globalIdx.find(local.landmarkSlots[i]);
+        if(it != globalIdx.end())
+        {
+            dupGlobal.push_back(it->second);
+            dupLocal.push_back(nG + 2*i);
+            bKeep[nG + 2*i] = bKeep[nG + 2*i + 1] = false;
+        }
+    }
+
+    int numDup = dupGlobal.size();
+    if(numDup > 0)
+    {
+        // H picks m_G - m_L, so PHt = P * H^T and S = H * P * H^T come straight from the columns and rows of P
+        Eigen::MatrixXd PHt(n, 2*numDup);
+        Eigen::VectorXd innovation(2*numDup);
+        for(int k = 0; k < numDup; ++k)
+        {
+            PHt.middleCols(2*k, 2) = P.middleCols(dupGlobal[k], 2) - P.middleCols(dupLocal[k], 2);
+            innovation.segment<2>(2*k) = x.segment<2>(dupLocal[k]) - x.segment<2>(dupGlobal[k]);
+        }
+        Eigen::MatrixXd S(2*numDup, 2*numDup);
+        for(int k = 0; k < numDup; ++k)
+        {
+            S.middleRows(2*k, 2) = PHt.middleRows(dupGlobal[k], 2) - PHt.middleRows(dupLocal[k], 2);
+        }
+        Eigen::LDLT<Eigen::MatrixXd> ldlt(S);
+        if(ldlt.info() == Eigen::Success && ldlt.isPositive())
+        {
+            Eigen::MatrixXd Kt = ldlt.solve(PHt.transpose());
+            x.noalias() += Kt.transpose() * innovation;
+            P.noalias() -= PHt * Kt;
+        }
+        else
+        {
+            std::cout << "Submap join: common landmarks not fused, ill conditioned" << std::endl;
+        }
+    }
+
+    // Drop the local copies of the common landmarks
+    std::vector<int> keep;
+    keep.reserve(n);
+    for(int i = 0; i < n; ++i)
+    {
+        if(bKeep[i])
+        {
+            keep.push_back(i);
+        }
+    }
+    global.states.resize(keep.size());
+    global.variances.resize(keep.size(), keep.size());
+    for(int j = 0; j < keep.size(); ++j)
+    {
+        global.states(j) = x(keep[j]);
+        for(int i = 0; i < keep.size(); ++i)
+        {
+            global.variances(i, j) = P(keep[i], keep[j]);
+        }
+    }
+    for(int i = 0; i < numLocalLandmarks; ++i)
+    {
+        if(bKeep[nG + 2*i])
+        {
+            global.landmarkIds.push_back(local.landmarkIds[i]);
+            global.landmarkSlots.push_back(local.landmarkSlots[i]);
+        }
+    }
+}
+
+static bool isSlotJoined(const std::vector<bool> &bJoinedSlots, int slot)
+{
+    return slot < bJoinedSlots.size() && bJoinedSlots[slot];
+}
+
+Eigen::Ref<const Eigen::VectorXd> SubmapSlam::getStates()
+{
+    int numSlots = globalIds.size();
+    states.resize(3 + 2*numSlots);
+    states.head<3>() = composePose(baseMean, ekf.getStates().head<3>());
+    states.segment(3, joinedStates.size()) = joinedStates;
+
+    // Landmarks not joined yet, from the latest submap that has them
+    for(int p = 0; p < pending.size(); ++p)
+    {
+        const Submap &submap = *pending[p];
+        for(int i = 0; i < submap.landmarkSlots.size(); ++i)
+        {
+            int slot = submap.landmarkSlots[i];
+            if(!isSlotJoined(bJoinedSlots, slot))
+            {
+                toWorld(submap.baseMean, submap.states(3 + 2*i), submap.states(4 + 2*i), states(3 + 2*slot), states(4 + 2*slot));
+            }
+        }
+    }
+    Eigen::Ref<const Eigen::VectorXd> localStates = ekf.getStates();
+    for(int i = 0; i < currentSlots.size(); ++i)
+    {
+        int slot = currentSlots[i];
+        if(!isSlotJoined(bJoinedSlots, slot))
+        {
+            toWorld(baseMean, localStates(3 + 2*i), localStates(4 + 2*i), states(3 + 2*slot), states(4 + 2*slot));
+        }
+    }
+    return states;
+}
+
+Eigen::Ref<const Eigen::MatrixXd> SubmapSlam::getVariances()
+{
+    int n = 3 + 2*globalIds.size();
+    variances.setZero(n, n);
+
+    // Global map landmarks with their cross terms. Their slots are in the order they were joined, so normally
+    // this is one block copy.
+    const Submap &global = *joinedSeen;
+    int numJoined = global.landmarkSlots.size();
+    bool bInOrder = true;
+    for(int i = 0; i < numJoined; ++i)
+    {
+        bInOrder = bInOrder && global.landmarkSlots[i] == i;
+    }
+    if(bInOrder)
+    {
+        variances.block(3, 3, 2*numJoined, 2*numJoined) = global.variances.bottomRightCorner(2*numJoined, 2*numJoined);
+    }
+    else
+    {
+        for(int i = 0; i < numJoined; ++i)
+        {
+            for(int j = 0; j < numJoined; ++j)
+            {
+                variances.block<2, 2>(3 + 2*global.landmarkSlots[i], 3 + 2*global.landmarkSlots[j]) =
+                    global.variances.block<2, 2>(3 + 2*i, 3 + 2*j);
+            }
+        }
+    }
+
+    // Robot, through the base of the current submap
+    Eigen::Ref<const Eigen::VectorXd> localStates = ekf.getStates();
+    Eigen::Ref<const Eigen::MatrixXd> localVariances = ekf.getVariances();
+    variances.topLeftCorner<3, 3>() = getRobotVariances();
+
+    // Marginals of the landmarks not joined yet
+    Eigen::Matrix<double, 2, 3> Jbase;
+    Eigen::Matrix2d Jm;
+    for(int p = 0; p < pending.size(); ++p)
+    {
+        const Submap &submap = *pending[p];
+        for(int i = 0; i < submap.landmarkSlots.size(); ++i)
+        {
+            int slot = submap.landmarkSlots[i];
+            if(!isSlotJoined(bJoinedSlots, slot))
+            {
+                pointJacobians(submap.baseMean, submap.states.segment<2>(3 + 2*i), Jbase, Jm);
+                variances.block<2, 2>(3 + 2*slot, 3 + 2*slot) = Jbase * submap.baseVariances * Jbase.transpose() +
+                    Jm * submap.variances.block<2, 2>(3 + 2*i, 3 + 2*i) * Jm.transpose();
+            }
+        }
+    }
+    for(int i = 0; i < currentSlots.size(); ++i)
+    {
+        int slot = currentSlots[i];
+        if(!isSlotJoined(bJoinedSlots, slot))
+        {
+            pointJacobians(baseMean, localStates.segment<2>(3 + 2*i), Jbase, Jm);
+            variances.block<2, 2>(3 + 2*slot, 3 + 2*slot) = Jbase * baseVariances * Jbase.transpose() +
+                Jm * localVariances.block<2, 2>(3 + 2*i, 3 + 2*i) * Jm.transpose();
+        }
+    }
+    return variances;
+}
+
+Eigen::Matrix3d SubmapSlam::getRobotVariances()
+{
+    Eigen::Matrix3d Ja, Jb;
+    composePoseJacobians(baseMean, ekf.getStates().head<3>(), Ja, Jb);
+    return Ja * baseVariances * Ja.transpose() + Jb * ekf.getRobotVariances() * Jb.transpose();
+}
+
+void SubmapSlam::display() const
+{
+    std::cout << "maxLandmarks " << maxLandmarks << std::endl;
+    std::cout << "maxDistance " << maxDistance << std::endl;
+    std::cout << "numSubmaps " << numFinished + 1 << std::endl;
+    std::cout << "numPending " << pending.size() << std::endl;
+    std::cout << "numLandmarks " << globalIds.size() << std::endl;
+    std::cout << "baseMean " << baseMean.transpose() << std::endl;
+    ekf.display();
+}
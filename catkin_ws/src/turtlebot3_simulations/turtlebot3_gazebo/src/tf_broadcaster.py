@@ -6,8 +6,11 @@ import rospy
 import tf
 from std_msgs.msg import Float64MultiArray
 from nav_msgs.msg import Odometry
+from std_msgs.msg import Int32MultiArray
 # import turtlesim.msg
 
+landmark_ids = []
+
 def handle_turtle_pose(msg):
     br = tf.TransformBroadcaster()
     br.sendTransform((msg.data[0], msg.data[1], 0),
@@ -16,34 +19,22 @@ def handle_turtle_pose(msg):
                      "base_scan",
                      "start_frame")
 
-    br1 = tf.TransformBroadcaster()
-    br1.sendTransform((msg.data[5], msg.data[6], 0),
-                     tf.transformations.quaternion_from_euler(0, 0, 0),
-                     rospy.Time.now(),
-                     "marker_1",
-                     "start_frame")
-
-
-    br2 = tf.TransformBroadcaster()
-    br2.sendTransform((msg.data[7], msg.data[8], 0),
-                     tf.transformations.quaternion_from_euler(0, 0, 0),
-                     rospy.Time.now(),
-                     "marker_2",
-                     "start_frame")
+    # Landmarks are stored in the order they were first seen, /turtle/landmark_ids gives the aruco id of each one
+    for slot, landmark_id in enumerate(landmark_ids):
+        idx = 3 + 2*slot
+        if idx + 1 >= len(msg.data):
+            break
+        br_marker = tf.TransformBroadcaster()
+        br_marker.sendTransform((msg.data[idx], msg.data[idx+1], 0),
+                         tf.transformations.quaternion_from_euler(0, 0, 0),
+                         rospy.Time.now(),
+                         "marker_%d" % landmark_id,
+                         "start_frame")
 
-    br3 = tf.TransformBroadcaster()
-    br3.sendTransform((msg.data[9], msg.data[10], 0),
-                     tf.transformations.quaternion_from_euler(0, 0, 0),
-                     rospy.Time.now(),
-                     "marker_3",
-                     "start_frame")
 
-    br4 = tf.TransformBroadcaster()
-    br4.sendTransform((msg.data[11], msg.data[12], 0),
-                     tf.transformations.quaternion_from_euler(0, 0, 0),
-                     rospy.Time.now(),
-                     "marker_4",
-                     "start_frame")
+def handle_landmark_ids(msg):
+    global landmark_ids
+    landmark_ids = list(msg.data)
 
 
 def handle_turtle_pose_odom(msg):
@@ -68,6 +59,10 @@ if __name__ == '__main__':
                      Float64MultiArray,
                      handle_turtle_pose)
 
+    rospy.Subscriber('/turtle/landmark_ids',
+                     Int32MultiArray,
+                     handle_landmark_ids)
+
     # rospy.Subscriber('/odom',
     #                  Odometry,
     #                  handle_turtle_pose_odom)